@@ -10,42 +10,656 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <string.h>
+#include <limits.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <ucontext.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <dirent.h>
+#include <time.h>
 #include <execinfo.h>
 #include <pthread.h>
 #include "eCrash.h"
+#include "eCrashRecord.h"
+#include "eCrashBlackBox.h"
 
 #define NIY()    printf("%s: Not Implemented Yet!\n", __FUNCTION__)
 
+/* Extra slots at the end of every frame buffer, so backtrace() has some slack */
+#define FRAME_SLACK 5
+
+/* Size of each chunk of an output buffer */
+#define ECRASH_OUTPUT_CHUNK_SIZE 16384
+
+/* Most chunks gathered into a single writev */
+#define ECRASH_MAX_IOV 64
+
+/* Frames of a profiler sample that are the sampling itself: the handler's, and the signal trampoline's */
+#define PROFILE_SKIP_FRAMES 2
+
+/* Slots looked at for a stack before the sample is dropped */
+#define PROFILE_MAX_PROBES 64
+
+/* Frames of a bt_handler backtrace that are the capture itself: captureBacktrace, bt_handler and the trampoline */
+#define BT_HANDLER_FRAMES 3
+
+/* How long a wall clock sample, and a live dump, wait for the threads' stacks, and how often they look:
+   first soon, then backing off, as threads waiting for a CPU can take a timeslice to answer */
+#define WALL_SAMPLE_WAIT_MS 10
+#define LIVE_DUMP_WAIT_MS 100
+#define BACKTRACE_POLL_NS 20000
+#define BACKTRACE_MAX_POLL_NS 1000000
+
+/* Frames a wall clock sample unwinds: the capture's, those kept, and one more to tell a deeper stack */
+#define WALL_SAMPLE_FRAMES (BT_HANDLER_FRAMES + ECRASH_PROFILE_MAX_FRAMES + 1)
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
 static eCrashParameters gbl_params;
-static int gbl_fd = -1;
 
-static int gbl_backtraceEntries;
-static void **gbl_backtraceBuffer;
-static char **gbl_backtraceSymbols;
-static int gbl_backtraceDoneFlag = 0;
+/*
+ * The crash arena.
+ *
+ * Everything the crash path touches is carved out of this single mapping
+ * at init time (and pre-faulted), so the handler never has to allocate.
+ * Allocations are never freed individually: the whole arena goes away in
+ * eCrash_Uninit.
+ */
+static char *gbl_arenaBase = NULL;
+static size_t gbl_arenaSize = 0;
+static size_t gbl_arenaUsed = 0;
+
+/*
+ * A captured stack
+ */
+typedef struct
+{
+    void **frames;
+    int entries;
+} Backtrace;
+
+/* The offending thread's backtrace */
+static Backtrace gbl_crashBacktrace;
+
+/* Room for the memory snapshot (see eCrashParameters.memorySnapshotSize) */
+static unsigned char *gbl_memorySnapshot = NULL;
+
+/*
+ * Output buffers.
+ *
+ * Text is formatted into a chain of chunks taken from the crash arena.
+ * The chain grows a chunk at a time as needed (chunks are kept and
+ * reused after a flush), so no line is ever too long.  If the arena runs
+ * dry, the buffer's flush hook is called to make room.
+ */
+typedef struct output_chunk
+{
+    struct output_chunk *next;
+    size_t len;
+    size_t size;
+    char data[];
+} OutputChunk;
+
+typedef struct output_buffer
+{
+    OutputChunk *head;
+    OutputChunk *tail;
+    size_t chunkSize;
+    void (*flush)(struct output_buffer *buf);
+} OutputBuffer;
+
+/*
+ * Our output destinations, resolved to plain fds at init (a FILE * is
+ * written through its fd, bypassing stdio and its locks).
+ */
+typedef enum
+{
+    SINK_KIND_FILE,     /* Regular file: copy_file_range from the memfd */
+    SINK_KIND_PIPE,     /* Pipe: splice from the memfd */
+    SINK_KIND_OTHER,    /* Socket, tty, ...: sendfile from the memfd */
+    SINK_KIND_COPY      /* None of the above worked: pread and write */
+} SinkKind;
+
+typedef struct
+{
+    int fd;
+    const char *name;
+    int error;      /* What outputWriteStream returns when this sink fails */
+    int stream;     /* Index of the stream feeding us */
+    bool owned;     /* We opened it, so we close it */
+    unsigned int selector;  /* Its bit in eCrash_DumpNow's sink selector */
+    bool idle;      /* Not selected for this live dump */
+    SinkKind kind;
+    off_t pushed;   /* How much of the memfd this sink has been given */
+    bool regular;   /* Regular file: O_NONBLOCK means nothing to it */
+    off_t fileOffset;   /* Slot logs: where this report's slot starts, else -1 */
+    bool socket;    /* Live dumps send to it with MSG_DONTWAIT */
+    int liveFd;     /* Anything else: our own non-blocking open of it, for live dumps, or -1 */
+    int savedFlags; /* fd flags from before we made it non-blocking */
+
+    /* Slot logs: where this report goes (slots is zero for a plain file) */
+    int slots;
+    int slot;
+    unsigned long long slotSeq;
+    unsigned long long limit;   /* Most bytes we may write (zero: no limit) */
+    bool truncated;
+    size_t reserve;             /* Plain files: space kept allocated past the end, for the next report */
+
+    /* Per-sink health and statistics */
+    int failures;
+    bool dropped;
+    bool dropNoted; /* The report says it was dropped */
+    bool timedOut;
+    unsigned long long bytes;
+    long long nanoseconds;
+} OutputSink;
+
+static OutputSink gbl_sinks[ECRASH_MAX_NUM_SINKS];
+static int gbl_numSinks = 0;
+
+/* Set while the calling thread runs a live dump, which writes through the sinks' liveFds */
+static __thread bool tls_liveOutput = false;
+
+/* The crash handler's deadline timer for regular files (see sinkAlarmHandler): a kernel timer id, or -1 */
+static int gbl_sinkTimer = -1;
+
+/*
+ * A mapped file, with all its consecutive mappings
+ */
+#define RESOURCE_PATH_LEN 96
+
+typedef struct
+{
+    unsigned long start;
+    unsigned long end;
+    char path[RESOURCE_PATH_LEN];   /* Cut if longer */
+} ResourceMap;
+
+/*
+ * The process's resource use, from getrusage and /proc/self
+ */
+typedef struct report_resources
+{
+    unsigned long long rssKb;
+    unsigned long long peakRssKb;
+    unsigned long long virtualKb;
+    unsigned long long majorFaults;
+    unsigned long long minorFaults;
+    unsigned int fds;
+    unsigned long long fdLimit;     /* 0 if unlimited */
+    unsigned int threads;
+    unsigned int mappings;
+    unsigned int anonMappings;
+    unsigned long long anonKb;
+    ResourceMap *maps;              /* Mapped files */
+    int numMaps;
+    unsigned int mapsOmitted;       /* Past ECRASH_MAX_RESOURCE_MAPS */
+} ReportResources;
+
+/*
+ * The report, as captured.  Each section is captured once, then handed
+ * to every stream's encoder.
+ */
+typedef struct
+{
+    int signo;
+    pid_t pid;
+    long long time;             /* Seconds since the epoch */
+    bool hasAddress;            /* Whether the signal comes with a fault address */
+    void *address;
+    unsigned long long signature;   /* For crash loop detection, or 0 */
+    unsigned int occurrence;    /* Of this signature, in the current crash loop */
+    unsigned int loopSeconds;   /* Since the loop's first occurrence */
+    const eCrashAnnotation *annotations;    /* Process wide */
+    int numAnnotations;
+    const struct core_exclusion *coreExclusions;
+    int numCoreExclusions;
+    const ReportResources *resources;       /* NULL if not wanted */
+    const struct report_hang *hang;         /* NULL unless the watchdog caught a hang */
+} ReportHeader;
+
+/*
+ * A thread that missed its heartbeat deadline
+ */
+typedef struct report_hang
+{
+    char name[ECRASH_MAX_THREAD_NAME_LEN];
+    unsigned long thread;
+    unsigned int silentMs;      /* Since its last heartbeat */
+    unsigned int deadlineMs;
+} ReportHang;
+
+/*
+ * Memory captured around a crash
+ */
+typedef struct
+{
+    const char *name;           /* "code", "fault" or "stack" */
+    unsigned long address;
+    unsigned int length;        /* Zero if it was unreadable */
+    const unsigned char *bytes;
+} MemoryRegion;
+
+#define NUM_MEMORY_REGIONS 3
+
+/*
+ * A thread's scheduler state and CPU use, from /proc/self/task/<tid>
+ */
+typedef struct
+{
+    char state;                 /* R, S, D, ... */
+    bool spinning;              /* Running, and on the CPU most of the dump */
+    int cpu;                    /* Last CPU it ran on */
+    unsigned long long userMs;
+    unsigned long long systemMs;
+    unsigned long long voluntary;   /* Context switches */
+    unsigned long long involuntary;
+} ThreadSched;
+
+typedef struct
+{
+    const char *name;
+    unsigned long thread;
+    bool offending;
+    bool captured;              /* False if the thread never answered */
+    Backtrace *backtrace;
+    const eCrashBreadcrumb *breadcrumbs;    /* Oldest first */
+    int numBreadcrumbs;
+    const eCrashAnnotation *annotations;
+    int numAnnotations;
+    const MemoryRegion *memory;             /* Offending thread only, for full outputs */
+    int numMemory;
+    const ThreadSched *sched;               /* NULL if it couldn't be read */
+} ReportThread;
+
+/* CLOCK_MONOTONIC at the crash, in ns, to age breadcrumbs against */
+static long long gbl_crashTime = 0;
+
+/* From the crash to the footer, in ns, and what we do next, for the footer */
+static long long gbl_dumpTime = 0;
+static eCrashDisposition gbl_dumpDisposition = ECRASH_DISPOSITION_EXIT;
+
+/* Counters and histograms, summed over every shard */
+typedef struct
+{
+    int numCounters;
+    int numHistograms;
+    const eCrashMetricShard *totals;
+} ReportMetrics;
+
+struct output_stream;
+
+/*
+ * A report encoder: one function per report section.
+ */
+typedef struct
+{
+    void (*header)(struct output_stream *stream, ReportHeader *header);
+    void (*thread)(struct output_stream *stream, ReportThread *thread);
+    void (*metrics)(struct output_stream *stream, ReportMetrics *metrics);
+    void (*sinkDropped)(struct output_stream *stream, OutputSink *sink);
+    void (*footer)(struct output_stream *stream);
+    void (*repeat)(struct output_stream *stream, ReportHeader *header);     /* The whole crash loop record */
+} ReportEncoder;
+
+/*
+ * Streaming LZ compressor (see eCrashRecord.h for the format).
+ *
+ * Its whole workspace comes out of the crash arena at init.  The window
+ * holds up to ECRASH_LZ_WINDOW bytes of history, then the data not yet
+ * compressed (at most a block).
+ */
+#define ECRASH_LZ_HASH_BITS 12
+#define ECRASH_LZ_OUT_SIZE (ECRASH_RECORD_FRAME_HEADER_LEN + 4 + ECRASH_LZ_BOUND(ECRASH_LZ_BLOCK_SIZE) + \
+                            ECRASH_RECORD_FRAME_TRAILER_LEN)
+
+typedef struct
+{
+    unsigned char *window;
+    size_t start;               /* Start of the data not yet compressed */
+    size_t end;                 /* End of the data */
+    uint32_t *hash;             /* Last window position (plus one) of each hash */
+    unsigned char *out;         /* Block frame being built */
+} LzState;
+
+/*
+ * Output streams.
+ *
+ * Sinks that want the same encoding (format, verbosity and compression)
+ * share a stream: the report is encoded once per stream, into the
+ * stream's own buffer, and written from there to each of its sinks.  In memfd mode
+ * the stream writes its memfd once, and the kernel copies it out to the
+ * sinks.  The memfd keeps the whole report, so it can be read back even
+ * if a sink (or the dump) never finishes.
+ */
+typedef struct output_stream
+{
+    eCrashFormat format;
+    eCrashVerbosity verbosity;
+    const ReportEncoder *encoder;
+    OutputBuffer buf;
+    int memfd;
+    off_t memfdLength;
+    uint32_t crc;               /* Binary frame being encoded */
+    LzState *lz;                /* Compressor, for compressed streams */
+} OutputStream;
+
+static OutputStream gbl_streams[ECRASH_MAX_NUM_SINKS];
+static int gbl_numStreams = 0;
+
+/* Our encoders, one per eCrashFormat (defined with the crash handler) */
+static const ReportEncoder gbl_textEncoder;
+static const ReportEncoder gbl_jsonEncoder;
+static const ReportEncoder gbl_binaryEncoder;
+
+/* Bounce buffer for sinks the kernel won't copy to from a memfd */
+static char *gbl_bounceBuffer = NULL;
 
 /* 
- * Private structures for our thread list
+ * Private structures for our thread list.  Threads live in a fixed table
+ * of slots allocated from the arena, so registering never calls malloc,
+ * and each slot owns the buffer its thread's backtrace is captured into.
  */
-typedef struct thread_list_node
+typedef struct
 {
-    char *threadName;
+    volatile int inUse;
+    char threadName[ECRASH_MAX_THREAD_NAME_LEN];
     pthread_t thread;
+    pid_t tid;
+    unsigned long long runnableAtStart; /* Its runnable time (ns) when the dump started, to tell spinners */
+    long long sampledAt;
+    uint64_t heartbeat;             /* Last eCrash_Heartbeat (CLOCK_MONOTONIC, in ns), 0 if none yet */
+    uint64_t hangReported;          /* The heartbeat its last hang was reported after */
+    unsigned int deadlineMs;        /* 0 if not watched */
+    timer_t profileTimer;           /* Its CPU clock's, when profiling */
+    bool profiling;
+    int statFd;                     /* Its /proc stat, for the wall clock sampler, or -1 */
+    int wallRole;                   /* Its wall clock role, -1 until its first sample */
+    char wallState;                 /* In the wall clock sample being taken */
     int backtraceSignal;
     sighandler_t oldHandler;
-    struct thread_list_node *Next;
-} ThreadListNode;
+    Backtrace backtrace;
+    int backtraceDepth;             /* Frames bt_handler unwinds: maxStackDepth, fewer for a wall clock sample */
+    volatile sig_atomic_t backtraceDone;
+    eCrashBlackBoxThread *box;      /* Our record in the black box, or NULL */
+    eCrashBreadcrumbRing *breadcrumbs;      /* In the black box record, if any, or ownBreadcrumbs */
+    eCrashBreadcrumbRing ownBreadcrumbs;
+    eCrashAnnotation *annotations;          /* Likewise, in the black box or ownAnnotations */
+    eCrashAnnotation ownAnnotations[ECRASH_MAX_THREAD_ANNOTATIONS];
+    eCrashMetricShard metrics;
+} ThreadSlot;
 
 static pthread_mutex_t ThreadListMutex = PTHREAD_MUTEX_INITIALIZER;
-static ThreadListNode *ThreadList = NULL;
+static ThreadSlot *ThreadSlots = NULL;
+
+/* Set while the calling thread's live dump holds ThreadListMutex */
+static __thread bool tls_threadListHeld = false;
+
+/* /proc/self/task, opened at init, and the unit of its CPU times */
+static int gbl_taskDirFd = -1;
+static long gbl_clockTicks = 100;
+
+/* For the resource section (dumpResources): /proc/self/status, maps and fd, opened at init */
+static int gbl_procStatusFd = -1;
+static int gbl_procMapsFd = -1;
+static int gbl_procFdDirFd = -1;
+static ResourceMap *gbl_resourceMaps = NULL;
+
+/*
+ * The black box (see eCrashBlackBox.h), or NULL.  Its thread records line
+ * up with ThreadSlots.
+ */
+static eCrashBlackBoxHeader *gbl_blackBox = NULL;
+static size_t gbl_blackBoxSize = 0;
+static char *gbl_blackBoxPath = NULL;
+static bool gbl_blackBoxAtExit = false;
+
+/*
+ * The crash record file (see eCrashParameters.crashRecordFile), or -1,
+ * and the buffer the record is built in.
+ */
+static int gbl_crashRecordFd = -1;
+static unsigned char gbl_crashRecord[ECRASH_CRASH_RECORD_SIZE];
+
+/*
+ * The crash loop file (see eCrashParameters.crashLoopFile), or -1.  It
+ * may be shared by several processes (the restarts of a service, or its
+ * workers), so the crash handler reads it again, and writes it back
+ * whole, under a lock.  Only processes on this host read it, so it is
+ * stored as it is.
+ */
+#define ECRASH_CRASH_LOOP_MAGIC 0x4c434365  /* "eCCL" */
+#define ECRASH_CRASH_LOOP_VERSION 1
+
+/* How long we wait for another process to be done with the crash loop file, before going ahead anyway */
+#define CRASH_LOOP_LOCK_WAIT_MS 1000
+
+typedef struct
+{
+    uint64_t signature;         /* 0 for an empty entry */
+    uint64_t first;             /* Seconds since the epoch, first crash of the current loop */
+    uint64_t last;              /* And the latest */
+    uint32_t count;             /* Crashes in the current loop */
+    uint32_t total;             /* Crashes ever */
+} CrashLoopEntry;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    CrashLoopEntry entries[ECRASH_CRASH_LOOP_SIGNATURES];
+} CrashLoopState;
+
+static int gbl_crashLoopFd = -1;
+static CrashLoopState gbl_crashLoop;
+
+/*
+ * Process wide annotations: in the black box if there is one, or
+ * gbl_ownAnnotations.  The mutex is only taken to claim a slot for a new
+ * key.
+ */
+static pthread_mutex_t AnnotationMutex = PTHREAD_MUTEX_INITIALIZER;
+static eCrashAnnotation *gbl_annotations = NULL;
+static eCrashAnnotation gbl_ownAnnotations[ECRASH_MAX_ANNOTATIONS];
+
+/*
+ * Counter and histogram names.  A name is written before its count is
+ * bumped, so the crash path can read names up to the count without the
+ * lock.  Unregistered threads share one shard; each registered thread
+ * has its own in its slot.
+ */
+static pthread_mutex_t MetricMutex = PTHREAD_MUTEX_INITIALIZER;
+static char gbl_counterNames[ECRASH_MAX_COUNTERS][ECRASH_METRIC_NAME_LEN];
+static int gbl_numCounters = 0;
+static char gbl_histogramNames[ECRASH_MAX_HISTOGRAMS][ECRASH_METRIC_NAME_LEN];
+static int gbl_numHistograms = 0;
+static eCrashMetricShard gbl_metricTotals;
+
+__thread eCrashMetricShard *eCrash_tlsMetrics = NULL;
+eCrashMetricShard eCrash_sharedMetrics;
+
+/*
+ * Ranges left out of core dumps (see eCrash_ExcludeFromCore), page
+ * aligned.  Changed under the mutex; the crash path copies them without
+ * it.
+ */
+typedef struct core_exclusion
+{
+    unsigned long start;
+    unsigned long length;
+    char name[ECRASH_METRIC_NAME_LEN];
+} CoreExclusion;
+
+static pthread_mutex_t CoreMutex = PTHREAD_MUTEX_INITIALIZER;
+static CoreExclusion gbl_coreExclusions[ECRASH_MAX_CORE_EXCLUSIONS];
+static int gbl_numCoreExclusions = 0;
+
+/* The calling thread's slot, so bt_handler knows where to put its stack */
+static __thread ThreadSlot *tls_threadSlot = NULL;
+
+/* And its breadcrumb ring, for eCrash_Breadcrumb */
+__thread eCrashBreadcrumbRing *eCrash_tlsBreadcrumbs = NULL;
+
+/* And its heartbeat, for eCrash_Heartbeat */
+__thread uint64_t *eCrash_tlsHeartbeat = NULL;
+
+/* Bumped by eCrash_Uninit: the slot pointers of a thread registered in an older generation are dangling */
+unsigned int eCrash_generation = 0;
+__thread unsigned int eCrash_tlsGeneration = 0;
+
+/* Set while the crash handler runs */
+static volatile sig_atomic_t gbl_crashing = 0;
+
+/* Live dumps: the thread running one (0 if none), and what wakes the thread that runs triggered ones */
+static pid_t gbl_dumpOwner = 0;
+static int gbl_dumpPipe[2] = { -1, -1 };
+static int gbl_dumpSocketFd = -1;
+static pthread_t gbl_dumpThread;
+static bool gbl_dumpThreadRunning = false;
+static struct sigaction gbl_oldDumpAction;
+
+/* The hang watchdog: role deadlines (copied), its thread, what stops it, and the hang it's aborting for */
+static struct
+{
+    char role[ECRASH_MAX_THREAD_NAME_LEN];
+    unsigned int deadlineMs;
+} gbl_heartbeatRoles[ECRASH_MAX_HEARTBEAT_ROLES];
+static int gbl_numHeartbeatRoles = 0;
+static int gbl_watchdogPipe[2] = { -1, -1 };
+static pthread_t gbl_watchdogThread;
+static bool gbl_watchdogRunning = false;
+static ReportHang gbl_hang;
+static volatile sig_atomic_t gbl_hangAborting = 0;
+
+/*
+ * A stack counted by a profiler.
+ *
+ * The table is open addressed, and filled from signal handlers without
+ * locks: a sampler claims a free entry by moving its key from 0 to 1,
+ * fills it in, then publishes the stack's hash as the key.  Entries are
+ * never freed, so the counts are totals since the profiler started.
+ */
+typedef struct
+{
+    uint64_t key;               /* 0 if free, 1 while being filled in, then the hash (2 or more) */
+    uint64_t count;
+    uint32_t tag;               /* Wall clock samples: role index << 8 | state; 0 for CPU samples */
+    uint32_t numFrames;         /* 0 if the thread never answered */
+    bool truncated;             /* Deeper than we keep: the outer frames are missing */
+    void *frames[ECRASH_PROFILE_MAX_FRAMES];    /* Innermost first */
+} ProfileStack;
+
+typedef struct
+{
+    ProfileStack *stacks;       /* ECRASH_PROFILE_MAX_STACKS of them, or NULL if not running */
+    const char *file;           /* Where it is written out */
+    uint64_t samples;
+    uint64_t dropped;           /* Samples that found no room */
+} ProfileTable;
+
+/* The profilers: CPU and wall clock, and the thread that samples the wall clock and writes both out */
+static ProfileTable gbl_cpuProfile;
+static ProfileTable gbl_wallProfile;
+static int gbl_profilePipe[2] = { -1, -1 };
+static pthread_t gbl_profileThread;
+static pid_t gbl_profileTid = 0;        /* Its tid: when it owns gbl_dumpOwner, it is taking a wall clock sample */
+static bool gbl_profileRunning = false;
+static struct sigaction gbl_oldProfileAction;
+
+/* Wall clock sampler roles, only added to by the profiler thread */
+#define WALL_MAX_ROLES 64
+static char gbl_wallRoles[WALL_MAX_ROLES][ECRASH_MAX_THREAD_NAME_LEN];
+static int gbl_numWallRoles = 0;
+
+/* Our crash signals' actions, as they were before eCrash_Init */
+static struct sigaction gbl_oldCrashActions[ECRASH_MAX_NUM_SIGNALS];
+
+#ifdef ECRASH_MALLOC_POISON
+/*
+ * Debug aid: while the crash handler runs, any call into the allocator is
+ * reported (to stderr, and counted in the crash report) and fails, which
+ * proves the crash path is allocation free.  Outside the handler, calls
+ * go straight through to glibc.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static volatile sig_atomic_t gbl_poisonedAllocations = 0;
+
+static void poisonHit(void)
+{
+    static const char message[] = "eCrash: allocator called from the crash path!\n";
+
+    gbl_poisonedAllocations++;
+    if (write(STDERR_FILENO, message, sizeof(message) - 1) < 0)
+    {
+        /* Nothing else we can do */
+    }
+}
+
+void *malloc(size_t size)
+{
+    if (gbl_crashing)
+    {
+        poisonHit();
+        return NULL;
+    }
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    if (gbl_crashing)
+    {
+        poisonHit();
+        return NULL;
+    }
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if (gbl_crashing)
+    {
+        poisonHit();
+        return NULL;
+    }
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    if (gbl_crashing)
+    {
+        poisonHit();
+        return;
+    }
+    __libc_free(ptr);
+}
+#endif /* ECRASH_MALLOC_POISON */
 
 /*********************************************************************
  *********************************************************************
@@ -54,565 +668,7096 @@ static ThreadListNode *ThreadList = NULL;
  ********************************************************************/
 
 /***
- * Insert a node into our threadList
+ * Map and pre-fault our crash arena
  *
- * @param name   Text string indicating our thread
- * @param thread Our Thread Id
- * @param signo  Signal to create backtrace with
- * @param old_handler Our old handler for signo
+ * @param size Number of bytes we will need
  *
  * @returns zero on success
  */
-static int addThreadToList(char *name, pthread_t thread, int signo, sighandler_t old_handler)
+static int arenaInit(size_t size)
 {
-    ThreadListNode *node;
+    void *base;
 
-    node = malloc(sizeof(ThreadListNode));
-    if (!node)
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (base == MAP_FAILED)
     {
         return -1;
     }
 
-    DPRINTF(ECRASH_DEBUG_VERBOSE, "Adding thread 0x%p (%s)\n", thread, name);
-    node->threadName = strdup(name);
-    node->thread = thread;
-    node->backtraceSignal = signo;
-    node->oldHandler = old_handler;
-
-    /* And, add it to the list */
-    pthread_mutex_lock(&ThreadListMutex);
-    node->Next = ThreadList;
-    ThreadList = node;
-    pthread_mutex_unlock(&ThreadListMutex);
+    gbl_arenaBase = base;
+    gbl_arenaSize = size;
+    gbl_arenaUsed = 0;
 
     return 0;
 }
 
 /***
- * Remove a node from our threadList
+ * Carve a zeroed, pointer-aligned block out of the crash arena
  *
- * @param thread Our Thread Id
+ * @param bytes Size of the block
  *
- * @returns zero on success
+ * @returns the block, or NULL if the arena is exhausted
  */
-static int removeThreadFromList(pthread_t thread)
+static void *arenaAlloc(size_t bytes)
 {
-    ThreadListNode *Probe, *Prev = NULL;
-    ThreadListNode *Removed = NULL;
+    size_t aligned = (bytes + 15) & ~(size_t)15;
+    void *block;
 
-    DPRINTF(ECRASH_DEBUG_VERBOSE, "Removing thread 0x%p from list . . .\n", thread);
-    pthread_mutex_lock(&ThreadListMutex);
-    for (Probe = ThreadList ; Probe != NULL ; Probe = Probe->Next)
+    /* No DPRINTF here: we may be inside the crash handler */
+    if (gbl_arenaBase == NULL || aligned > gbl_arenaSize - gbl_arenaUsed)
     {
-        if (Probe->thread == thread)
-        {
-            /* We found it!  Unlink it and move on! */
-            Removed = Probe;
-            if (Prev == NULL)
-            {
-                /* head of list */
-                ThreadList = Probe->Next;
-            }
-            else
-            {
-                /* Prev != null, so we need to link around ourselves. */
-                Prev->Next = Probe->Next;
-            }
-            Removed->Next = NULL;
-            break;
-        }
-
-        Prev = Probe;
+        return NULL;
     }
-    pthread_mutex_unlock(&ThreadListMutex);
 
-    /* Now, if something is in Removed, free it, and return success */
-    if (Removed)
-    {
-        DPRINTF(ECRASH_DEBUG_VERBOSE, "   Found %s -- removing\n", Removed->threadName);
-        /* Reset the signal handler */
-        signal(Removed->backtraceSignal, Removed->oldHandler);
+    block = gbl_arenaBase + gbl_arenaUsed;
+    gbl_arenaUsed += aligned;
 
-        /* And free the allocated memory */
-        free(Removed->threadName);
-        free(Removed);
+    return block;
+}
 
-        return 0;
-    }
-    else
+/***
+ * Release the crash arena
+ */
+static void arenaFini(void)
+{
+    if (gbl_arenaBase)
     {
-        DPRINTF(ECRASH_DEBUG_VERBOSE, "   Not Found\n");
-        return -1; /* Not Found */
+        munmap(gbl_arenaBase, gbl_arenaSize);
     }
+    gbl_arenaBase = NULL;
+    gbl_arenaSize = gbl_arenaUsed = 0;
 }
 
 /***
- * Output text to a fd, looping to avoid being interrupted.
- *
- * @param str   String to output
- * @param bytes String length
- * @param fd    File descriptor to write to
+ * Empty an output buffer, keeping its chunks for reuse
  *
- * @returns bytes written, or error on failure.
+ * @param buf Buffer to reset
  */
-static int blockingWrite(char *str, int bytes, int fd)
+static void bufReset(OutputBuffer *buf)
 {
-    int offset = 0;
-    int bytesWritten;
-    int totalWritten = 0;
-
-    while (bytes > 0)
+    buf->tail = buf->head;
+    if (buf->head)
     {
-        bytesWritten = write(fd, &str[offset], bytes);
-        if (bytesWritten < 1)
-        {
-            break;
-        }
-        totalWritten += bytesWritten;
-        bytes -= bytesWritten;
+        buf->head->len = 0;
     }
-
-    return totalWritten;
 }
 
 /***
- * Print out a line of output to all our destinations
- *
- * One by one, output a line of text to all of our output destinations.
+ * Make sure the tail chunk of a buffer has room in it
  *
- * Return failure if we fail to output to any of them.
+ * Moves on to the next (reused or newly allocated) chunk when the tail is
+ * full.  When the arena is exhausted, the buffer is flushed instead.
  *
- * @param format   Normal printf style vararg format
+ * @param buf Buffer to grow
  *
- * @returns bytes written, or error on failure.
+ * @returns bytes available in the tail chunk (zero only if we are stuck)
  */
-static int outputPrintf(char *format, ...)
+static size_t bufRoom(OutputBuffer *buf)
 {
-    /* Our output line of text */
-    static char outputLine[MAX_LINE_LEN];
-    int bytesInLine;
-    va_list ap;
-    int return_value = 0;
+    OutputChunk *chunk = buf->tail;
 
-    va_start(ap, format);
+    if (chunk && chunk->len < chunk->size)
+    {
+        return chunk->size - chunk->len;
+    }
 
-    bytesInLine = vsnprintf(outputLine, MAX_LINE_LEN - 1, format, ap);
-    if (bytesInLine > -1 && bytesInLine < (MAX_LINE_LEN - 1))
+    if (chunk && chunk->next)
     {
-        /* We're a happy camper -- start printing */
-        if (gbl_params.filename)
-        {
-            /* append to our file -- hopefully it's been opened */
-            if (gbl_fd != -1)
-            {
-                if (blockingWrite(outputLine, bytesInLine, gbl_fd))
-                {
-                    return_value = -2;
-                }
-            }
-        }
+        buf->tail = chunk->next;
+        buf->tail->len = 0;
+        return buf->tail->size;
+    }
 
-        /* Write to our file pointer */
-        if (gbl_params.filep != NULL)
+    chunk = arenaAlloc(sizeof(OutputChunk) + buf->chunkSize);
+    if (chunk)
+    {
+        chunk->next = NULL;
+        chunk->len = 0;
+        chunk->size = buf->chunkSize;
+        if (buf->tail)
         {
-            if (fwrite(outputLine, bytesInLine, 1, gbl_params.filep) != 1)
-            {
-                return_value = -3;
-            }
-            fflush(gbl_params.filep);
+            buf->tail->next = chunk;
         }
-
-        /* Write to our fd */
-        if (gbl_params.fd != -1)
+        else
         {
-            if (blockingWrite(outputLine, bytesInLine, gbl_params.fd))
-            {
-                return_value = -4;
-            }
+            buf->head = chunk;
         }
+        buf->tail = chunk;
+        return chunk->size;
     }
-    else
+
+    /* Out of arena: push out what we have, and start over from the head */
+    if (buf->flush && buf->head && buf->head->len)
     {
-        /* We overran our string. */
-        return_value = -1;
+        buf->flush(buf);
+        return buf->head->size;
     }
 
-    return return_value;
+    return 0;
 }
 
 /***
- * Initialize our output (open files, etc)
- *
- * This file initializes all output streams, since we're about
- * to have output.
+ * Append raw bytes to an output buffer
  *
+ * @param buf  Buffer to append to
+ * @param data Bytes to append
+ * @param len  Number of bytes
  */
-static void outputInit(void)
+static void bufAppend(OutputBuffer *buf, const char *data, size_t len)
 {
-    if (gbl_params.filename)
+    while (len > 0)
     {
-        /* First try append */
-        gbl_fd = open(gbl_params.filename, O_WRONLY | O_APPEND);
-        if (gbl_fd < 0)
+        size_t room = bufRoom(buf);
+        size_t n = len < room ? len : room;
+
+        if (n == 0)
         {
-            /*                                 0644 */
-            gbl_fd = open(gbl_params.filename, O_RDWR | O_CREAT, S_IREAD | S_IWRITE | S_IRGRP | S_IROTH);
-            if (gbl_fd < 0)
-            {
-                gbl_fd = -1;
-            }
+            return;
         }
+
+        memcpy(&buf->tail->data[buf->tail->len], data, n);
+        buf->tail->len += n;
+        data += n;
+        len -= n;
     }
 }
 
 /***
- * Finalize our output (close files, etc)
- *
- * This file closes all output streams.
+ * Append a string to an output buffer
  *
+ * @param buf Buffer to append to
+ * @param str NUL terminated string (NULL prints as "(null)")
  */
-static void outputFini(void)
+static void bufAppendStr(OutputBuffer *buf, const char *str)
 {
-    if (gbl_fd > -1)
+    if (!str)
     {
-        close(gbl_fd);
+        str = "(null)";
     }
+    bufAppend(buf, str, strlen(str));
+}
 
-    if (gbl_params.filep != NULL)
+/***
+ * Append a single character to an output buffer
+ *
+ * @param buf Buffer to append to
+ * @param c   Character
+ */
+static void bufAppendChar(OutputBuffer *buf, char c)
+{
+    if (buf->tail && buf->tail->len < buf->tail->size)
     {
-        fclose(gbl_params.filep);
+        buf->tail->data[buf->tail->len++] = c;
     }
-
-    if (gbl_params.fd > -1)
+    else
     {
-        close(gbl_params.fd);
+        bufAppend(buf, &c, 1);
     }
-
-    /* Just in case someone tries to call outputPrintf after outputFini */
-    gbl_fd = gbl_params.fd = -1;
-    gbl_params.filep = NULL;
-
-    sync();
 }
 
-static void *lookupClosestSymbol(eCrashSymbolTable *table, void *address)
+/***
+ * Convert an unsigned number to decimal digits
+ *
+ * Digits are written backwards, ending just before end, two at a time.
+ *
+ * @param end   One past the end of a buffer of at least 20 characters
+ * @param value Number to convert
+ *
+ * @returns the first digit
+ */
+static char *formatUDec(char *end, unsigned long long value)
 {
-    int addr;
-    eCrashSymbol *last = NULL;
+    static const char digitPairs[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    char *p = end;
 
-    /* For now, use a linear lookup. */
-    DPRINTF(ECRASH_DEBUG_VERBOSE, "Looking for %p in %d symbols\n", address, table->numSymbols);
-    for (addr = 0 ; addr < table->numSymbols ; addr++)
+    while (value >= 100)
     {
-        DPRINTF(ECRASH_DEBUG_VERBOSE, "  Examining [%d] %p\n", addr, table->symbols[addr].address);
-        if (table->symbols[addr].address > address)
-        {
-            break;
-        }
-        last = &table->symbols[addr];
+        const char *pair = &digitPairs[(value % 100) * 2];
+
+        value /= 100;
+        *--p = pair[1];
+        *--p = pair[0];
+    }
+    if (value >= 10)
+    {
+        *--p = digitPairs[value * 2 + 1];
+        *--p = digitPairs[value * 2];
+    }
+    else
+    {
+        *--p = '0' + value;
     }
 
-    /* last will either be NULL, or the last address less than the
-     * one we're looking for.
-     */
-    DPRINTF(ECRASH_DEBUG_VERBOSE, "Returning %s (%p)\n", last ? last->function : "(nil)", last ? last->address : 0);
-    return last;
+    return p;
 }
 
 /***
- * Dump our backtrace into a global location
+ * Convert an unsigned number to lower case hex digits
  *
- * This function will dump out our backtrace into our
- * global holding area.
+ * @param end   One past the end of a buffer of at least 16 characters
+ * @param value Number to convert
  *
+ * @returns the first digit
  */
-static void createGlobalBacktrace(void)
+static char *formatHex(char *end, unsigned long long value)
 {
-    gbl_backtraceEntries = backtrace(gbl_backtraceBuffer, gbl_params.maxStackDepth);
+    static const char hexDigits[] = "0123456789abcdef";
+    char *p = end;
 
-    /* This is NOT signal safe -- it calls malloc.  We need to
-       let the caller pass in a pointer to a symbol table inside of
-       our params. TODO */
+    do
+    {
+        *--p = hexDigits[value & 0xf];
+        value >>= 4;
+    } while (value);
 
-    if (!gbl_params.symbolTable)
+    return p;
+}
+
+/***
+ * Append a character repeatedly
+ *
+ * @param buf   Buffer to append to
+ * @param c     Character
+ * @param count Number of times (may be zero or negative)
+ */
+static void bufAppendFill(OutputBuffer *buf, char c, int count)
+{
+    while (count-- > 0)
     {
-        if (gbl_params.useBacktraceSymbols != false)
-        {
-            gbl_backtraceSymbols = backtrace_symbols(gbl_backtraceBuffer, gbl_backtraceEntries);
-        }
+        bufAppendChar(buf, c);
     }
 }
 
 /***
- * Print out (to all the fds, etc), or global backtrace
+ * Append an unsigned decimal number
+ *
+ * @param buf   Buffer to append to
+ * @param value Number to print
  */
-static void outputGlobalBacktrace(void)
+static void bufAppendUDec(OutputBuffer *buf, unsigned long long value)
 {
-    int i;
+    char digits[24];
+    char *p = formatUDec(&digits[sizeof(digits)], value);
+
+    bufAppend(buf, p, &digits[sizeof(digits)] - p);
+}
+
+/***
+ * Append a zero padded index (like %02d), as used for frame numbers
+ *
+ * @param buf   Buffer to append to
+ * @param value Index to print
+ * @param width Minimum number of digits
+ */
+static void bufAppendIndex(OutputBuffer *buf, unsigned int value, int width)
+{
+    char digits[24];
+    char *p = formatUDec(&digits[sizeof(digits)], value);
+
+    bufAppendFill(buf, '0', width - (int)(&digits[sizeof(digits)] - p));
+    bufAppend(buf, p, &digits[sizeof(digits)] - p);
+}
+
+/***
+ * Append a hexadecimal number, without any prefix
+ *
+ * @param buf       Buffer to append to
+ * @param value     Number to print
+ * @param minDigits Minimum number of digits (zero padded)
+ */
+static void bufAppendHex(OutputBuffer *buf, unsigned long long value, int minDigits)
+{
+    char digits[24];
+    char *p = formatHex(&digits[sizeof(digits)], value);
+
+    bufAppendFill(buf, '0', minDigits - (int)(&digits[sizeof(digits)] - p));
+    bufAppend(buf, p, &digits[sizeof(digits)] - p);
+}
+
+/***
+ * Append a pointer, as 0x followed by hex digits
+ *
+ * @param buf Buffer to append to
+ * @param ptr Pointer to print
+ */
+static void bufAppendPtr(OutputBuffer *buf, const void *ptr)
+{
+    bufAppend(buf, "0x", 2);
+    bufAppendHex(buf, (unsigned long)ptr, 1);
+}
+
+/***
+ * Format printf style into an output buffer
+ *
+ * This is a small, locale free, async signal safe subset of printf built
+ * on the appenders above.  It understands the '0' and '-' flags, a field
+ * width, the l, ll and z length modifiers, and the d, i, u, x, p, s, c
+ * and % conversions.
+ *
+ * @param buf    Buffer to append to
+ * @param format printf style format
+ * @param ap     Arguments
+ */
+static void bufVFormat(OutputBuffer *buf, const char *format, va_list ap)
+{
+    const char *p = format;
 
-    for (i = 0 ; i < gbl_backtraceEntries ; i++)
+    while (*p)
     {
-        if (gbl_params.symbolTable)
-        {
-            eCrashSymbol *symbol;
+        const char *literal = p;
+        char digits[24];
+        char *end = &digits[sizeof(digits)];
+        const char *field;
+        size_t fieldLen;
+        const char *prefix = "";
+        char pad = ' ';
+        bool leftAlign = false;
+        int width = 0;
+        int longs = 0;
 
-            symbol = lookupClosestSymbol(gbl_params.symbolTable, gbl_backtraceBuffer[i]);
+        while (*p && *p != '%')
+        {
+            p++;
+        }
+        if (p != literal)
+        {
+            bufAppend(buf, literal, p - literal);
+        }
+        if (!*p)
+        {
+            break;
+        }
+        p++;
 
-            if (symbol)
+        /* Flags, width and length */
+        for ( ; *p == '0' || *p == '-' ; p++)
+        {
+            if (*p == '0')
             {
-                outputPrintf("*      Frame %02d: %s+%u\n", i, symbol->function,
-                             gbl_backtraceBuffer[i] - symbol->address);
+                pad = '0';
             }
             else
             {
-                outputPrintf("*      Frame %02d: %p\n", i, gbl_backtraceBuffer[i]);
+                leftAlign = true;
             }
         }
-        else
+        for ( ; *p >= '0' && *p <= '9' ; p++)
+        {
+            width = width * 10 + (*p - '0');
+        }
+        for ( ; *p == 'l' || *p == 'z' ; p++)
+        {
+            longs++;
+        }
+
+        switch (*p)
         {
-            if (gbl_backtraceSymbols != false)
+        case 'd':
+        case 'i':
+        {
+            long long value = longs > 1 ? va_arg(ap, long long) : longs ? va_arg(ap, long) : va_arg(ap, int);
+
+            if (value < 0)
             {
-                outputPrintf("*      Frame %02d: %s\n", i, gbl_backtraceSymbols[i]);
+                prefix = "-";
+                field = formatUDec(end, -(unsigned long long)value);
             }
             else
             {
-                outputPrintf("*      Frame %02d: %p\n", i, gbl_backtraceBuffer[i]);
+                field = formatUDec(end, value);
+            }
+            fieldLen = end - field;
+            break;
+        }
+        case 'u':
+        case 'x':
+        case 'X':
+        {
+            unsigned long long value = longs > 1 ? va_arg(ap, unsigned long long) :
+                                       longs ? va_arg(ap, unsigned long) : va_arg(ap, unsigned int);
+
+            field = (*p == 'u') ? formatUDec(end, value) : formatHex(end, value);
+            fieldLen = end - field;
+            break;
+        }
+        case 'p':
+            prefix = "0x";
+            field = formatHex(end, (unsigned long)va_arg(ap, void *));
+            fieldLen = end - field;
+            break;
+        case 's':
+            field = va_arg(ap, const char *);
+            if (!field)
+            {
+                field = "(null)";
             }
+            fieldLen = strlen(field);
+            pad = ' ';
+            break;
+        case 'c':
+            digits[0] = (char)va_arg(ap, int);
+            field = digits;
+            fieldLen = 1;
+            pad = ' ';
+            break;
+        case '%':
+            field = "%";
+            fieldLen = 1;
+            break;
+        case '\0':
+            return;
+        default:
+            /* Unknown conversion: print it as-is */
+            field = p - 1;
+            fieldLen = 2;
+            break;
+        }
+        p++;
+
+        width -= (int)(fieldLen + strlen(prefix));
+        if (leftAlign)
+        {
+            bufAppendStr(buf, prefix);
+            bufAppend(buf, field, fieldLen);
+            bufAppendFill(buf, ' ', width);
+        }
+        else if (pad == '0')
+        {
+            bufAppendStr(buf, prefix);
+            bufAppendFill(buf, '0', width);
+            bufAppend(buf, field, fieldLen);
+        }
+        else
+        {
+            bufAppendFill(buf, ' ', width);
+            bufAppendStr(buf, prefix);
+            bufAppend(buf, field, fieldLen);
         }
     }
 }
 
 /***
- * Output our current stack's backtrace
+ * Format printf style into an output buffer
+ *
+ * @param buf    Buffer to append to
+ * @param format printf style format
  */
-static void outputBacktrace(void)
+static void bufFormat(OutputBuffer *buf, const char *format, ...)
 {
-    createGlobalBacktrace();
-    outputGlobalBacktrace();
+    va_list ap;
+
+    va_start(ap, format);
+    bufVFormat(buf, format, ap);
+    va_end(ap);
 }
 
-static void outputBacktraceThreads(void)
+/***
+ * Bytes of arena needed for a given set of parameters
+ *
+ * @param params Our (defaulted) parameters
+ *
+ * @returns arena size, rounded up to a page
+ */
+static size_t arenaSizeNeeded(eCrashParameters *params)
 {
-    ThreadListNode *probe;
+    size_t frameBytes = sizeof(void *) * (params->maxStackDepth + FRAME_SLACK) + 16;
+    size_t size = 0;
+    long page = sysconf(_SC_PAGESIZE);
     int i;
 
-    /* When we're backtracing, don't worry about the mutex . . hopefully
-     * we're in a safe place.
-     */
+    /* Offending thread's backtrace, plus one per thread slot */
+    size += frameBytes * (params->maxThreads + 1);
+    size += (sizeof(ThreadSlot) + 16) * params->maxThreads;
 
-    for (probe = ThreadList ; probe ; probe = probe->Next)
+    /* Copies of the filename and symbol table */
+    if (params->filename)
     {
-        gbl_backtraceDoneFlag = 0;
-        pthread_kill(probe->thread, probe->backtraceSignal);
-        for (i = 0 ; i < gbl_params.threadWaitTime ; i++)
-        {
-            if (gbl_backtraceDoneFlag)
-            {
-                break;
-            }
-            sleep(1);
-        }
-        if (gbl_backtraceDoneFlag)
-        {
-            outputPrintf("*  Backtrace of \"%s\" (0x%p)\n", probe->threadName, probe->thread);
-            outputGlobalBacktrace();
-        }
-        else
+        size += strlen(params->filename) + 1 + 16;
+    }
+    if (params->useMemfd != false)
+    {
+        size += ECRASH_OUTPUT_CHUNK_SIZE + 16;
+    }
+    if (params->blackBoxDir)
+    {
+        size += strlen(params->blackBoxDir) + sizeof(ECRASH_BLACKBOX_FILE_FORMAT) + 16 + 16;
+    }
+    if (params->profileFile)
+    {
+        size += strlen(params->profileFile) + 1 + 16;
+    }
+    if (params->wallProfileFile)
+    {
+        size += strlen(params->wallProfileFile) + 1 + 16;
+    }
+
+    /* The memory snapshot, and the resource section's mapped files */
+    size += params->memorySnapshotSize + 16;
+    if (params->dumpResources != false)
+    {
+        size += sizeof(ResourceMap) * ECRASH_MAX_RESOURCE_MAPS + 16;
+    }
+
+    /* A first buffer chunk for each stream (at most one per sink) */
+    size += (sizeof(OutputChunk) + ECRASH_OUTPUT_CHUNK_SIZE + 16) * ECRASH_MAX_NUM_SINKS;
+
+    /* And a compressor for each compressed one */
+    for (i = 0 ; i < ECRASH_MAX_NUM_SINKS && params->sinks[i].type != ECRASH_SINK_NONE ; i++)
+    {
+        if (params->sinks[i].compress != false)
         {
-            outputPrintf("*  Error: unable to get backtrace of \"%s\" (0x%p)\n", probe->threadName,
-                         probe->thread);
+            size += sizeof(LzState) + ECRASH_LZ_WINDOW + ECRASH_LZ_BLOCK_SIZE;
+            size += (sizeof(uint32_t) << ECRASH_LZ_HASH_BITS) + ECRASH_LZ_OUT_SIZE + 4 * 16;
         }
-        outputPrintf("*\n");
     }
-}
+    if (params->symbolTable)
+    {
+        size += sizeof(eCrashSymbolTable) + 16;
+        size += sizeof(eCrashSymbol) * params->symbolTable->numSymbols + 16;
+    }
 
+    size += params->crashArenaSize;
+
+    return (size + page - 1) & ~(size_t)(page - 1);
+}
 
 /***
- * Handle signals (crash signals)
+ * Find a thread's slot
  *
- * This function will catch all crash signals, and will output the
- * crash dump.  
+ * @param thread Our Thread Id
  *
- * It will physically write (and sync) the current thread's information
- * before it attempts to send signals to other threads.
- * 
- * @param signum Signal received.
+ * @returns the slot, or NULL if the thread is not registered
  */
-static void crash_handler(int signo)
+static ThreadSlot *findThreadSlot(pthread_t thread)
 {
-    outputInit();
-    outputPrintf("*********************************************************\n");
-    outputPrintf("*               eCrash Crash Handler\n");
-    outputPrintf("*********************************************************\n");
-    outputPrintf("*\n");
-    outputPrintf("*  Got a crash! signo=%d\n", signo);
-    outputPrintf("*\n");
-    outputPrintf("*  Offending Thread's Backtrace:\n");
-    outputPrintf("*\n");
-    outputBacktrace();
-    outputPrintf("*\n");
+    int i;
 
-    if (gbl_params.dumpAllThreads != false)
+    for (i = 0 ; ThreadSlots && i < gbl_params.maxThreads ; i++)
     {
-        outputBacktraceThreads();
+        if (ThreadSlots[i].inUse && pthread_equal(ThreadSlots[i].thread, thread))
+        {
+            return &ThreadSlots[i];
+        }
     }
 
-    outputPrintf("*\n");
-    outputPrintf("*********************************************************\n");
-    outputPrintf("*               eCrash Crash Handler\n");
-    outputPrintf("*********************************************************\n");
+    return NULL;
+}
 
-    outputFini();
+/***
+ * Get the calling thread's slot
+ *
+ * A thread still registered when eCrash_Uninit ran is not any more: its
+ * slot went away with the arena, so forget it.
+ *
+ * @returns the slot, or NULL if the thread is not registered
+ */
+static ThreadSlot *currentSlot(void)
+{
+    if (tls_threadSlot && eCrash_tlsGeneration != __atomic_load_n(&eCrash_generation, __ATOMIC_ACQUIRE))
+    {
+        tls_threadSlot = NULL;
+        eCrash_tlsBreadcrumbs = NULL;
+        eCrash_tlsMetrics = NULL;
+        eCrash_tlsHeartbeat = NULL;
+    }
 
-    exit(signo);
+    return tls_threadSlot;
 }
 
 /***
- * Handle signals (bt signals)
+ * Find the heartbeat deadline of a thread's role
  *
- * This function shoudl be called to generate a crashdump into our
- * global area.  Once the dump has been completed, this function will
- * return after tickling a global.  Since mutexes are not async
- * signal safe, the main thread, after signaling us to generate our
- * own backtrace, will sleep for a few seconds waiting for us to complete.
+ * @param name The thread's name
  *
- * @param signum Signal received.
+ * @returns the deadline of the first role starting the name, in ms, or 0 if none does
  */
-static void bt_handler(int signo)
+static unsigned int heartbeatRoleDeadline(const char *name)
 {
-    createGlobalBacktrace();
-    gbl_backtraceDoneFlag = 1;
+    int i;
+
+    for (i = 0 ; i < gbl_numHeartbeatRoles ; i++)
+    {
+        if (strncmp(name, gbl_heartbeatRoles[i].role, strlen(gbl_heartbeatRoles[i].role)) == 0)
+        {
+            return gbl_heartbeatRoles[i].deadlineMs;
+        }
+    }
+
+    return 0;
 }
 
 /***
- * Validate a passed-in symbol table
+ * Insert a node into our threadList
  *
- * For now, just print it out (if verbose), and make sure it's
- * sorted and none of the pointers are zero.
+ * @param name   Text string indicating our thread
+ * @param thread Our Thread Id
+ * @param signo  Signal to create backtrace with
+ * @param old_handler Our old handler for signo
+ *
+ * @returns the thread's slot, or NULL if we are out of slots
  */
-static int ValidateSymbolTable(void)
+static ThreadSlot *addThreadToList(char *name, pthread_t thread, int signo, sighandler_t old_handler)
 {
+    ThreadSlot *slot = NULL;
     int i;
-    int rc = 0;
-    unsigned long lastAddress = 0;
 
-    /* Get out of here if the table is empty */
-    if (!gbl_params.symbolTable)
+    DPRINTF(ECRASH_DEBUG_VERBOSE, "Adding thread 0x%lx (%s)\n", (unsigned long)thread, name);
+
+    pthread_mutex_lock(&ThreadListMutex);
+    for (i = 0 ; ThreadSlots && i < gbl_params.maxThreads ; i++)
     {
-        return 0;
+        if (!ThreadSlots[i].inUse)
+        {
+            slot = &ThreadSlots[i];
+            break;
+        }
     }
 
-    /* Dump it in verbose mode */
-    DPRINTF(ECRASH_DEBUG_VERBOSE, "Symbol Table Provided with %d symbols\n", gbl_params.symbolTable->numSymbols);
-    for (i = 0 ; i < gbl_params.symbolTable->numSymbols ; i++)
+    if (slot)
     {
-        /* Dump it in verbose mode */
-        DPRINTF(ECRASH_DEBUG_VERBOSE, "%-30s %p\n", gbl_params.symbolTable->symbols[i].function,
-                gbl_params.symbolTable->symbols[i].address);
-        if (lastAddress > (unsigned long)gbl_params.symbolTable->symbols[i].address)
+        strncpy(slot->threadName, name ? name : "", sizeof(slot->threadName) - 1);
+        slot->threadName[sizeof(slot->threadName) - 1] = '\0';
+        slot->thread = thread;
+        slot->backtraceSignal = signo;
+        slot->oldHandler = old_handler;
+        slot->backtrace.entries = 0;
+        slot->backtraceDepth = gbl_params.maxStackDepth;
+        slot->backtraceDone = 0;
+        slot->tid = syscall(SYS_gettid);
+        slot->sampledAt = 0;
+        slot->profiling = false;
+        slot->statFd = -1;
+        slot->wallRole = -1;
+        slot->heartbeat = 0;
+        slot->hangReported = 0;
+        slot->deadlineMs = heartbeatRoleDeadline(slot->threadName);
+
+        if (slot->box)
         {
-            DPRINTF(ECRASH_DEBUG_ERROR, "Error: symbol table is not sorted (last=%p, current=%p)\n",
-                    (void *)lastAddress, gbl_params.symbolTable->symbols[i].address);
-            rc = -1;
+            memset(slot->box, 0, sizeof(*slot->box));
+            memcpy(slot->box->name, slot->threadName, sizeof(slot->box->name) - 1);
+            slot->box->tid = slot->tid;
+            slot->box->thread = (unsigned long)thread;
+            slot->box->inUse = 1;
         }
+        slot->breadcrumbs = slot->box ? &slot->box->breadcrumbs : &slot->ownBreadcrumbs;
+        memset(slot->breadcrumbs, 0, sizeof(*slot->breadcrumbs));
+        slot->annotations = slot->box ? slot->box->annotations : slot->ownAnnotations;
+        memset(slot->annotations, 0, sizeof(eCrashAnnotation) * ECRASH_MAX_THREAD_ANNOTATIONS);
+        memset(&slot->metrics, 0, sizeof(slot->metrics));
 
+        /* Publish it last, the crash path walks the table without the lock */
+        __atomic_store_n(&slot->inUse, 1, __ATOMIC_RELEASE);
     }
+    pthread_mutex_unlock(&ThreadListMutex);
 
-    return rc;
+    if (!slot)
+    {
+        DPRINTF(ECRASH_DEBUG_ERROR, "Error: no free thread slots for %s\n", name);
+    }
 
+    return slot;
 }
 
-/*********************************************************************
- *********************************************************************
- **      P  U  B  L  I  C      F  U  N  C  T  I  O  N  S
- *********************************************************************
- ********************************************************************/
-
 /***
- * Initialize eCrash.
- * 
- * This function must be called before calling any other eCrash
- * functions.  It sets up the global behavior of the system, and
- * registers the calling thread for crash dumps.
+ * Remove a node from our threadList
  *
- * @param params Our input parameters.  The passed in structure will be copied.
+ * @param thread Our Thread Id
  *
- * @return Zero on success.
+ * @returns zero on success
  */
-int eCrash_Init(eCrashParameters *params)
+static int removeThreadFromList(pthread_t thread)
 {
-    int sigIndex;
-    int ret = 0;
-#ifdef DO_SIGNALS_RIGHT
-    sigset_t blocked;
-    struct sigaction act;
-#endif
-
-    DPRINTF(ECRASH_DEBUG_VERY_VERBOSE, "Init Starting params = %p\n", params);
-
-    /* Allocate our backtrace area */
-    gbl_backtraceBuffer = malloc(sizeof(void *) * (params->maxStackDepth + 5));
-
-#ifdef DO_SIGNALS_RIGHT
-    sigemptyset(&blocked);
-    act.sa_sigaction = crash_handler;
-    act.sa_mask = blocked;
-    act.sa_flags = SA_SIGINFO;
-#endif
+    ThreadSlot *removed;
+    bool signalInUse = false;
+    int i;
 
-    if (params != NULL)
+    DPRINTF(ECRASH_DEBUG_VERBOSE, "Removing thread 0x%lx from list . . .\n", (unsigned long)thread);
+    pthread_mutex_lock(&ThreadListMutex);
+    removed = findThreadSlot(thread);
+    if (removed)
     {
-        /* Make ourselves a global copy of params. */
-        gbl_params = *params;
-        gbl_params.filename = strdup(params->filename);
-
-        /* Set our defaults, if they weren't specified */
-        if (gbl_params.maxStackDepth == 0)
+        DPRINTF(ECRASH_DEBUG_VERBOSE, "   Found %s -- removing\n", removed->threadName);
+        __atomic_store_n(&removed->inUse, 0, __ATOMIC_RELEASE);
+        if (removed->statFd > -1)
         {
-            gbl_params.maxStackDepth = ECRASH_DEFAULT_STACK_DEPTH;
+            close(removed->statFd);
+            removed->statFd = -1;
         }
-
-        if (gbl_params.defaultBacktraceSignal == 0)
+        if (removed->box)
         {
-            gbl_params.defaultBacktraceSignal = ECRASH_DEFAULT_BACKTRACE_SIGNAL;
+            removed->box->inUse = 0;
         }
 
-        if (gbl_params.threadWaitTime == 0)
+        for (i = 0 ; i < gbl_params.maxThreads ; i++)
         {
-            gbl_params.threadWaitTime = ECRASH_DEFAULT_THREAD_WAIT_TIME;
-        }
+            if (ThreadSlots[i].inUse && ThreadSlots[i].backtraceSignal == removed->backtraceSignal)
+            {
+                signalInUse = true;
+            }
+        }
+    }
+    pthread_mutex_unlock(&ThreadListMutex);
+
+    /* Now, if something was removed, return success */
+    if (removed)
+    {
+        /* Reset the signal handler, unless another thread still needs it */
+        if (!signalInUse)
+        {
+            signal(removed->backtraceSignal, removed->oldHandler);
+        }
+
+        return 0;
+    }
+    else
+    {
+        DPRINTF(ECRASH_DEBUG_VERBOSE, "   Not Found\n");
+        return -1; /* Not Found */
+    }
+}
+
+/***
+ * Monotonic clock, in nanoseconds (clock_gettime is async signal safe)
+ */
+static long long nowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/***
+ * Wall clock, in nanoseconds since the epoch (async signal safe)
+ */
+static unsigned long long realtimeNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/***
+ * Mark the black box exited, and remove it, when the process exits cleanly
+ *
+ * An atexit hook, so a process that never calls eCrash_Uninit isn't
+ * taken for killed.  One exiting from the crash handler (the EXIT
+ * disposition) keeps its box.  The mapping stays, as other threads may
+ * still publish to it.
+ */
+static void blackBoxAtExit(void)
+{
+    if (!gbl_blackBox || gbl_blackBox->state != ECRASH_BLACKBOX_RUNNING)
+    {
+        return;
+    }
+
+    gbl_blackBox->exitTime = realtimeNs();
+    gbl_blackBox->state = ECRASH_BLACKBOX_EXITED;
+    unlink(gbl_blackBoxPath);
+}
+
+/***
+ * Remove the black boxes of dead processes, but for the ECRASH_BLACKBOX_KEEP newest
+ *
+ * Those are what ecrash_blackbox is for, but one is left by every
+ * process killed, or crashed, so they would pile up.
+ */
+static void blackBoxPrune(void)
+{
+    struct
+    {
+        int pid;
+        time_t mtime;
+    } kept[ECRASH_BLACKBOX_KEEP];
+    char path[PATH_MAX];
+    struct dirent *entry;
+    struct stat st;
+    int numKept = 0;
+    int oldest;
+    int end;
+    int pid;
+    DIR *dir;
+    int i;
+
+    dir = opendir(gbl_params.blackBoxDir);
+    if (!dir)
+    {
+        return;
+    }
+
+    while ((entry = readdir(dir)) != NULL)
+    {
+        end = 0;
+        if (sscanf(entry->d_name, "ecrash.%d.bbx%n", &pid, &end) != 1 || end == 0 || entry->d_name[end] != '\0' ||
+            pid <= 0 || pid == getpid() || kill(pid, 0) == 0 || errno != ESRCH)
+        {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), ECRASH_BLACKBOX_FILE_FORMAT, gbl_params.blackBoxDir, pid);
+        if (stat(path, &st) != 0)
+        {
+            continue;
+        }
+
+        if (numKept < ECRASH_BLACKBOX_KEEP)
+        {
+            kept[numKept].pid = pid;
+            kept[numKept].mtime = st.st_mtime;
+            numKept++;
+            continue;
+        }
+
+        /* One too many: the oldest goes, this one or one kept so far */
+        oldest = 0;
+        for (i = 1 ; i < numKept ; i++)
+        {
+            if (kept[i].mtime < kept[oldest].mtime)
+            {
+                oldest = i;
+            }
+        }
+        if (st.st_mtime > kept[oldest].mtime)
+        {
+            snprintf(path, sizeof(path), ECRASH_BLACKBOX_FILE_FORMAT, gbl_params.blackBoxDir, kept[oldest].pid);
+            kept[oldest].pid = pid;
+            kept[oldest].mtime = st.st_mtime;
+        }
+        DPRINTF(ECRASH_DEBUG_VERBOSE, "Removing old black box %s\n", path);
+        unlink(path);
+    }
+
+    closedir(dir);
+}
+
+/***
+ * Create and map the black box
+ *
+ * The file is sized and mapped once, here; from then on the black box is
+ * only ever written through the mapping, with plain stores.  Failing to
+ * create it is not fatal: crash reports work the same without it.
+ *
+ * @returns zero on success
+ */
+static int blackBoxInit(void)
+{
+    eCrashBlackBoxHeader *header;
+    size_t pathLen;
+    size_t size;
+    void *map;
+    int fd;
+    int i;
+
+    blackBoxPrune();
+
+    pathLen = strlen(gbl_params.blackBoxDir) + sizeof(ECRASH_BLACKBOX_FILE_FORMAT) + 16;
+    gbl_blackBoxPath = arenaAlloc(pathLen);
+    snprintf(gbl_blackBoxPath, pathLen, ECRASH_BLACKBOX_FILE_FORMAT, gbl_params.blackBoxDir, (int)getpid());
+
+    size = sizeof(eCrashBlackBoxHeader) + sizeof(eCrashBlackBoxThread) * gbl_params.maxThreads;
+    fd = open(gbl_blackBoxPath, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        DPRINTF(ECRASH_DEBUG_ERROR, "Error: unable to create black box %s: %s\n", gbl_blackBoxPath,
+                strerror(errno));
+        return -1;
+    }
+
+    /* Allocate the blocks now, so a full disk can't SIGBUS us later */
+    if (posix_fallocate(fd, 0, size) != 0)
+    {
+        DPRINTF(ECRASH_DEBUG_ERROR, "Error: unable to allocate black box %s\n", gbl_blackBoxPath);
+        close(fd);
+        unlink(gbl_blackBoxPath);
+        return -1;
+    }
+
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        DPRINTF(ECRASH_DEBUG_ERROR, "Error: unable to map black box %s: %s\n", gbl_blackBoxPath,
+                strerror(errno));
+        unlink(gbl_blackBoxPath);
+        return -1;
+    }
+
+    header = map;
+    header->headerSize = sizeof(eCrashBlackBoxHeader);
+    header->threadSize = sizeof(eCrashBlackBoxThread);
+    header->numThreads = gbl_params.maxThreads;
+    header->pid = getpid();
+    header->startTime = realtimeNs();
+    header->startMonotonic = nowNs();
+    header->state = ECRASH_BLACKBOX_RUNNING;
+    header->version = ECRASH_BLACKBOX_VERSION;
+    __atomic_store_n(&header->magic, ECRASH_BLACKBOX_MAGIC, __ATOMIC_RELEASE);
+
+    for (i = 0 ; i < gbl_params.maxThreads ; i++)
+    {
+        ThreadSlots[i].box = (eCrashBlackBoxThread *)((char *)map + header->headerSize) + i;
+    }
+
+    gbl_blackBox = header;
+    gbl_blackBoxSize = size;
+    gbl_annotations = header->annotations;
+
+    if (!gbl_blackBoxAtExit && atexit(blackBoxAtExit) == 0)
+    {
+        gbl_blackBoxAtExit = true;
+    }
+
+    return 0;
+}
+
+/***
+ * Unmap and remove the black box (there is nothing to read in it after
+ * a clean shutdown)
+ */
+static void blackBoxFini(void)
+{
+    int i;
+
+    if (!gbl_blackBox)
+    {
+        return;
+    }
+
+    gbl_blackBox->state = ECRASH_BLACKBOX_EXITED;
+    for (i = 0 ; ThreadSlots && i < gbl_params.maxThreads ; i++)
+    {
+        ThreadSlots[i].box = NULL;
+    }
+
+    gbl_annotations = NULL;
+    munmap(gbl_blackBox, gbl_blackBoxSize);
+    unlink(gbl_blackBoxPath);
+    gbl_blackBox = NULL;
+    gbl_blackBoxSize = 0;
+    gbl_blackBoxPath = NULL;
+}
+
+/***
+ * Publish a stack to the black box
+ *
+ * The stack's sequence number is odd while it is written, so a reader
+ * can tell a stack the process died in the middle of.  Only one thread
+ * ever writes a given stack.  Async signal safe.
+ *
+ * @param stack  Where to publish it
+ * @param frames Return addresses
+ * @param count  Number of them
+ */
+static void blackBoxPublish(eCrashBlackBoxStack *stack, void **frames, int count)
+{
+    uint64_t seq = stack->seq;
+    int i;
+
+    if (count > ECRASH_BLACKBOX_MAX_FRAMES)
+    {
+        count = ECRASH_BLACKBOX_MAX_FRAMES;
+    }
+
+    __atomic_store_n(&stack->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    stack->time = realtimeNs();
+    for (i = 0 ; i < count ; i++)
+    {
+        stack->frames[i] = (unsigned long)frames[i];
+    }
+    stack->numFrames = count;
+
+    __atomic_store_n(&stack->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/***
+ * Copy a thread's breadcrumbs out of its ring, oldest first
+ *
+ * The thread may still be adding breadcrumbs (only the offending thread
+ * is stopped), so the ring's count is read on both sides of the copy,
+ * and entries it may have overwritten meanwhile are left out.
+ *
+ * @param ring   Ring to read, or NULL
+ * @param crumbs Where to copy them (ECRASH_NUM_BREADCRUMBS entries)
+ *
+ * @returns the number copied
+ */
+static int captureBreadcrumbs(const eCrashBreadcrumbRing *ring, eCrashBreadcrumb *crumbs)
+{
+    uint64_t before;
+    uint64_t after;
+    uint64_t first;
+    uint64_t n;
+
+    if (!ring)
+    {
+        return 0;
+    }
+
+    before = __atomic_load_n(&ring->count, __ATOMIC_ACQUIRE);
+    first = before > ECRASH_NUM_BREADCRUMBS ? before - ECRASH_NUM_BREADCRUMBS : 0;
+    for (n = first ; n < before ; n++)
+    {
+        crumbs[n - first] = ring->crumbs[n & (ECRASH_NUM_BREADCRUMBS - 1)];
+    }
+
+    /* Anything before after - N + 1 may have been overwritten mid copy */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    after = __atomic_load_n(&ring->count, __ATOMIC_RELAXED);
+    if (after != before && after >= ECRASH_NUM_BREADCRUMBS && after - ECRASH_NUM_BREADCRUMBS + 1 > first)
+    {
+        n = after - ECRASH_NUM_BREADCRUMBS + 1 - first;
+        if (n > before - first)
+        {
+            n = before - first;
+        }
+        memmove(crumbs, crumbs + n, sizeof(*crumbs) * (before - first - n));
+        first += n;
+    }
+
+    return before - first;
+}
+
+/***
+ * Set an annotation, claiming a slot for its key if it is new
+ *
+ * Values are updated in place behind the slot's sequence lock.  Writers
+ * take the lock by moving the sequence number from even to odd, so two
+ * threads updating the same process wide key can't interleave.
+ *
+ * @param table Annotation slots
+ * @param size  Number of them
+ * @param key   Annotation name
+ * @param value New value, or NULL to clear it
+ *
+ * @returns zero on success, -1 if the table is full
+ */
+static int annotationSet(eCrashAnnotation *table, int size, const char *key, const char *value)
+{
+    eCrashAnnotation *slot = NULL;
+    uint64_t seq;
+    int i;
+
+    for (i = 0 ; i < size && !slot ; i++)
+    {
+        if (__atomic_load_n(&table[i].inUse, __ATOMIC_ACQUIRE) == 2 &&
+            strncmp(table[i].key, key, sizeof(table[i].key) - 1) == 0)
+        {
+            slot = &table[i];
+        }
+    }
+
+    if (!slot)
+    {
+        /* A new key: look again under the lock, in case it just got claimed, then claim a slot */
+        pthread_mutex_lock(&AnnotationMutex);
+        for (i = 0 ; i < size && !slot ; i++)
+        {
+            if (table[i].inUse && strncmp(table[i].key, key, sizeof(table[i].key) - 1) == 0)
+            {
+                slot = &table[i];
+            }
+        }
+        for (i = 0 ; i < size && !slot ; i++)
+        {
+            if (!table[i].inUse)
+            {
+                slot = &table[i];
+                slot->inUse = 1;
+                strncpy(slot->key, key, sizeof(slot->key) - 1);
+                slot->key[sizeof(slot->key) - 1] = '\0';
+                __atomic_store_n(&slot->inUse, 2, __ATOMIC_RELEASE);
+            }
+        }
+        pthread_mutex_unlock(&AnnotationMutex);
+
+        if (!slot)
+        {
+            DPRINTF(ECRASH_DEBUG_ERROR, "Error: no free annotation slots for %s\n", key);
+            return -1;
+        }
+    }
+
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+    while ((seq & 1) ||
+           !__atomic_compare_exchange_n(&slot->seq, &seq, seq + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    strncpy(slot->value, value ? value : "", sizeof(slot->value) - 1);
+    slot->value[sizeof(slot->value) - 1] = '\0';
+
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/***
+ * Copy the set annotations out of a table
+ *
+ * A value being written is retried a few times, then left out: it may
+ * belong to the thread that crashed mid update.  Async signal safe.
+ *
+ * @param table  Annotation slots, or NULL
+ * @param size   Number of them
+ * @param copies Where to copy them (size entries)
+ *
+ * @returns the number copied
+ */
+static int captureAnnotations(const eCrashAnnotation *table, int size, eCrashAnnotation *copies)
+{
+    eCrashAnnotation *copy;
+    int count = 0;
+    int tries;
+    int i;
+
+    for (i = 0 ; table && i < size ; i++)
+    {
+        if (__atomic_load_n(&table[i].inUse, __ATOMIC_ACQUIRE) != 2)
+        {
+            continue;
+        }
+
+        copy = &copies[count];
+        for (tries = 0 ; tries < 3 ; tries++)
+        {
+            copy->seq = __atomic_load_n(&table[i].seq, __ATOMIC_ACQUIRE);
+            if (copy->seq & 1)
+            {
+                continue;
+            }
+            memcpy(copy->key, table[i].key, sizeof(copy->key));
+            memcpy(copy->value, table[i].value, sizeof(copy->value));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&table[i].seq, __ATOMIC_RELAXED) == copy->seq)
+            {
+                break;
+            }
+        }
+
+        copy->key[sizeof(copy->key) - 1] = '\0';
+        copy->value[sizeof(copy->value) - 1] = '\0';
+        if (tries < 3 && copy->value[0] != '\0')
+        {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+/***
+ * Register a counter or histogram name
+ *
+ * @param names Name table
+ * @param count Number of names in it (updated)
+ * @param max   Table size
+ * @param name  Name to add
+ *
+ * @returns the name's index, or -1 if the table is full
+ */
+static int metricRegister(char (*names)[ECRASH_METRIC_NAME_LEN], int *count, int max, const char *name)
+{
+    int id = -1;
+    int i;
+
+    pthread_mutex_lock(&MetricMutex);
+    for (i = 0 ; i < *count ; i++)
+    {
+        if (strncmp(names[i], name, ECRASH_METRIC_NAME_LEN - 1) == 0)
+        {
+            id = i;
+            break;
+        }
+    }
+
+    if (id < 0 && *count < max)
+    {
+        id = *count;
+        strncpy(names[id], name, ECRASH_METRIC_NAME_LEN - 1);
+        names[id][ECRASH_METRIC_NAME_LEN - 1] = '\0';
+        __atomic_store_n(count, id + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&MetricMutex);
+
+    if (id < 0)
+    {
+        DPRINTF(ECRASH_DEBUG_ERROR, "Error: no room for metric %s\n", name);
+    }
+
+    return id;
+}
+
+/***
+ * Add one shard into another
+ *
+ * @param total  Shard to add to (with atomic adds, as it may be shared)
+ * @param shard  Shard to add
+ */
+static void metricsAdd(eCrashMetricShard *total, const eCrashMetricShard *shard)
+{
+    int i;
+    int b;
+
+    for (i = 0 ; i < ECRASH_MAX_COUNTERS ; i++)
+    {
+        __atomic_fetch_add(&total->counters[i], __atomic_load_n(&shard->counters[i], __ATOMIC_RELAXED),
+                           __ATOMIC_RELAXED);
+    }
+    for (i = 0 ; i < ECRASH_MAX_HISTOGRAMS ; i++)
+    {
+        for (b = 0 ; b < ECRASH_HISTOGRAM_BUCKETS ; b++)
+        {
+            __atomic_fetch_add(&total->histograms[i][b], __atomic_load_n(&shard->histograms[i][b], __ATOMIC_RELAXED),
+                               __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/***
+ * Sum every shard, for a report
+ *
+ * Threads keep counting while this runs; each value is read once, so
+ * totals are a moment's snapshot give or take the updates racing it.
+ * Async signal safe.
+ *
+ * @param metrics Filled in
+ */
+static void metricsTotal(ReportMetrics *metrics)
+{
+    int t;
+
+    memset(&gbl_metricTotals, 0, sizeof(gbl_metricTotals));
+    metricsAdd(&gbl_metricTotals, &eCrash_sharedMetrics);
+    for (t = 0 ; ThreadSlots && t < gbl_params.maxThreads ; t++)
+    {
+        if (__atomic_load_n(&ThreadSlots[t].inUse, __ATOMIC_ACQUIRE))
+        {
+            metricsAdd(&gbl_metricTotals, &ThreadSlots[t].metrics);
+        }
+    }
+
+    metrics->numCounters = __atomic_load_n(&gbl_numCounters, __ATOMIC_ACQUIRE);
+    metrics->numHistograms = __atomic_load_n(&gbl_numHistograms, __ATOMIC_ACQUIRE);
+    metrics->totals = &gbl_metricTotals;
+}
+
+/***
+ * End (exclusive) of a histogram bucket
+ */
+static unsigned long long histogramBucketEnd(int b)
+{
+    return b >= 63 ? ~0ULL : 2ULL << b;
+}
+
+/***
+ * Find a percentile of a histogram
+ *
+ * @param buckets The histogram
+ * @param samples Number of values in it
+ * @param percent Percentile wanted
+ *
+ * @returns the (exclusive) upper bound of the bucket it falls in
+ */
+static unsigned long long histogramPercentile(const uint64_t *buckets, unsigned long long samples, int percent)
+{
+    unsigned long long seen = 0;
+    int b;
+
+    for (b = 0 ; b < ECRASH_HISTOGRAM_BUCKETS - 1 ; b++)
+    {
+        seen += buckets[b];
+        if (seen * 100 >= samples * percent)
+        {
+            break;
+        }
+    }
+
+    return histogramBucketEnd(b);
+}
+
+/***
+ * Count the values in a histogram
+ */
+static unsigned long long histogramSamples(const uint64_t *buckets)
+{
+    unsigned long long samples = 0;
+    int b;
+
+    for (b = 0 ; b < ECRASH_HISTOGRAM_BUCKETS ; b++)
+    {
+        samples += buckets[b];
+    }
+
+    return samples;
+}
+
+/***
+ * Find the whole pages inside a range
+ *
+ * @param ptr   Start of the range
+ * @param len   Its length
+ * @param start Set to the first page
+ * @param end   Set to the end of the last page
+ *
+ * @returns false if no whole page is inside the range
+ */
+static bool corePages(const void *ptr, size_t len, unsigned long *start, unsigned long *end)
+{
+    unsigned long page = sysconf(_SC_PAGESIZE);
+
+    *start = ((unsigned long)ptr + page - 1) & ~(page - 1);
+    *end = ((unsigned long)ptr + len) & ~(page - 1);
+
+    return *start < *end;
+}
+
+/***
+ * Take a range out of the core exclusion list, splitting the ranges it
+ * falls in the middle of.  Call with CoreMutex held.
+ *
+ * @param start First page of the range
+ * @param end   End of its last page
+ *
+ * @returns zero, or -1 if a split needed more room than there is
+ */
+static int coreExclusionsRemove(unsigned long start, unsigned long end)
+{
+    CoreExclusion *range;
+    unsigned long rangeEnd;
+    int i;
+
+    for (i = 0 ; i < gbl_numCoreExclusions ; )
+    {
+        range = &gbl_coreExclusions[i];
+        rangeEnd = range->start + range->length;
+
+        if (rangeEnd <= start || range->start >= end)
+        {
+            i++;
+            continue;
+        }
+
+        if (range->start < start && rangeEnd > end)
+        {
+            /* The middle goes: keep the tail as a range of its own */
+            if (gbl_numCoreExclusions == ECRASH_MAX_CORE_EXCLUSIONS)
+            {
+                return -1;
+            }
+            gbl_coreExclusions[gbl_numCoreExclusions] = *range;
+            gbl_coreExclusions[gbl_numCoreExclusions].start = end;
+            gbl_coreExclusions[gbl_numCoreExclusions].length = rangeEnd - end;
+            gbl_numCoreExclusions++;
+            range->length = start - range->start;
+            i++;
+        }
+        else if (range->start < start)
+        {
+            range->length = start - range->start;
+            i++;
+        }
+        else if (rangeEnd > end)
+        {
+            range->length = rangeEnd - end;
+            range->start = end;
+            i++;
+        }
+        else
+        {
+            *range = gbl_coreExclusions[--gbl_numCoreExclusions];
+        }
+    }
+
+    return 0;
+}
+
+/***
+ * Set the core dump filter
+ *
+ * @returns zero on success
+ */
+static int coreSetFilter(unsigned int filter)
+{
+    char text[16];
+    int len;
+    int fd;
+
+    fd = open("/proc/self/coredump_filter", O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        DPRINTF(ECRASH_DEBUG_ERROR, "Error: unable to open coredump_filter: %s\n", strerror(errno));
+        return -1;
+    }
+
+    len = snprintf(text, sizeof(text), "0x%x\n", filter);
+    if (write(fd, text, len) != len)
+    {
+        DPRINTF(ECRASH_DEBUG_ERROR, "Error: unable to set coredump_filter: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+    return 0;
+}
+
+/***
+ * Wait for a non-blocking fd to accept more output
+ *
+ * @param fd       File descriptor we're writing to
+ * @param deadline nowNs() time to give up at, or zero to wait forever
+ *
+ * @returns zero when writable, or -1 (errno ETIMEDOUT) past the deadline
+ */
+static int waitWritable(int fd, long long deadline)
+{
+    struct pollfd pfd;
+    int timeoutMs = -1;
+    int rc;
+
+    for (;;)
+    {
+        if (deadline)
+        {
+            long long left = deadline - nowNs();
+
+            if (left <= 0)
+            {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            timeoutMs = (int)((left + 999999) / 1000000);
+        }
+
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        rc = poll(&pfd, 1, timeoutMs);
+        if (rc > 0)
+        {
+            return 0;
+        }
+        if (rc < 0 && errno != EINTR)
+        {
+            return -1;
+        }
+    }
+}
+
+/***
+ * Output a gather list to a fd, looping to avoid being interrupted.
+ *
+ * Short writes are handled by advancing through the iovecs (which are
+ * modified) and writing the rest.  A non-blocking fd that fills up is
+ * polled until the deadline.
+ *
+ * @param fd        File descriptor to write to
+ * @param iov       Buffers to output
+ * @param iovcnt    Number of buffers
+ * @param deadline  nowNs() time to give up at, or zero for none
+ * @param bytes     If not NULL, incremented by every byte that makes it out
+ * @param sendFlags Zero to writev, else flags to sendmsg with (for a socket)
+ *
+ * @returns bytes written, or -1 on failure (errno ETIMEDOUT past the deadline).
+ */
+static ssize_t blockingWritev(int fd, struct iovec *iov, int iovcnt, long long deadline,
+                              unsigned long long *bytes, int sendFlags)
+{
+    ssize_t bytesWritten;
+    ssize_t totalWritten = 0;
+    struct msghdr msg;
+
+    while (iovcnt > 0)
+    {
+        if (sendFlags)
+        {
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = iovcnt;
+            bytesWritten = sendmsg(fd, &msg, sendFlags);
+        }
+        else
+        {
+            bytesWritten = writev(fd, iov, iovcnt);
+        }
+        if (bytesWritten < 0)
+        {
+            if (errno == EINTR && (!deadline || nowNs() < deadline))
+            {
+                continue;
+            }
+            if (errno == EAGAIN && waitWritable(fd, deadline) == 0)
+            {
+                continue;
+            }
+            if (errno == EINTR)
+            {
+                /* Our alarm went off: the deadline has passed */
+                errno = ETIMEDOUT;
+            }
+            return -1;
+        }
+        if (bytesWritten == 0)
+        {
+            return -1;
+        }
+        totalWritten += bytesWritten;
+        if (bytes)
+        {
+            *bytes += bytesWritten;
+        }
+
+        /* Skip what made it out, and pick up mid-buffer if we have to */
+        while (iovcnt > 0 && (size_t)bytesWritten >= iov->iov_len)
+        {
+            bytesWritten -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + bytesWritten;
+            iov->iov_len -= bytesWritten;
+        }
+    }
+
+    return totalWritten;
+}
+
+/***
+ * Get the fd to write a sink through
+ *
+ * Live dumps leave the application's fds in its blocking mode, so they
+ * write through our own non-blocking open of the sink instead (sockets,
+ * which can't be opened again, are sent to with MSG_DONTWAIT).
+ */
+static int sinkFd(OutputSink *sink)
+{
+    return (tls_liveOutput && sink->liveFd > -1) ? sink->liveFd : sink->fd;
+}
+
+/***
+ * Get the sendmsg flags to write a sink with, or zero to just write it
+ */
+static int sinkSendFlags(OutputSink *sink)
+{
+    return (tls_liveOutput && sink->socket) ? MSG_DONTWAIT | MSG_NOSIGNAL : 0;
+}
+
+/***
+ * Bring a sink up to date with the memfd
+ *
+ * Copies everything the sink hasn't seen yet from the memfd, in the
+ * kernel where we can: copy_file_range for files, splice for pipes and
+ * sendfile for anything else.  When the kernel refuses, we drop down to
+ * the next method, ending with a plain pread/write through a bounce
+ * buffer from the arena.
+ *
+ * @param sink     Sink to push to
+ * @param deadline nowNs() time to give up at, or zero for none
+ *
+ * @returns zero, or -1 on failure (errno ETIMEDOUT past the deadline).
+ */
+static int memfdPush(OutputSink *sink, long long deadline)
+{
+    OutputStream *stream = &gbl_streams[sink->stream];
+    int sendFlags = sinkSendFlags(sink);
+    int fd = sinkFd(sink);
+    SinkKind kind;
+
+    while (sink->pushed < stream->memfdLength)
+    {
+        size_t len = stream->memfdLength - sink->pushed;
+        loff_t off = sink->pushed;
+        loff_t fileOff = sink->fileOffset + sink->bytes;
+        off_t sendOff = sink->pushed;
+        ssize_t n = -1;
+        struct iovec iov;
+
+        if (sink->limit && sink->bytes + len > sink->limit)
+        {
+            /* Slot full: what doesn't fit is dropped */
+            sink->truncated = true;
+            len = (sink->bytes < sink->limit) ? sink->limit - sink->bytes : 0;
+            if (len == 0)
+            {
+                sink->pushed = stream->memfdLength;
+                break;
+            }
+        }
+
+        /* sendfile would block on a socket: a live dump sends it the bounce buffer instead */
+        kind = sendFlags ? SINK_KIND_COPY : sink->kind;
+        switch (kind)
+        {
+        case SINK_KIND_FILE:
+            n = copy_file_range(stream->memfd, &off, fd, (sink->fileOffset > -1) ? &fileOff : NULL, len, 0);
+            break;
+        case SINK_KIND_PIPE:
+            n = splice(stream->memfd, &off, fd, NULL, len, 0);
+            break;
+        case SINK_KIND_OTHER:
+            n = sendfile(fd, stream->memfd, &sendOff, len);
+            break;
+        case SINK_KIND_COPY:
+            if (len > ECRASH_OUTPUT_CHUNK_SIZE)
+            {
+                len = ECRASH_OUTPUT_CHUNK_SIZE;
+            }
+            n = pread(stream->memfd, gbl_bounceBuffer, len, sink->pushed);
+            if (n > 0)
+            {
+                iov.iov_base = gbl_bounceBuffer;
+                iov.iov_len = n;
+                if (blockingWritev(fd, &iov, 1, deadline, &sink->bytes, sendFlags) < 0)
+                {
+                    return -1;
+                }
+                sink->pushed += n;
+                continue;
+            }
+            break;
+        }
+
+        if (n < 0 && errno == EINTR && (!deadline || nowNs() < deadline))
+        {
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN)
+        {
+            if (waitWritable(fd, deadline) != 0)
+            {
+                return -1;
+            }
+            continue;
+        }
+        if (n < 0 && kind != SINK_KIND_COPY &&
+            (errno == EINVAL || errno == EXDEV || errno == EBADF || errno == ENOSYS || errno == EOPNOTSUPP))
+        {
+            /* The kernel can't do this one for us; try the next way down */
+            if (kind == SINK_KIND_FILE && sink->fileOffset > -1)
+            {
+                /* The others write at the fd's position, which copy_file_range left behind */
+                lseek(fd, fileOff, SEEK_SET);
+            }
+            sink->kind++;
+            continue;
+        }
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+            {
+                errno = ETIMEDOUT;
+            }
+            return -1;
+        }
+
+        sink->pushed += n;
+        sink->bytes += n;
+    }
+
+    return 0;
+}
+
+/***
+ * Trim a block so it fits in what is left of a sink's slot
+ *
+ * @param sink   Sink to write to
+ * @param iov    The block (trimmed in place)
+ * @param iovcnt Number of iovecs in it
+ *
+ * @returns the number of iovecs left
+ */
+static int sinkClamp(OutputSink *sink, struct iovec *iov, int iovcnt)
+{
+    unsigned long long room;
+    int i;
+
+    if (sink->limit == 0)
+    {
+        return iovcnt;
+    }
+
+    room = (sink->bytes < sink->limit) ? sink->limit - sink->bytes : 0;
+    for (i = 0 ; i < iovcnt ; i++)
+    {
+        if (iov[i].iov_len >= room)
+        {
+            sink->truncated = sink->truncated || iov[i].iov_len > room || i < iovcnt - 1;
+            iov[i].iov_len = room;
+            return room ? i + 1 : i;
+        }
+        room -= iov[i].iov_len;
+    }
+
+    return iovcnt;
+}
+
+/***
+ * Our deadline alarm, for sinks poll can't help with
+ *
+ * Regular files ignore O_NONBLOCK, so a write to a hung NFS server just
+ * blocks.  While crashing, those writes are covered by a timer instead,
+ * which signals the crashing thread itself (a process wide alarm would
+ * go to whichever thread the kernel picks, usually the main one): it
+ * interrupts the write, which returns EINTR.  The handler itself has
+ * nothing to do.
+ *
+ * @param signo Signal received.
+ */
+static void sinkAlarmHandler(int signo)
+{
+}
+
+/***
+ * Write a gather list to one sink, under its deadline
+ *
+ * Keeps the sink's byte count, time taken and failure count up to date.
+ * A sink that misses its deadline, or fails too often, is dropped, and a
+ * note saying so goes into the report.
+ *
+ * @param sink   Sink to write to
+ * @param iov    Buffers to output (NULL to push from the memfd)
+ * @param iovcnt Number of buffers
+ *
+ * @returns zero, or the sink's error code on failure.
+ */
+static int sinkWrite(OutputSink *sink, struct iovec *iov, int iovcnt)
+{
+    struct itimerspec timer;
+    long long start = nowNs();
+    long long deadline = start + (long long)gbl_params.sinkTimeoutMs * 1000000LL;
+    bool armed = false;
+    int rc;
+
+    if (sink->dropped)
+    {
+        return sink->error;
+    }
+    if (sink->idle)
+    {
+        return 0;
+    }
+    if (tls_liveOutput && gbl_crashing)
+    {
+        /* The crash handler wants the outputs: let go, without holding it against the sink */
+        return sink->error;
+    }
+
+    if (sink->regular && gbl_sinkTimer > -1)
+    {
+        memset(&timer, 0, sizeof(timer));
+        timer.it_value.tv_sec = gbl_params.sinkTimeoutMs / 1000;
+        timer.it_value.tv_nsec = (gbl_params.sinkTimeoutMs % 1000) * 1000000L;
+        armed = syscall(SYS_timer_settime, gbl_sinkTimer, 0, &timer, NULL) == 0;
+    }
+
+    if (iov)
+    {
+        iovcnt = sinkClamp(sink, iov, iovcnt);
+        rc = (iovcnt == 0 ||
+              blockingWritev(sinkFd(sink), iov, iovcnt, deadline, &sink->bytes, sinkSendFlags(sink)) >= 0) ? 0 : -1;
+    }
+    else
+    {
+        rc = memfdPush(sink, deadline);
+    }
+
+    if (armed)
+    {
+        memset(&timer, 0, sizeof(timer));
+        syscall(SYS_timer_settime, gbl_sinkTimer, 0, &timer, NULL);
+    }
+
+    sink->nanoseconds += nowNs() - start;
+
+    if (rc == 0)
+    {
+        return 0;
+    }
+
+    sink->failures++;
+    if (errno == ETIMEDOUT || sink->failures >= gbl_params.sinkMaxFailures)
+    {
+        /* There's no point waiting on it again: let the others finish */
+        sink->dropped = true;
+        sink->timedOut = (errno == ETIMEDOUT);
+    }
+
+    return sink->error;
+}
+
+/***
+ * Write a block out to all of a stream's destinations
+ *
+ * In memfd mode, the block goes into the memfd only: the destinations
+ * are brought up to date from there when the stream is written out.
+ *
+ * @param stream Stream the block belongs to
+ * @param iov    The block
+ * @param iovcnt Number of iovecs in it
+ *
+ * @returns zero, or error on failure.
+ */
+static int outputWriteIov(OutputStream *stream, struct iovec *iov, int iovcnt)
+{
+    struct iovec sinkIov[ECRASH_MAX_IOV];
+    int return_value = 0;
+    int s;
+
+    if (stream->memfd > -1)
+    {
+        /* Only one copy, into the memfd: the sinks get theirs later */
+        ssize_t written = blockingWritev(stream->memfd, iov, iovcnt, 0, NULL, 0);
+
+        if (written > 0)
+        {
+            stream->memfdLength += written;
+        }
+        return 0;
+    }
+
+    for (s = 0 ; s < gbl_numSinks ; s++)
+    {
+        if (&gbl_streams[gbl_sinks[s].stream] != stream)
+        {
+            continue;
+        }
+
+        /* blockingWritev consumes its iovecs, so give each sink its own copy */
+        memcpy(sinkIov, iov, sizeof(struct iovec) * iovcnt);
+        if (sinkWrite(&gbl_sinks[s], sinkIov, iovcnt) != 0)
+        {
+            return_value = gbl_sinks[s].error;
+        }
+    }
+
+    return return_value;
+}
+
+/***
+ * Store a little endian integer
+ *
+ * @param p     Where to store it
+ * @param value Value to store
+ * @param bytes Size in bytes
+ */
+static void storeLE(unsigned char *p, unsigned long long value, int bytes)
+{
+    int i;
+
+    for (i = 0 ; i < bytes ; i++)
+    {
+        p[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+/***
+ * Append an LZ sequence length extension (see eCrashRecord.h)
+ *
+ * @param op  Where to write
+ * @param len What is left of the length, after the 15 in the token
+ *
+ * @returns the new write position
+ */
+static unsigned char *lzLength(unsigned char *op, size_t len)
+{
+    while (len >= 255)
+    {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (unsigned char)len;
+
+    return op;
+}
+
+/***
+ * Append one LZ sequence
+ *
+ * @param op       Where to write
+ * @param literals Literal bytes
+ * @param litLen   Number of literal bytes
+ * @param offset   Match offset
+ * @param matchLen Match length, or zero for the last sequence
+ *
+ * @returns the new write position
+ */
+static unsigned char *lzSequence(unsigned char *op, const unsigned char *literals, size_t litLen, size_t offset,
+                                 size_t matchLen)
+{
+    unsigned char *token = op++;
+
+    *token = (litLen >= 15 ? 15 : litLen) << 4;
+    if (litLen >= 15)
+    {
+        op = lzLength(op, litLen - 15);
+    }
+    memcpy(op, literals, litLen);
+    op += litLen;
+
+    if (matchLen)
+    {
+        matchLen -= ECRASH_LZ_MIN_MATCH;
+        *token |= (matchLen >= 15 ? 15 : matchLen);
+        storeLE(op, offset, 2);
+        op += 2;
+        if (matchLen >= 15)
+        {
+            op = lzLength(op, matchLen - 15);
+        }
+    }
+
+    return op;
+}
+
+/***
+ * Compress the pending data of a stream into an LZ block payload
+ *
+ * A simple greedy LZ77 parse with a one entry hash table: it is not the
+ * best compressor around, but it is fast, needs no allocation, and does
+ * very well on backtraces, which repeat the same frames over and over.
+ * Matches may reach back into data already sent in earlier blocks.
+ *
+ * @param lz  Compressor state
+ * @param out Where to write the sequences
+ *
+ * @returns the number of bytes written
+ */
+static size_t lzCompress(LzState *lz, unsigned char *out)
+{
+    unsigned char *w = lz->window;
+    unsigned char *op = out;
+    size_t ip = lz->start;
+    size_t anchor = lz->start;
+
+    while (ip + ECRASH_LZ_MIN_MATCH <= lz->end)
+    {
+        uint32_t seq;
+        uint32_t hash;
+        size_t ref;
+
+        memcpy(&seq, &w[ip], sizeof(seq));
+        hash = (seq * 2654435761u) >> (32 - ECRASH_LZ_HASH_BITS);
+        ref = lz->hash[hash];
+        lz->hash[hash] = ip + 1;
+
+        if (ref && ip - (ref - 1) <= 0xffff && memcmp(&w[ref - 1], &w[ip], ECRASH_LZ_MIN_MATCH) == 0)
+        {
+            size_t len = ECRASH_LZ_MIN_MATCH;
+
+            ref--;
+            while (ip + len < lz->end && w[ref + len] == w[ip + len])
+            {
+                len++;
+            }
+
+            op = lzSequence(op, &w[anchor], ip - anchor, ip - ref, len);
+            ip += len;
+            anchor = ip;
+        }
+        else
+        {
+            ip++;
+        }
+    }
+
+    op = lzSequence(op, &w[anchor], lz->end - anchor, 0, 0);
+    lz->start = lz->end;
+
+    return op - out;
+}
+
+/***
+ * Compress and write out a stream's pending data as one LZ block frame
+ *
+ * @param stream Stream to write out
+ *
+ * @returns zero, or error on failure.
+ */
+static int lzEmit(OutputStream *stream)
+{
+    LzState *lz = stream->lz;
+    unsigned char *payload = lz->out + ECRASH_RECORD_FRAME_HEADER_LEN;
+    size_t rawLen = lz->end - lz->start;
+    size_t len;
+    struct iovec iov;
+
+    if (rawLen == 0)
+    {
+        return 0;
+    }
+
+    len = 4 + lzCompress(lz, payload + 4);
+    storeLE(lz->out, ECRASH_RECORD_LZ_BLOCK, 2);
+    storeLE(lz->out + 2, len, 4);
+    storeLE(payload, rawLen, 4);
+    storeLE(payload + len, eCrashRecord_Crc32(0, lz->out, ECRASH_RECORD_FRAME_HEADER_LEN + len), 4);
+
+    iov.iov_base = lz->out;
+    iov.iov_len = ECRASH_RECORD_FRAME_HEADER_LEN + len + ECRASH_RECORD_FRAME_TRAILER_LEN;
+
+    return outputWriteIov(stream, &iov, 1);
+}
+
+/***
+ * Feed data to a stream's compressor
+ *
+ * Data is compressed a block at a time, as blocks fill up.  The window
+ * keeps the last ECRASH_LZ_WINDOW bytes as history for matches, and is
+ * slid down when it fills.
+ *
+ * @param stream Stream to compress for
+ * @param data   Bytes to add
+ * @param len    Number of bytes
+ *
+ * @returns zero, or error on failure.
+ */
+static int lzFeed(OutputStream *stream, const char *data, size_t len)
+{
+    LzState *lz = stream->lz;
+    int return_value = 0;
+
+    while (len)
+    {
+        size_t n;
+
+        if (lz->end - lz->start == ECRASH_LZ_BLOCK_SIZE)
+        {
+            int rc = lzEmit(stream);
+
+            if (rc != 0)
+            {
+                return_value = rc;
+            }
+        }
+
+        if (lz->end == ECRASH_LZ_WINDOW + ECRASH_LZ_BLOCK_SIZE)
+        {
+            size_t shift = lz->end - ECRASH_LZ_WINDOW;
+            int i;
+
+            memmove(lz->window, lz->window + shift, ECRASH_LZ_WINDOW);
+            for (i = 0 ; i < (1 << ECRASH_LZ_HASH_BITS) ; i++)
+            {
+                lz->hash[i] = (lz->hash[i] > shift) ? lz->hash[i] - shift : 0;
+            }
+            lz->start -= shift;
+            lz->end -= shift;
+        }
+
+        n = ECRASH_LZ_BLOCK_SIZE - (lz->end - lz->start);
+        if (n > ECRASH_LZ_WINDOW + ECRASH_LZ_BLOCK_SIZE - lz->end)
+        {
+            n = ECRASH_LZ_WINDOW + ECRASH_LZ_BLOCK_SIZE - lz->end;
+        }
+        if (n > len)
+        {
+            n = len;
+        }
+
+        memcpy(lz->window + lz->end, data, n);
+        lz->end += n;
+        data += n;
+        len -= n;
+    }
+
+    return return_value;
+}
+
+/***
+ * Set up a compressor, out of the crash arena
+ *
+ * @returns the compressor, or NULL if the arena is short
+ */
+static LzState *lzInit(void)
+{
+    LzState *lz = arenaAlloc(sizeof(LzState));
+
+    if (lz)
+    {
+        lz->window = arenaAlloc(ECRASH_LZ_WINDOW + ECRASH_LZ_BLOCK_SIZE);
+        lz->hash = arenaAlloc(sizeof(uint32_t) << ECRASH_LZ_HASH_BITS);
+        lz->out = arenaAlloc(ECRASH_LZ_OUT_SIZE);
+        if (!lz->window || !lz->hash || !lz->out)
+        {
+            return NULL;
+        }
+        memset(lz->hash, 0, sizeof(uint32_t) << ECRASH_LZ_HASH_BITS);
+        lz->start = lz->end = 0;
+    }
+
+    return lz;
+}
+
+/***
+ * Write out a stream's buffer to all its destinations
+ *
+ * The buffered block (a whole report section) goes out with a single
+ * writev per destination, whatever its size or the number of lines in
+ * it, and the buffer is emptied.  A compressed stream goes out as one or
+ * more LZ blocks instead.  In memfd mode, the block goes into the memfd,
+ * and each destination is brought up to date from there.
+ *
+ * Return failure if we fail to output to any of them.
+ *
+ * @param stream Stream to write out
+ *
+ * @returns zero, or error on failure.
+ */
+static int outputWriteStream(OutputStream *stream)
+{
+    struct iovec iov[ECRASH_MAX_IOV];
+    OutputBuffer *buf = &stream->buf;
+    OutputChunk *chunk = buf->head;
+    int return_value = 0;
+    int rc = 0;
+    int s;
+    int i;
+
+    while (chunk)
+    {
+        int iovcnt = 0;
+
+        /* Gather as many chunks as one writev will take */
+        for ( ; chunk && iovcnt < ECRASH_MAX_IOV ; chunk = (chunk == buf->tail) ? NULL : chunk->next)
+        {
+            if (chunk->len)
+            {
+                iov[iovcnt].iov_base = chunk->data;
+                iov[iovcnt].iov_len = chunk->len;
+                iovcnt++;
+            }
+        }
+
+        if (iovcnt == 0)
+        {
+            break;
+        }
+
+        if (stream->lz)
+        {
+            for (i = 0 ; i < iovcnt ; i++)
+            {
+                rc = lzFeed(stream, iov[i].iov_base, iov[i].iov_len);
+                if (rc != 0)
+                {
+                    return_value = rc;
+                }
+            }
+        }
+        else
+        {
+            rc = outputWriteIov(stream, iov, iovcnt);
+            if (rc != 0)
+            {
+                return_value = rc;
+            }
+        }
+    }
+
+    /* Every section ends a block, so it is out there should we die */
+    if (stream->lz)
+    {
+        rc = lzEmit(stream);
+        if (rc != 0)
+        {
+            return_value = rc;
+        }
+    }
+
+    /* This flush is a checkpoint: hand the sinks everything so far */
+    if (stream->memfd > -1)
+    {
+        for (s = 0 ; s < gbl_numSinks ; s++)
+        {
+            if (&gbl_streams[gbl_sinks[s].stream] == stream && sinkWrite(&gbl_sinks[s], NULL, 0) != 0)
+            {
+                return_value = gbl_sinks[s].error;
+            }
+        }
+    }
+
+    bufReset(buf);
+
+    return return_value;
+}
+
+/***
+ * Flush hook for our stream buffers, for when the arena runs dry
+ *
+ * A live dump lets go of the thread list for the write, as a slow sink
+ * mustn't hold up registration.  The slots stay mapped meanwhile, and
+ * the next one is checked for a thread once the list is ours again.
+ *
+ * @param buf Buffer to write out
+ */
+static void outputFlushHook(OutputBuffer *buf)
+{
+    int i;
+
+    if (tls_threadListHeld)
+    {
+        pthread_mutex_unlock(&ThreadListMutex);
+    }
+
+    for (i = 0 ; i < gbl_numStreams ; i++)
+    {
+        if (&gbl_streams[i].buf == buf)
+        {
+            outputWriteStream(&gbl_streams[i]);
+        }
+    }
+
+    if (tls_threadListHeld)
+    {
+        pthread_mutex_lock(&ThreadListMutex);
+    }
+}
+
+/***
+ * Write out everything appended to the report so far, on every stream
+ *
+ * Any sink dropped along the way gets a note in every stream's next
+ * block.
+ *
+ * @returns zero, or error on failure.
+ */
+static int outputFlush(void)
+{
+    int return_value = 0;
+    int i;
+    int s;
+
+    for (i = 0 ; i < gbl_numStreams ; i++)
+    {
+        int rc = outputWriteStream(&gbl_streams[i]);
+
+        if (rc != 0)
+        {
+            return_value = rc;
+        }
+    }
+
+    for (s = 0 ; s < gbl_numSinks ; s++)
+    {
+        if (gbl_sinks[s].dropped && !gbl_sinks[s].dropNoted)
+        {
+            for (i = 0 ; i < gbl_numStreams ; i++)
+            {
+                gbl_streams[i].encoder->sinkDropped(&gbl_streams[i], &gbl_sinks[s]);
+            }
+            gbl_sinks[s].dropNoted = true;
+        }
+    }
+
+    return return_value;
+}
+
+/***
+ * Add a destination to our sink list
+ *
+ * Invalid fds are ignored, and so are fds we already write to, so
+ * nothing is output twice.  The sink joins the stream for its format,
+ * verbosity and compression, which is created if need be.
+ *
+ * @param fd        File descriptor to write to
+ * @param error     Error code to report when it fails
+ * @param name      What to call it in the report
+ * @param owned     True if we opened it
+ * @param format    Encoding it wants
+ * @param verbosity How much of the report it wants
+ * @param compress  True to LZ compress what it gets
+ *
+ * @returns the new sink, or NULL if it was not added
+ */
+static OutputSink *addSink(int fd, int error, const char *name, bool owned, eCrashFormat format,
+                    eCrashVerbosity verbosity, bool compress)
+{
+    char path[32];
+    OutputSink *sink;
+    struct stat st;
+    int s;
+
+    if (fd < 0 || gbl_numSinks >= ECRASH_MAX_NUM_SINKS)
+    {
+        return NULL;
+    }
+
+    for (s = 0 ; s < gbl_numSinks ; s++)
+    {
+        if (gbl_sinks[s].fd == fd)
+        {
+            return NULL;
+        }
+    }
+
+    if (verbosity == ECRASH_VERBOSITY_DEFAULT)
+    {
+        verbosity = ECRASH_VERBOSITY_NORMAL;
+    }
+
+    sink = &gbl_sinks[gbl_numSinks];
+    memset(sink, 0, sizeof(*sink));
+    sink->fd = fd;
+    sink->name = name;
+    sink->error = error;
+    sink->owned = owned;
+    sink->savedFlags = -1;
+    sink->liveFd = -1;
+    sink->fileOffset = -1;
+    sink->kind = SINK_KIND_OTHER;
+    if (fstat(fd, &st) == 0)
+    {
+        if (S_ISREG(st.st_mode))
+        {
+            /* The kernel won't copy to an O_APPEND file (ours, or the application's): pread/write it */
+            sink->kind = (fcntl(fd, F_GETFL) & O_APPEND) ? SINK_KIND_COPY : SINK_KIND_FILE;
+            sink->regular = true;
+        }
+        else if (S_ISFIFO(st.st_mode))
+        {
+            sink->kind = SINK_KIND_PIPE;
+        }
+        else if (S_ISSOCK(st.st_mode))
+        {
+            sink->socket = true;
+        }
+    }
+
+    if (!sink->regular && !sink->socket)
+    {
+        /* A new open file description, so O_NONBLOCK on it leaves the application's alone */
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+        sink->liveFd = open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+        if (sink->liveFd < 0)
+        {
+            DPRINTF(ECRASH_DEBUG_WARN, "Warning: unable to reopen %s output (fd %d): live dumps will skip it\n",
+                    name, fd);
+        }
+    }
+
+    /* Find (or start) the stream for this encoding */
+    for (sink->stream = 0 ; sink->stream < gbl_numStreams ; sink->stream++)
+    {
+        OutputStream *stream = &gbl_streams[sink->stream];
+
+        if (stream->format == format && stream->verbosity == verbosity && (stream->lz != NULL) == compress)
+        {
+            break;
+        }
+    }
+    if (sink->stream == gbl_numStreams)
+    {
+        OutputStream *stream = &gbl_streams[gbl_numStreams++];
+
+        memset(stream, 0, sizeof(*stream));
+        stream->format = format;
+        stream->verbosity = verbosity;
+        stream->encoder = (format == ECRASH_FORMAT_JSON) ? &gbl_jsonEncoder :
+                          (format == ECRASH_FORMAT_BINARY) ? &gbl_binaryEncoder : &gbl_textEncoder;
+        stream->buf.chunkSize = ECRASH_OUTPUT_CHUNK_SIZE;
+        stream->buf.flush = outputFlushHook;
+        bufRoom(&stream->buf);
+        stream->memfd = -1;
+        if (compress != false)
+        {
+            stream->lz = lzInit();
+            if (stream->lz == NULL)
+            {
+                DPRINTF(ECRASH_DEBUG_ERROR, "Error: unable to set up compression, writing uncompressed\n");
+            }
+        }
+    }
+
+    gbl_numSinks++;
+
+    return sink;
+}
+
+/***
+ * Open a file for a ECRASH_SINK_FILENAME sink
+ *
+ * A plain file is opened O_APPEND, so processes sharing it each get
+ * their reports appended whole, rather than writing over each other
+ * from an end they found before the others wrote.  The kernel won't
+ * copy to such a file, so in memfd mode it gets pread/write.
+ *
+ * @param filename File to open (created if need be)
+ * @param slots    Number of slots, for a slot log, or zero to append
+ *
+ * @returns the fd, or -1 on failure
+ */
+static int openSinkFile(const char *filename, int slots)
+{
+    int flags = (slots > 0) ? O_RDWR | O_CREAT : O_WRONLY | O_CREAT | O_APPEND;
+    int fd;
+
+    /*                     0644 */
+    fd = open(filename, flags, S_IREAD | S_IWRITE | S_IRGRP | S_IROTH);
+    if (fd < 0)
+    {
+        DPRINTF(ECRASH_DEBUG_ERROR, "Error: unable to open %s\n", filename);
+        fd = -1;
+    }
+
+    return fd;
+}
+
+/***
+ * Load a little endian integer
+ *
+ * @param p     Where to load it from
+ * @param bytes Size in bytes
+ *
+ * @returns the value
+ */
+static unsigned long long loadLE(const unsigned char *p, int bytes)
+{
+    unsigned long long value = 0;
+    int i;
+
+    for (i = 0 ; i < bytes ; i++)
+    {
+        value |= (unsigned long long)p[i] << (8 * i);
+    }
+
+    return value;
+}
+
+/***
+ * Set up the space for a file sink's report
+ *
+ * The space is allocated now, so a full disk at crash time can't cost us
+ * the report.  A plain file gets slotSize bytes reserved past its end.
+ * A slot log gets all of its slots allocated, and this report's slot is
+ * picked: the one after the last report's.  The log's header is read
+ * here, at init, so the crash handler only has to write its slot entry.
+ *
+ * @param sink     Sink for the file
+ * @param slots    Number of slots, or zero for a plain file
+ * @param slotSize Size of each slot
+ */
+static void fileSinkInit(OutputSink *sink, int slots, size_t slotSize)
+{
+    unsigned char header[ECRASH_SLOTLOG_HEADER_SIZE];
+    unsigned long long seq = 0;
+    off_t size;
+    bool valid;
+    int i;
+
+    if (slotSize == 0)
+    {
+        slotSize = ECRASH_DEFAULT_SLOT_SIZE;
+    }
+
+    if (slots <= 0)
+    {
+        struct stat st;
+
+        sink->reserve = slotSize;
+        if (fstat(sink->fd, &st) == 0 && fallocate(sink->fd, FALLOC_FL_KEEP_SIZE, st.st_size, slotSize) != 0)
+        {
+            DPRINTF(ECRASH_DEBUG_WARN, "Warning: unable to reserve space for the report\n");
+        }
+        return;
+    }
+
+    if (slots > ECRASH_SLOTLOG_MAX_SLOTS)
+    {
+        slots = ECRASH_SLOTLOG_MAX_SLOTS;
+    }
+
+    /* Use the existing log if its layout is the one we want, else start over */
+    valid = pread(sink->fd, header, sizeof(header), 0) == sizeof(header) &&
+            loadLE(header, 4) == ECRASH_SLOTLOG_MAGIC && loadLE(header + 4, 4) == ECRASH_SLOTLOG_VERSION &&
+            loadLE(header + 8, 4) == (unsigned)slots && loadLE(header + 16, 8) == slotSize;
+    if (!valid)
+    {
+        memset(header, 0, sizeof(header));
+        storeLE(header, ECRASH_SLOTLOG_MAGIC, 4);
+        storeLE(header + 4, ECRASH_SLOTLOG_VERSION, 4);
+        storeLE(header + 8, slots, 4);
+        storeLE(header + 16, slotSize, 8);
+        if (pwrite(sink->fd, header, sizeof(header), 0) != sizeof(header))
+        {
+            DPRINTF(ECRASH_DEBUG_ERROR, "Error: unable to write slot log header\n");
+        }
+    }
+
+    for (i = 0 ; i < slots ; i++)
+    {
+        unsigned long long slotSeq = loadLE(header + ECRASH_SLOTLOG_ENTRIES + i * ECRASH_SLOTLOG_ENTRY_SIZE, 8);
+
+        if (slotSeq > seq)
+        {
+            seq = slotSeq;
+        }
+    }
+
+    size = ECRASH_SLOTLOG_HEADER_SIZE + (off_t)slots * slotSize;
+    if (fallocate(sink->fd, 0, 0, size) != 0)
+    {
+        /* No fallocate on this filesystem: at least get the size right */
+        DPRINTF(ECRASH_DEBUG_WARN, "Warning: unable to preallocate slot log\n");
+        if (ftruncate(sink->fd, size) != 0)
+        {
+            DPRINTF(ECRASH_DEBUG_ERROR, "Error: unable to size slot log\n");
+        }
+    }
+
+    sink->slots = slots;
+    sink->slot = loadLE(header + 12, 4) % slots;
+    sink->slotSeq = seq + 1;
+    sink->limit = slotSize;
+    lseek(sink->fd, ECRASH_SLOTLOG_HEADER_SIZE + (off_t)sink->slot * slotSize, SEEK_SET);
+}
+
+/***
+ * Update a slot log's header for our report
+ *
+ * When we start writing, the next report is pointed at the following
+ * slot (so a dump that never finishes can't stall the rotation), and our
+ * slot is marked as being written.  When we are done, it gets its length.
+ *
+ * A header that can't be written costs the sink a failure and drops it,
+ * as a report can't be found in a slot without its entry; outputFlush
+ * notes it in the report.  (A failure at the end comes too late for
+ * that, but leaves the slot marked as being written.)
+ *
+ * @param sink  Sink for the slot log
+ * @param state ECRASH_SLOT_*
+ */
+static void slotLogMark(OutputSink *sink, int state)
+{
+    unsigned char entry[ECRASH_SLOTLOG_ENTRY_SIZE];
+    unsigned char next[4];
+    bool written;
+
+    storeLE(entry, sink->slotSeq, 8);
+    storeLE(entry + 8, sink->bytes, 8);
+    storeLE(entry + 16, getpid(), 4);
+    storeLE(entry + 20, state, 4);
+    written = pwrite(sink->fd, entry, sizeof(entry), ECRASH_SLOTLOG_ENTRIES + sink->slot * ECRASH_SLOTLOG_ENTRY_SIZE) ==
+              sizeof(entry);
+
+    if (written && state == ECRASH_SLOT_WRITING)
+    {
+        storeLE(next, (sink->slot + 1) % sink->slots, 4);
+        written = pwrite(sink->fd, next, sizeof(next), 12) == sizeof(next);
+    }
+
+    if (!written)
+    {
+        sink->failures++;
+        sink->dropped = true;
+        sink->timedOut = false;
+    }
+}
+
+/***
+ * Put a slot log at the start of this report's slot
+ *
+ * The slot's offset is kept for copy_file_range, and the fd's position
+ * moved there too, for writes that don't give an offset.
+ *
+ * @param sink Sink to position
+ */
+static void sinkFileStart(OutputSink *sink)
+{
+    if (sink->slots)
+    {
+        sink->fileOffset = ECRASH_SLOTLOG_HEADER_SIZE + (off_t)sink->slot * sink->limit;
+        lseek(sink->fd, sink->fileOffset, SEEK_SET);
+    }
+}
+
+/***
+ * Get our sinks ready for the crash handler
+ *
+ * Every sink is switched to non-blocking, so a stalled reader can only
+ * cost us its deadline, and the timer used to interrupt writes to
+ * regular files is set up, aimed at the calling (crashing) thread.  It
+ * is made with the system call, as glibc's timer_create may allocate.
+ */
+static void outputBegin(void)
+{
+    struct sigaction act;
+    struct sigevent event;
+    int s;
+
+    for (s = 0 ; s < gbl_numSinks ; s++)
+    {
+        if (gbl_sinks[s].slots)
+        {
+            slotLogMark(&gbl_sinks[s], ECRASH_SLOT_WRITING);
+        }
+        sinkFileStart(&gbl_sinks[s]);
+
+        gbl_sinks[s].savedFlags = fcntl(gbl_sinks[s].fd, F_GETFL);
+        if (gbl_sinks[s].savedFlags != -1)
+        {
+            fcntl(gbl_sinks[s].fd, F_SETFL, gbl_sinks[s].savedFlags | O_NONBLOCK);
+        }
+    }
+
+    /* No SA_RESTART: the whole point is to interrupt the write */
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = sinkAlarmHandler;
+    sigemptyset(&act.sa_mask);
+    sigaction(SIGALRM, &act, NULL);
+
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGALRM;
+    event.sigev_notify_thread_id = syscall(SYS_gettid);
+    if (syscall(SYS_timer_create, CLOCK_MONOTONIC, &event, &gbl_sinkTimer) != 0)
+    {
+        gbl_sinkTimer = -1;
+    }
+}
+
+/***
+ * Initialize our output (open files, etc)
+ *
+ * This file initializes all output streams.  It is called from
+ * eCrash_Init, so the crash handler itself never has to open anything.
+ *
+ */
+static void outputInit(void)
+{
+    OutputSink *sink;
+    eCrashSink *desc;
+    int i;
+
+    gbl_numSinks = 0;
+    gbl_numStreams = 0;
+
+    if (gbl_params.sinks[0].type == ECRASH_SINK_NONE)
+    {
+        /* The old-style outputs: all text */
+        if (gbl_params.filename)
+        {
+            sink = addSink(openSinkFile(gbl_params.filename, 0), -2, "filename", true, ECRASH_FORMAT_TEXT,
+                           ECRASH_VERBOSITY_NORMAL, false);
+            if (sink)
+            {
+                fileSinkInit(sink, 0, 0);
+                sink->selector = 1 << 0;
+            }
+        }
+        if (gbl_params.filep != NULL)
+        {
+            /* Anything the caller already buffered goes out first */
+            fflush(gbl_params.filep);
+            sink = addSink(fileno(gbl_params.filep), -3, "filep", false, ECRASH_FORMAT_TEXT,
+                           ECRASH_VERBOSITY_NORMAL, false);
+            if (sink)
+            {
+                sink->selector = 1 << 1;
+            }
+        }
+        sink = addSink(gbl_params.fd, -4, "fd", false, ECRASH_FORMAT_TEXT, ECRASH_VERBOSITY_NORMAL, false);
+        if (sink)
+        {
+            sink->selector = 1 << 2;
+        }
+    }
+
+    for (i = 0 ; i < ECRASH_MAX_NUM_SINKS && gbl_params.sinks[i].type != ECRASH_SINK_NONE ; i++)
+    {
+        desc = &gbl_params.sinks[i];
+        sink = NULL;
+        switch (desc->type)
+        {
+        case ECRASH_SINK_FILENAME:
+            if (desc->filename)
+            {
+                sink = addSink(openSinkFile(desc->filename, desc->slots), -2, "filename", true, desc->format,
+                               desc->verbosity, desc->compress);
+                if (sink)
+                {
+                    fileSinkInit(sink, desc->slots, desc->slotSize);
+                }
+            }
+            break;
+        case ECRASH_SINK_FILEP:
+            if (desc->filep != NULL)
+            {
+                fflush(desc->filep);
+                sink = addSink(fileno(desc->filep), -3, "filep", false, desc->format, desc->verbosity,
+                               desc->compress);
+            }
+            break;
+        case ECRASH_SINK_FD:
+            sink = addSink(desc->fd, -4, "fd", false, desc->format, desc->verbosity, desc->compress);
+            break;
+        default:
+            DPRINTF(ECRASH_DEBUG_ERROR, "Error: unknown sink type %d\n", desc->type);
+            break;
+        }
+        if (sink)
+        {
+            sink->selector = 1U << i;
+        }
+    }
+
+    if (gbl_params.useMemfd != false)
+    {
+        gbl_bounceBuffer = arenaAlloc(ECRASH_OUTPUT_CHUNK_SIZE);
+        for (i = 0 ; i < gbl_numStreams && gbl_bounceBuffer ; i++)
+        {
+            gbl_streams[i].memfd = memfd_create("eCrash report", MFD_CLOEXEC);
+            gbl_streams[i].memfdLength = 0;
+            if (gbl_streams[i].memfd < 0)
+            {
+                DPRINTF(ECRASH_DEBUG_ERROR, "Error: unable to set up memfd output, writing directly\n");
+            }
+        }
+    }
+}
+
+/***
+ * Finalize our output (close files, etc)
+ *
+ * This file closes all output streams.
+ *
+ */
+static void outputFini(void)
+{
+    int s;
+
+    for (s = 0 ; s < gbl_numSinks ; s++)
+    {
+        OutputSink *sink = &gbl_sinks[s];
+
+        if (sink->slots)
+        {
+            slotLogMark(sink, (sink->truncated || sink->dropped) ? ECRASH_SLOT_TRUNCATED : ECRASH_SLOT_COMPLETE);
+        }
+
+        /* Our own files only: a global sync() can take seconds on a busy box */
+        if (sink->regular)
+        {
+            fdatasync(sink->fd);
+        }
+
+        /* Put back the blocking mode of the fds we don't own */
+        if (sink->savedFlags != -1)
+        {
+            fcntl(sink->fd, F_SETFL, sink->savedFlags);
+        }
+        if (sink->liveFd > -1)
+        {
+            close(sink->liveFd);
+        }
+
+        /* We wrote a FILE * through its fd; don't fclose it, the caller owns it */
+        if (sink->owned || sink->error == -4)
+        {
+            close(sink->fd);
+        }
+    }
+
+    if (gbl_sinkTimer > -1)
+    {
+        syscall(SYS_timer_delete, gbl_sinkTimer);
+        gbl_sinkTimer = -1;
+    }
+
+    /* Just in case someone tries to output after outputFini */
+    gbl_params.fd = -1;
+    gbl_params.filep = NULL;
+    gbl_numSinks = 0;
+}
+
+/***
+ * Get the outputs ready for a new report
+ *
+ * Clears the sinks' statistics, empties the stream buffers and memfds,
+ * restarts the compressors, and puts slot logs back at the start of
+ * their slot, so whatever a live dump left behind is forgotten.
+ */
+static void outputReset(void)
+{
+    OutputSink *sink;
+    OutputStream *stream;
+    int s;
+
+    for (s = 0 ; s < gbl_numSinks ; s++)
+    {
+        sink = &gbl_sinks[s];
+        sink->pushed = 0;
+        sink->truncated = false;
+        sink->failures = 0;
+        sink->dropped = false;
+        sink->dropNoted = false;
+        sink->timedOut = false;
+        sink->bytes = 0;
+        sink->nanoseconds = 0;
+        sink->idle = false;
+        sinkFileStart(sink);
+    }
+
+    for (s = 0 ; s < gbl_numStreams ; s++)
+    {
+        stream = &gbl_streams[s];
+        bufReset(&stream->buf);
+        if (stream->memfd > -1 && ftruncate(stream->memfd, 0) == 0)
+        {
+            /* Back to the start too, or the next report lands past a hole the size of the last */
+            lseek(stream->memfd, 0, SEEK_SET);
+            stream->memfdLength = 0;
+        }
+        if (stream->lz)
+        {
+            memset(stream->lz->hash, 0, sizeof(uint32_t) << ECRASH_LZ_HASH_BITS);
+            stream->lz->start = stream->lz->end = 0;
+        }
+    }
+}
+
+/***
+ * Get the selected sinks ready for a live dump
+ *
+ * Unlike outputBegin, this leaves the fds' modes and SIGALRM alone: the
+ * application is still running, and may be using both.  Our writes go
+ * through the sinks' own non-blocking opens (or MSG_DONTWAIT) instead,
+ * so they still keep to sinkTimeoutMs.  A sink that could not be opened
+ * again is left out, as a write to it could block forever.
+ *
+ * @param selector Sinks to write to (ECRASH_DUMP_ALL_SINKS for all)
+ */
+static void outputLiveBegin(unsigned int selector)
+{
+    OutputSink *sink;
+    int s;
+
+    outputReset();
+    tls_liveOutput = true;
+    for (s = 0 ; s < gbl_numSinks ; s++)
+    {
+        sink = &gbl_sinks[s];
+        sink->idle = (selector != ECRASH_DUMP_ALL_SINKS && !(selector & sink->selector)) ||
+                     (!sink->regular && !sink->socket && sink->liveFd < 0);
+        if (sink->slots && !sink->idle)
+        {
+            slotLogMark(sink, ECRASH_SLOT_WRITING);
+        }
+    }
+}
+
+/***
+ * Finish a live dump, keeping the sinks open for the next report
+ *
+ * Slot logs move on to their next slot, and files get space reserved
+ * for the next report again.
+ */
+static void outputLiveEnd(void)
+{
+    OutputSink *sink;
+    int s;
+
+    for (s = 0 ; s < gbl_numSinks ; s++)
+    {
+        sink = &gbl_sinks[s];
+        if (sink->idle)
+        {
+            continue;
+        }
+
+        if (sink->slots)
+        {
+            slotLogMark(sink, (sink->truncated || sink->dropped) ? ECRASH_SLOT_TRUNCATED : ECRASH_SLOT_COMPLETE);
+            sink->slot = (sink->slot + 1) % sink->slots;
+            sink->slotSeq++;
+        }
+        else if (sink->owned && sink->regular)
+        {
+            fileSinkInit(sink, 0, sink->reserve);
+        }
+
+        if (sink->regular)
+        {
+            fdatasync(sink->fd);
+        }
+    }
+
+    outputReset();
+    tls_liveOutput = false;
+}
+
+/***
+ * Take the outputs over for the crash handler
+ *
+ * A live dump running on another thread notices the crash and lets go
+ * after the thread it is dumping; we give it as long as a thread gets to
+ * answer.  One running on this thread (which crashed in the middle of
+ * it) is simply abandoned.
+ */
+static void outputClaim(void)
+{
+    struct timespec pollInterval = { 0, 1000000 };
+    pid_t self = syscall(SYS_gettid);
+    pid_t owner;
+    unsigned int i;
+
+    for (i = 0 ; i < gbl_params.threadWaitTime * 1000 ; i++)
+    {
+        owner = __atomic_load_n(&gbl_dumpOwner, __ATOMIC_ACQUIRE);
+        if (owner == 0 || owner == self)
+        {
+            break;
+        }
+        nanosleep(&pollInterval, NULL);
+    }
+
+    /* Ours now, even if this thread crashed in the middle of a live dump */
+    tls_liveOutput = false;
+    outputReset();
+}
+
+static void *lookupClosestSymbol(eCrashSymbolTable *table, void *address)
+{
+    int addr;
+    eCrashSymbol *last = NULL;
+
+    /* For now, use a linear lookup. */
+    DPRINTF(ECRASH_DEBUG_VERBOSE, "Looking for %p in %d symbols\n", address, table->numSymbols);
+    for (addr = 0 ; addr < table->numSymbols ; addr++)
+    {
+        DPRINTF(ECRASH_DEBUG_VERBOSE, "  Examining [%d] %p\n", addr, table->symbols[addr].address);
+        if (table->symbols[addr].address > address)
+        {
+            break;
+        }
+        last = &table->symbols[addr];
+    }
+
+    /* last will either be NULL, or the last address less than the
+     * one we're looking for.
+     */
+    DPRINTF(ECRASH_DEBUG_VERBOSE, "Returning %s (%p)\n", last ? last->function : "(nil)", last ? last->address : 0);
+    return last;
+}
+
+/***
+ * Capture the calling thread's stack
+ *
+ * backtrace() only stores raw return addresses in the buffer we hand
+ * it.  Symbols are resolved when the backtrace is printed, so capture
+ * never allocates.  Never inlined, so bt_handler's backtraces always
+ * start with the same BT_HANDLER_FRAMES frames.
+ *
+ * @param bt    Where to put the stack
+ * @param depth Most frames to unwind (at most maxStackDepth)
+ */
+static __attribute__((noinline)) void captureBacktrace(Backtrace *bt, int depth)
+{
+    if (bt->frames)
+    {
+        bt->entries = backtrace(bt->frames, depth);
+    }
+    else
+    {
+        bt->entries = 0;
+    }
+}
+
+/***
+ * Look for a repeating cycle of frames starting at a given frame
+ *
+ * Runaway recursion shows up as the same handful of return addresses
+ * repeated over and over.  Try every period up to maxCyclePeriod, and
+ * keep the one covering the most frames.
+ *
+ * @param bt      Backtrace to search
+ * @param start   First frame of the candidate cycle
+ * @param end     One past the last frame we may consume
+ * @param repeats Set to the number of times the cycle repeats
+ *
+ * @returns the cycle period in frames, or zero if there is no cycle
+ */
+static int findFrameCycle(Backtrace *bt, int start, int end, int *repeats)
+{
+    int period;
+    int bestPeriod = 0;
+    int bestRepeats = 0;
+
+    for (period = 1 ; period <= gbl_params.maxCyclePeriod ; period++)
+    {
+        int matched = 0;
+        int count;
+
+        if (start + period * ECRASH_MIN_CYCLE_REPEATS > end)
+        {
+            break;
+        }
+
+        while (start + period + matched < end &&
+               bt->frames[start + matched] == bt->frames[start + period + matched])
+        {
+            matched++;
+        }
+
+        count = 1 + matched / period;
+        if (count >= ECRASH_MIN_CYCLE_REPEATS && count * period > bestRepeats * bestPeriod)
+        {
+            bestPeriod = period;
+            bestRepeats = count;
+        }
+    }
+
+    *repeats = bestRepeats;
+    return bestPeriod;
+}
+
+/***
+ * What a frame's address resolves to
+ */
+typedef struct
+{
+    const char *module;         /* Object file, when resolved with dladdr() */
+    const char *function;       /* Symbol, if any */
+    unsigned long offset;       /* From the symbol, or from the module base */
+} FrameInfo;
+
+/***
+ * Resolve a frame's address to a symbol
+ *
+ * A symbol table, if we were given one, wins.  Otherwise, with
+ * useBacktraceSymbols, the frame is resolved with dladdr(), which
+ * (unlike backtrace_symbols) never allocates.
+ *
+ * @param address Return address from the backtrace
+ * @param info    Filled in with what we found
+ *
+ * @returns true if the address was resolved
+ */
+static bool resolveFrame(void *address, FrameInfo *info)
+{
+    Dl_info dlInfo;
+
+    memset(info, 0, sizeof(*info));
+
+    if (gbl_params.symbolTable)
+    {
+        eCrashSymbol *symbol = lookupClosestSymbol(gbl_params.symbolTable, address);
+
+        if (symbol)
+        {
+            info->function = symbol->function;
+            info->offset = (unsigned long)(address - symbol->address);
+            return true;
+        }
+        return false;
+    }
+
+    if (gbl_params.useBacktraceSymbols != false && dladdr(address, &dlInfo) && dlInfo.dli_fname)
+    {
+        info->module = dlInfo.dli_fname;
+        if (dlInfo.dli_sname)
+        {
+            info->function = dlInfo.dli_sname;
+            info->offset = (unsigned long)(address - dlInfo.dli_saddr);
+        }
+        else
+        {
+            info->offset = (unsigned long)(address - dlInfo.dli_fbase);
+        }
+        return true;
+    }
+
+    return false;
+}
+
+/***
+ * Find the run of frames starting at a given frame
+ *
+ * The first stackHeadFrames and last stackTailFrames frames always
+ * stand on their own.  In between, repeating cycles of frames come back
+ * as a single run, so a deep recursion costs a few lines instead of
+ * thousands.
+ *
+ * @param bt      Backtrace to walk
+ * @param i       First frame of the run
+ * @param repeats Set to the number of times the cycle repeats
+ *
+ * @returns the cycle period, or zero for a single, verbatim frame
+ */
+static int nextFrameRun(Backtrace *bt, int i, int *repeats)
+{
+    int headEnd = gbl_params.stackHeadFrames;
+    int tailStart = bt->entries - (int)gbl_params.stackTailFrames;
+
+    *repeats = 0;
+    if (tailStart < headEnd)
+    {
+        tailStart = headEnd;
+    }
+
+    if (i < headEnd || i >= tailStart)
+    {
+        return 0;
+    }
+
+    return findFrameCycle(bt, i, tailStart, repeats);
+}
+
+/***
+ * Print out the description of one frame of a backtrace
+ *
+ * This is the part of the frame line after the "Frame NN: " prefix,
+ * without a trailing newline, so it can be used both for frame lines
+ * and inside cycle summaries.  dladdr() results are printed the same way
+ * backtrace_symbols would have printed them.
+ *
+ * @param out      Buffer to print into
+ * @param address  Return address from the backtrace
+ * @param symbolic False to print the bare address
+ */
+static void outputFrameDescription(OutputBuffer *out, void *address, bool symbolic)
+{
+    FrameInfo info;
+
+    if (symbolic == false || !resolveFrame(address, &info))
+    {
+        bufAppendPtr(out, address);
+    }
+    else if (info.module)
+    {
+        bufAppendStr(out, info.module);
+        bufAppendChar(out, '(');
+        if (info.function)
+        {
+            bufAppendStr(out, info.function);
+        }
+        bufAppendChar(out, '+');
+        bufAppendPtr(out, (void *)info.offset);
+        bufAppendStr(out, ") [");
+        bufAppendPtr(out, address);
+        bufAppendChar(out, ']');
+    }
+    else
+    {
+        bufAppendStr(out, info.function);
+        bufAppendChar(out, '+');
+        bufAppendUDec(out, info.offset);
+    }
+}
+
+/***
+ * Print out (to a text stream) a backtrace
+ *
+ * @param stream Stream to print into
+ * @param bt     Backtrace to print
+ */
+static void textBacktraceFrames(OutputStream *stream, Backtrace *bt)
+{
+    OutputBuffer *out = &stream->buf;
+    bool symbolic = (stream->verbosity != ECRASH_VERBOSITY_MINIMAL);
+    int i;
+    int j;
+
+    for (i = 0 ; i < bt->entries ; )
+    {
+        int repeats;
+        int period = nextFrameRun(bt, i, &repeats);
+
+        if (period == 0)
+        {
+            bufAppendStr(out, "*      Frame ");
+            bufAppendIndex(out, i, 2);
+            bufAppend(out, ": ", 2);
+            outputFrameDescription(out, bt->frames[i], symbolic);
+            bufAppendChar(out, '\n');
+            i++;
+            continue;
+        }
+
+        bufFormat(out, "*      Frames %02d-%02d: cycle of %d frame%s (", i, i + period * repeats - 1, period,
+                  period == 1 ? "" : "s");
+        for (j = 0 ; j < period ; j++)
+        {
+            if (j)
+            {
+                bufAppend(out, ", ", 2);
+            }
+            outputFrameDescription(out, bt->frames[i + j], symbolic);
+        }
+        bufFormat(out, ") x%d\n", repeats);
+
+        i += period * repeats;
+    }
+}
+
+/***
+ * Print annotations, one "key: value" line each
+ *
+ * @param indent What to start each line with
+ */
+static void textAnnotations(OutputStream *stream, const char *indent, const eCrashAnnotation *annotations,
+                            int numAnnotations)
+{
+    OutputBuffer *out = &stream->buf;
+    int i;
+
+    if (numAnnotations == 0 || stream->verbosity == ECRASH_VERBOSITY_MINIMAL)
+    {
+        return;
+    }
+
+    bufFormat(out, "%sAnnotations:\n", indent);
+    for (i = 0 ; i < numAnnotations ; i++)
+    {
+        bufFormat(out, "%s  %s: %s\n", indent, annotations[i].key, annotations[i].value);
+    }
+}
+
+/***
+ * Check whether the report has a core dump section: ranges were
+ * excluded, or the filter was set
+ */
+static bool reportHasCore(OutputStream *stream, ReportHeader *header)
+{
+    return (header->numCoreExclusions || gbl_params.coredumpFilter) && stream->verbosity != ECRASH_VERBOSITY_MINIMAL;
+}
+
+/***
+ * Print the process's resource use
+ */
+static void textResources(OutputStream *stream, const ReportResources *res)
+{
+    OutputBuffer *out = &stream->buf;
+    int i;
+
+    bufFormat(out, "*  Resources:\n"
+                   "*    RSS: %llu KB (peak %llu KB), %llu KB virtual\n"
+                   "*    Page faults: %llu major, %llu minor\n", res->rssKb, res->peakRssKb, res->virtualKb,
+              res->majorFaults, res->minorFaults);
+    if (res->fdLimit)
+    {
+        bufFormat(out, "*    File descriptors: %u of %llu\n", res->fds, res->fdLimit);
+    }
+    else
+    {
+        bufFormat(out, "*    File descriptors: %u (no limit)\n", res->fds);
+    }
+    bufFormat(out, "*    Threads: %u\n"
+                   "*    Mappings: %u, %u anonymous (%llu KB)\n", res->threads, res->mappings, res->anonMappings,
+              res->anonKb);
+    for (i = 0 ; i < res->numMaps ; i++)
+    {
+        bufFormat(out, "*      0x%lx-0x%lx (%lu KB) %s\n", res->maps[i].start, res->maps[i].end,
+                  (res->maps[i].end - res->maps[i].start) / 1024, res->maps[i].path);
+    }
+    if (res->mapsOmitted)
+    {
+        bufFormat(out, "*      ... and %u more files\n", res->mapsOmitted);
+    }
+    bufAppendStr(out, "*\n");
+}
+
+/***
+ * Print the core dump filter and the ranges left out of the core
+ */
+static void textCore(OutputStream *stream, ReportHeader *header)
+{
+    const CoreExclusion *range;
+    int i;
+
+    if (gbl_params.coredumpFilter)
+    {
+        bufFormat(&stream->buf, "*  Core dump filter: 0x%x\n", gbl_params.coredumpFilter);
+    }
+    if (header->numCoreExclusions)
+    {
+        bufAppendStr(&stream->buf, "*  Excluded from core dumps:\n");
+    }
+    for (i = 0 ; i < header->numCoreExclusions ; i++)
+    {
+        range = &header->coreExclusions[i];
+        bufFormat(&stream->buf, "*    %s: 0x%lx-0x%lx (%lu KB)\n", range->name, range->start,
+                  range->start + range->length, range->length / 1024);
+    }
+    bufAppendStr(&stream->buf, "*\n");
+}
+
+static void textHeader(OutputStream *stream, ReportHeader *header)
+{
+    bufFormat(&stream->buf, "*********************************************************\n"
+                            "*               eCrash Crash Handler\n"
+                            "*********************************************************\n"
+                            "*\n");
+    if (header->signo)
+    {
+        bufFormat(&stream->buf, "*  Got a crash! signo=%d\n", header->signo);
+    }
+    else
+    {
+        bufAppendStr(&stream->buf, "*  Live dump: no crash, the process keeps running\n");
+    }
+    if (header->hasAddress)
+    {
+        bufAppendStr(&stream->buf, "*  Fault address: ");
+        bufAppendPtr(&stream->buf, header->address);
+        bufAppendChar(&stream->buf, '\n');
+    }
+    if (header->signature)
+    {
+        bufFormat(&stream->buf, "*  Signature: 0x%016llx\n", header->signature);
+    }
+    bufAppendStr(&stream->buf, "*\n");
+
+    if (header->hang)
+    {
+        bufFormat(&stream->buf, "*  Hang: \"%s\" (0x%lx) sent no heartbeat for %u ms (deadline %u ms)\n*\n",
+                  header->hang->name, header->hang->thread, header->hang->silentMs, header->hang->deadlineMs);
+    }
+
+    if (header->numAnnotations && stream->verbosity != ECRASH_VERBOSITY_MINIMAL)
+    {
+        textAnnotations(stream, "*  ", header->annotations, header->numAnnotations);
+        bufAppendStr(&stream->buf, "*\n");
+    }
+
+    if (reportHasCore(stream, header))
+    {
+        textCore(stream, header);
+    }
+
+    if (header->resources && stream->verbosity != ECRASH_VERBOSITY_MINIMAL)
+    {
+        textResources(stream, header->resources);
+    }
+}
+
+/***
+ * Print a thread's breadcrumbs, with their time relative to the crash
+ */
+static void textBreadcrumbs(OutputStream *stream, ReportThread *thread)
+{
+    OutputBuffer *out = &stream->buf;
+    const eCrashBreadcrumb *crumb;
+    long long age;
+    int i;
+
+    if (thread->numBreadcrumbs == 0 || stream->verbosity == ECRASH_VERBOSITY_MINIMAL)
+    {
+        return;
+    }
+
+    bufAppendStr(out, "*    Breadcrumbs (oldest first):\n");
+    for (i = 0 ; i < thread->numBreadcrumbs ; i++)
+    {
+        crumb = &thread->breadcrumbs[i];
+        age = gbl_crashTime - (long long)crumb->time;
+        bufFormat(out, "*      %lld.%03lld ms %s: id %u, arg 0x%llx\n", (age < 0 ? -age : age) / 1000000,
+                  ((age < 0 ? -age : age) / 1000) % 1000, age < 0 ? "after" : "before", crumb->id,
+                  (unsigned long long)crumb->arg);
+    }
+}
+
+/***
+ * Print captured memory as a hex dump, 16 bytes a line
+ */
+static void textMemory(OutputStream *stream, ReportThread *thread)
+{
+    OutputBuffer *out = &stream->buf;
+    const MemoryRegion *region;
+    unsigned int i;
+    unsigned int j;
+    int r;
+
+    for (r = 0 ; r < thread->numMemory && stream->verbosity == ECRASH_VERBOSITY_FULL ; r++)
+    {
+        region = &thread->memory[r];
+        if (region->length == 0)
+        {
+            bufFormat(out, "*    Memory (%s) at 0x%lx: unreadable\n", region->name, region->address);
+            continue;
+        }
+
+        bufFormat(out, "*    Memory (%s) at 0x%lx: %u bytes\n", region->name, region->address, region->length);
+        for (i = 0 ; i < region->length ; i += 16)
+        {
+            bufFormat(out, "*      %016lx:", region->address + i);
+            for (j = i ; j < i + 16 ; j++)
+            {
+                if (j < region->length)
+                {
+                    bufAppendChar(out, ' ');
+                    bufAppendHex(out, region->bytes[j], 2);
+                }
+                else
+                {
+                    bufAppend(out, "   ", 3);
+                }
+            }
+            bufAppend(out, "  |", 3);
+            for (j = i ; j < i + 16 && j < region->length ; j++)
+            {
+                bufAppendChar(out, region->bytes[j] >= 0x20 && region->bytes[j] < 0x7f ? region->bytes[j] : '.');
+            }
+            bufAppend(out, "|\n", 2);
+        }
+    }
+}
+
+/***
+ * Print a thread's scheduler state and CPU use
+ */
+static void textSched(OutputStream *stream, ReportThread *thread)
+{
+    const ThreadSched *sched = thread->sched;
+
+    if (!sched || stream->verbosity == ECRASH_VERBOSITY_MINIMAL)
+    {
+        return;
+    }
+
+    bufFormat(&stream->buf, "*    State %c%s, cpu %d, %llu.%03llu s user, %llu.%03llu s system, %llu voluntary / %llu "
+              "involuntary switches\n", sched->state, sched->spinning ? " (spinning)" : "", sched->cpu,
+              sched->userMs / 1000, sched->userMs % 1000, sched->systemMs / 1000, sched->systemMs % 1000,
+              sched->voluntary, sched->involuntary);
+}
+
+static void textThread(OutputStream *stream, ReportThread *thread)
+{
+    OutputBuffer *out = &stream->buf;
+
+    if (thread->offending)
+    {
+        bufAppendStr(out, "*  Offending Thread's Backtrace:\n*\n");
+        textBacktraceFrames(stream, thread->backtrace);
+    }
+    else if (thread->captured)
+    {
+        bufFormat(out, "*  Backtrace of \"%s\" (0x%lx)\n", thread->name, thread->thread);
+        textBacktraceFrames(stream, thread->backtrace);
+    }
+    else
+    {
+        bufFormat(out, "*  Error: unable to get backtrace of \"%s\" (0x%lx)\n", thread->name, thread->thread);
+    }
+    textSched(stream, thread);
+    textMemory(stream, thread);
+    textBreadcrumbs(stream, thread);
+    textAnnotations(stream, "*    ", thread->annotations, thread->numAnnotations);
+    bufAppendStr(out, "*\n");
+}
+
+static void textMetrics(OutputStream *stream, ReportMetrics *metrics)
+{
+    OutputBuffer *out = &stream->buf;
+    const uint64_t *buckets;
+    unsigned long long samples;
+    int i;
+    int b;
+
+    if (stream->verbosity == ECRASH_VERBOSITY_MINIMAL || (metrics->numCounters == 0 && metrics->numHistograms == 0))
+    {
+        return;
+    }
+
+    if (metrics->numCounters)
+    {
+        bufAppendStr(out, "*  Counters:\n");
+    }
+    for (i = 0 ; i < metrics->numCounters ; i++)
+    {
+        bufFormat(out, "*    %s: %llu\n", gbl_counterNames[i], (unsigned long long)metrics->totals->counters[i]);
+    }
+
+    if (metrics->numHistograms)
+    {
+        bufAppendStr(out, "*  Histograms:\n");
+    }
+    for (i = 0 ; i < metrics->numHistograms ; i++)
+    {
+        buckets = metrics->totals->histograms[i];
+        samples = histogramSamples(buckets);
+        if (samples == 0)
+        {
+            bufFormat(out, "*    %s: no samples\n", gbl_histogramNames[i]);
+            continue;
+        }
+
+        bufFormat(out, "*    %s: %llu samples, p50 < %llu, p90 < %llu, p99 < %llu, max < %llu\n", gbl_histogramNames[i],
+                  samples, histogramPercentile(buckets, samples, 50), histogramPercentile(buckets, samples, 90),
+                  histogramPercentile(buckets, samples, 99), histogramPercentile(buckets, samples, 100));
+        for (b = 0 ; stream->verbosity == ECRASH_VERBOSITY_FULL && b < ECRASH_HISTOGRAM_BUCKETS ; b++)
+        {
+            if (buckets[b])
+            {
+                bufFormat(out, "*      [%llu, %llu): %llu\n", b ? 1ULL << b : 0ULL, histogramBucketEnd(b),
+                          (unsigned long long)buckets[b]);
+            }
+        }
+    }
+    bufAppendStr(out, "*\n");
+}
+
+static void textSinkDropped(OutputStream *stream, OutputSink *sink)
+{
+    bufFormat(&stream->buf, "*  Note: output %s (fd %d) dropped: %s after %d failure(s)\n", sink->name, sink->fd,
+              sink->timedOut ? "timed out" : "write error", sink->failures);
+}
+
+static void textFooter(OutputStream *stream)
+{
+    OutputBuffer *out = &stream->buf;
+    int s;
+
+    bufAppendStr(out, "*  Outputs:\n");
+    for (s = 0 ; s < gbl_numSinks ; s++)
+    {
+        OutputSink *sink = &gbl_sinks[s];
+
+        if (sink->idle)
+        {
+            continue;
+        }
+        bufFormat(out, "*    %-8s fd %d: %llu bytes in %lld.%03lld ms%s\n", sink->name, sink->fd, sink->bytes,
+                  sink->nanoseconds / 1000000, (sink->nanoseconds / 1000) % 1000,
+                  sink->dropped ? " (dropped)" : "");
+    }
+    bufFormat(out, "*  Dumped in %lld.%03lld ms, then %s\n", gbl_dumpTime / 1000000, (gbl_dumpTime / 1000) % 1000,
+              eCrash_DispositionName(gbl_dumpDisposition));
+#ifdef ECRASH_MALLOC_POISON
+    bufFormat(out, "*  Malloc poison: %d allocator call(s) from the crash path\n", gbl_poisonedAllocations);
+#endif
+    bufAppendStr(out, "*\n"
+                      "*********************************************************\n"
+                      "*               eCrash Crash Handler\n"
+                      "*********************************************************\n");
+}
+
+static void textRepeat(OutputStream *stream, ReportHeader *header)
+{
+    bufFormat(&stream->buf, "eCrash: signo=%d, pid %d, signature 0x%016llx: occurrence %u in %u s, full report "
+              "skipped\n", header->signo, (int)header->pid, header->signature, header->occurrence,
+              header->loopSeconds);
+}
+
+static const ReportEncoder gbl_textEncoder =
+{
+    textHeader, textThread, textMetrics, textSinkDropped, textFooter, textRepeat
+};
+
+/***
+ * Append a string as a JSON string literal (quotes included)
+ *
+ * @param buf Buffer to append to
+ * @param str String to quote, may be NULL (giving null)
+ */
+static void bufAppendJsonStr(OutputBuffer *buf, const char *str)
+{
+    if (str == NULL)
+    {
+        bufAppendStr(buf, "null");
+        return;
+    }
+
+    bufAppendChar(buf, '"');
+    for ( ; *str ; str++)
+    {
+        unsigned char c = *str;
+
+        if (c == '"' || c == '\\')
+        {
+            bufAppendChar(buf, '\\');
+            bufAppendChar(buf, c);
+        }
+        else if (c < 0x20)
+        {
+            bufAppendStr(buf, "\\u");
+            bufAppendHex(buf, c, 4);
+        }
+        else
+        {
+            bufAppendChar(buf, c);
+        }
+    }
+    bufAppendChar(buf, '"');
+}
+
+/***
+ * Append a frame as a JSON object
+ *
+ * @param out      Buffer to append to
+ * @param address  Return address from the backtrace
+ * @param symbolic False to leave the address unresolved
+ */
+static void jsonFrame(OutputBuffer *out, void *address, bool symbolic)
+{
+    FrameInfo info;
+
+    bufAppendStr(out, "{\"pc\":\"");
+    bufAppendPtr(out, address);
+    bufAppendChar(out, '"');
+    if (symbolic != false && resolveFrame(address, &info))
+    {
+        if (info.module)
+        {
+            bufAppendStr(out, ",\"module\":");
+            bufAppendJsonStr(out, info.module);
+        }
+        if (info.function)
+        {
+            bufAppendStr(out, ",\"symbol\":");
+            bufAppendJsonStr(out, info.function);
+        }
+        bufAppendStr(out, ",\"offset\":");
+        bufAppendUDec(out, info.offset);
+    }
+    bufAppendChar(out, '}');
+}
+
+/***
+ * Append annotations as an "annotations" object member
+ */
+static void jsonAnnotations(OutputStream *stream, const eCrashAnnotation *annotations, int numAnnotations)
+{
+    OutputBuffer *out = &stream->buf;
+    int i;
+
+    if (numAnnotations == 0 || stream->verbosity == ECRASH_VERBOSITY_MINIMAL)
+    {
+        return;
+    }
+
+    bufAppendStr(out, ",\"annotations\":{");
+    for (i = 0 ; i < numAnnotations ; i++)
+    {
+        if (i)
+        {
+            bufAppendChar(out, ',');
+        }
+        bufAppendJsonStr(out, annotations[i].key);
+        bufAppendChar(out, ':');
+        bufAppendJsonStr(out, annotations[i].value);
+    }
+    bufAppendChar(out, '}');
+}
+
+/***
+ * Append the core dump filter and excluded ranges, as a "core" member
+ */
+static void jsonCore(OutputStream *stream, ReportHeader *header)
+{
+    OutputBuffer *out = &stream->buf;
+    const CoreExclusion *range;
+    int i;
+
+    bufFormat(out, ",\"core\":{\"filter\":%u,\"excluded\":[", gbl_params.coredumpFilter);
+    for (i = 0 ; i < header->numCoreExclusions ; i++)
+    {
+        range = &header->coreExclusions[i];
+        bufAppendStr(out, i ? ",{\"name\":" : "{\"name\":");
+        bufAppendJsonStr(out, range->name);
+        bufFormat(out, ",\"start\":\"0x%lx\",\"length\":%lu}", range->start, range->length);
+    }
+    bufAppendStr(out, "]}");
+}
+
+/***
+ * Append the process's resource use, as a "resources" member
+ */
+static void jsonResources(OutputStream *stream, const ReportResources *res)
+{
+    OutputBuffer *out = &stream->buf;
+    int i;
+
+    bufFormat(out, ",\"resources\":{\"rssKb\":%llu,\"peakRssKb\":%llu,\"virtualKb\":%llu,\"majorFaults\":%llu,"
+              "\"minorFaults\":%llu,\"fds\":%u,\"fdLimit\":%llu,\"threads\":%u,\"mappings\":%u,"
+              "\"anonymousMappings\":%u,\"anonymousKb\":%llu,\"files\":[", res->rssKb, res->peakRssKb, res->virtualKb,
+              res->majorFaults, res->minorFaults, res->fds, res->fdLimit, res->threads, res->mappings,
+              res->anonMappings, res->anonKb);
+    for (i = 0 ; i < res->numMaps ; i++)
+    {
+        bufAppendStr(out, i ? ",{\"path\":" : "{\"path\":");
+        bufAppendJsonStr(out, res->maps[i].path);
+        bufFormat(out, ",\"start\":\"0x%lx\",\"end\":\"0x%lx\"}", res->maps[i].start, res->maps[i].end);
+    }
+    bufFormat(out, "],\"filesOmitted\":%u}", res->mapsOmitted);
+}
+
+static void jsonHeader(OutputStream *stream, ReportHeader *header)
+{
+    bufFormat(&stream->buf, "{\"type\":\"%s\",\"signo\":%d,\"pid\":%d,\"time\":%lld",
+              header->signo ? "crash" : "dump", header->signo, (int)header->pid, header->time);
+    if (header->hasAddress)
+    {
+        bufAppendStr(&stream->buf, ",\"address\":\"");
+        bufAppendPtr(&stream->buf, header->address);
+        bufAppendChar(&stream->buf, '"');
+    }
+    if (header->signature)
+    {
+        bufFormat(&stream->buf, ",\"signature\":\"0x%016llx\"", header->signature);
+    }
+    if (header->hang)
+    {
+        bufAppendStr(&stream->buf, ",\"hang\":{\"thread\":");
+        bufAppendJsonStr(&stream->buf, header->hang->name);
+        bufFormat(&stream->buf, ",\"id\":\"0x%lx\",\"silentMs\":%u,\"deadlineMs\":%u}", header->hang->thread,
+                  header->hang->silentMs, header->hang->deadlineMs);
+    }
+    jsonAnnotations(stream, header->annotations, header->numAnnotations);
+    if (reportHasCore(stream, header))
+    {
+        jsonCore(stream, header);
+    }
+    if (header->resources && stream->verbosity != ECRASH_VERBOSITY_MINIMAL)
+    {
+        jsonResources(stream, header->resources);
+    }
+    bufAppendStr(&stream->buf, "}\n");
+}
+
+static void jsonThread(OutputStream *stream, ReportThread *thread)
+{
+    OutputBuffer *out = &stream->buf;
+    Backtrace *bt = thread->backtrace;
+    bool symbolic = (stream->verbosity != ECRASH_VERBOSITY_MINIMAL);
+    int i;
+    int j;
+
+    bufAppendStr(out, "{\"type\":\"thread\",\"name\":");
+    bufAppendJsonStr(out, thread->name);
+    bufFormat(out, ",\"thread\":\"0x%lx\",\"offending\":%s,\"captured\":%s", thread->thread,
+              thread->offending ? "true" : "false", thread->captured ? "true" : "false");
+
+    if (thread->captured)
+    {
+        bufAppendStr(out, ",\"frames\":[");
+        for (i = 0 ; i < bt->entries ; )
+        {
+            int repeats;
+            int period = nextFrameRun(bt, i, &repeats);
+
+            if (i)
+            {
+                bufAppendChar(out, ',');
+            }
+
+            if (period == 0)
+            {
+                jsonFrame(out, bt->frames[i], symbolic);
+                i++;
+                continue;
+            }
+
+            bufFormat(out, "{\"first\":%d,\"last\":%d,\"repeats\":%d,\"cycle\":[", i, i + period * repeats - 1,
+                      repeats);
+            for (j = 0 ; j < period ; j++)
+            {
+                if (j)
+                {
+                    bufAppendChar(out, ',');
+                }
+                jsonFrame(out, bt->frames[i + j], symbolic);
+            }
+            bufAppendStr(out, "]}");
+
+            i += period * repeats;
+        }
+        bufAppendChar(out, ']');
+    }
+
+    if (thread->sched && stream->verbosity != ECRASH_VERBOSITY_MINIMAL)
+    {
+        bufFormat(out, ",\"sched\":{\"state\":\"%c\",\"spinning\":%s,\"cpu\":%d,\"userMs\":%llu,\"systemMs\":%llu,"
+                  "\"voluntary\":%llu,\"involuntary\":%llu}", thread->sched->state,
+                  thread->sched->spinning ? "true" : "false", thread->sched->cpu, thread->sched->userMs,
+                  thread->sched->systemMs, thread->sched->voluntary, thread->sched->involuntary);
+    }
+
+    if (thread->numMemory && stream->verbosity == ECRASH_VERBOSITY_FULL)
+    {
+        const MemoryRegion *region;
+        unsigned int j;
+
+        bufAppendStr(out, ",\"memory\":[");
+        for (i = 0 ; i < thread->numMemory ; i++)
+        {
+            region = &thread->memory[i];
+            bufFormat(out, "%s{\"name\":\"%s\",\"address\":\"0x%lx\",\"bytes\":\"", i ? "," : "", region->name,
+                      region->address);
+            for (j = 0 ; j < region->length ; j++)
+            {
+                bufAppendHex(out, region->bytes[j], 2);
+            }
+            bufAppendStr(out, "\"}");
+        }
+        bufAppendChar(out, ']');
+    }
+
+    if (thread->numBreadcrumbs && stream->verbosity != ECRASH_VERBOSITY_MINIMAL)
+    {
+        bufAppendStr(out, ",\"breadcrumbs\":[");
+        for (i = 0 ; i < thread->numBreadcrumbs ; i++)
+        {
+            bufFormat(out, "%s{\"id\":%u,\"arg\":\"0x%llx\",\"age\":%lld}", i ? "," : "",
+                      thread->breadcrumbs[i].id, (unsigned long long)thread->breadcrumbs[i].arg,
+                      gbl_crashTime - (long long)thread->breadcrumbs[i].time);
+        }
+        bufAppendChar(out, ']');
+    }
+    jsonAnnotations(stream, thread->annotations, thread->numAnnotations);
+    bufAppendStr(out, "}\n");
+}
+
+static void jsonMetrics(OutputStream *stream, ReportMetrics *metrics)
+{
+    OutputBuffer *out = &stream->buf;
+    const uint64_t *buckets;
+    unsigned long long samples;
+    bool first;
+    int i;
+    int b;
+
+    if (stream->verbosity == ECRASH_VERBOSITY_MINIMAL || (metrics->numCounters == 0 && metrics->numHistograms == 0))
+    {
+        return;
+    }
+
+    bufAppendStr(out, "{\"type\":\"metrics\",\"counters\":{");
+    for (i = 0 ; i < metrics->numCounters ; i++)
+    {
+        if (i)
+        {
+            bufAppendChar(out, ',');
+        }
+        bufAppendJsonStr(out, gbl_counterNames[i]);
+        bufFormat(out, ":%llu", (unsigned long long)metrics->totals->counters[i]);
+    }
+
+    bufAppendStr(out, "},\"histograms\":{");
+    for (i = 0 ; i < metrics->numHistograms ; i++)
+    {
+        buckets = metrics->totals->histograms[i];
+        samples = histogramSamples(buckets);
+        if (i)
+        {
+            bufAppendChar(out, ',');
+        }
+        bufAppendJsonStr(out, gbl_histogramNames[i]);
+        bufFormat(out, ":{\"samples\":%llu", samples);
+        if (samples)
+        {
+            bufFormat(out, ",\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"max\":%llu",
+                      histogramPercentile(buckets, samples, 50), histogramPercentile(buckets, samples, 90),
+                      histogramPercentile(buckets, samples, 99), histogramPercentile(buckets, samples, 100));
+        }
+
+        /* Non empty buckets, as [start, count] pairs */
+        if (stream->verbosity == ECRASH_VERBOSITY_FULL)
+        {
+            bufAppendStr(out, ",\"buckets\":[");
+            for (b = 0, first = true ; b < ECRASH_HISTOGRAM_BUCKETS ; b++)
+            {
+                if (buckets[b])
+                {
+                    bufFormat(out, "%s[%llu,%llu]", first ? "" : ",", b ? 1ULL << b : 0ULL,
+                              (unsigned long long)buckets[b]);
+                    first = false;
+                }
+            }
+            bufAppendChar(out, ']');
+        }
+        bufAppendChar(out, '}');
+    }
+    bufAppendStr(out, "}}\n");
+}
+
+static void jsonSinkDropped(OutputStream *stream, OutputSink *sink)
+{
+    bufFormat(&stream->buf, "{\"type\":\"dropped\",\"output\":\"%s\",\"fd\":%d,\"reason\":\"%s\",\"failures\":%d}\n",
+              sink->name, sink->fd, sink->timedOut ? "timed out" : "write error", sink->failures);
+}
+
+static void jsonFooter(OutputStream *stream)
+{
+    OutputBuffer *out = &stream->buf;
+    bool first = true;
+    int s;
+
+    bufAppendStr(out, "{\"type\":\"outputs\",\"outputs\":[");
+    for (s = 0 ; s < gbl_numSinks ; s++)
+    {
+        OutputSink *sink = &gbl_sinks[s];
+
+        if (sink->idle)
+        {
+            continue;
+        }
+        bufFormat(out, "%s{\"name\":\"%s\",\"fd\":%d,\"bytes\":%llu,\"nanoseconds\":%lld,\"dropped\":%s}",
+                  first ? "" : ",", sink->name, sink->fd, sink->bytes, sink->nanoseconds,
+                  sink->dropped ? "true" : "false");
+        first = false;
+    }
+    bufFormat(out, "],\"dumpNanoseconds\":%lld,\"disposition\":\"%s\"}\n", gbl_dumpTime,
+              eCrash_DispositionName(gbl_dumpDisposition));
+#ifdef ECRASH_MALLOC_POISON
+    bufFormat(out, "{\"type\":\"poison\",\"allocations\":%d}\n", gbl_poisonedAllocations);
+#endif
+    bufAppendStr(out, "{\"type\":\"end\"}\n");
+}
+
+static void jsonRepeat(OutputStream *stream, ReportHeader *header)
+{
+    bufFormat(&stream->buf, "{\"type\":\"repeat\",\"signo\":%d,\"pid\":%d,\"time\":%lld,\"signature\":\"0x%016llx\","
+              "\"occurrence\":%u,\"seconds\":%u}\n", header->signo, (int)header->pid, header->time, header->signature,
+              header->occurrence, header->loopSeconds);
+}
+
+static const ReportEncoder gbl_jsonEncoder =
+{
+    jsonHeader, jsonThread, jsonMetrics, jsonSinkDropped, jsonFooter, jsonRepeat
+};
+
+/*
+ * Binary records (see eCrashRecord.h).
+ *
+ * Every section is one or more CRC protected frames, so a record cut
+ * short by a dying process can still be decoded up to the tear.
+ */
+
+/***
+ * Append bytes to a binary stream, adding them to the frame's CRC
+ *
+ * @param stream Stream to append to
+ * @param data   Bytes to append
+ * @param len    Number of bytes
+ */
+static void binaryAppend(OutputStream *stream, const void *data, size_t len)
+{
+    stream->crc = eCrashRecord_Crc32(stream->crc, data, len);
+    bufAppend(&stream->buf, data, len);
+}
+
+/***
+ * Append a little endian integer of the given size
+ *
+ * @param stream Stream to append to
+ * @param value  Value to append
+ * @param bytes  Size in bytes
+ */
+static void binaryAppendLE(OutputStream *stream, unsigned long long value, int bytes)
+{
+    char data[8];
+    int i;
+
+    for (i = 0 ; i < bytes ; i++)
+    {
+        data[i] = (char)(value >> (8 * i));
+    }
+    binaryAppend(stream, data, bytes);
+}
+
+/***
+ * Length of a string, as stored in a record
+ */
+static size_t binaryStrLen(const char *str)
+{
+    size_t len = str ? strlen(str) : 0;
+
+    return len > 0xffff ? 0xffff : len;
+}
+
+/***
+ * Append a length prefixed string
+ *
+ * @param stream Stream to append to
+ * @param str    String, may be NULL (giving an empty string)
+ */
+static void binaryAppendStr(OutputStream *stream, const char *str)
+{
+    size_t len = binaryStrLen(str);
+
+    binaryAppendLE(stream, len, 2);
+    binaryAppend(stream, str, len);
+}
+
+/***
+ * Start a frame
+ *
+ * @param stream Stream to append to
+ * @param type   ECRASH_RECORD_*
+ * @param len    Length of the payload to follow
+ */
+static void binaryFrameStart(OutputStream *stream, eCrashRecordType type, size_t len)
+{
+    stream->crc = 0;
+    binaryAppendLE(stream, type, 2);
+    binaryAppendLE(stream, len, 4);
+}
+
+/***
+ * Finish a frame, with the CRC of everything since binaryFrameStart
+ *
+ * @param stream Stream to append to
+ */
+static void binaryFrameEnd(OutputStream *stream)
+{
+    binaryAppendLE(stream, stream->crc, 4);
+}
+
+/***
+ * One ANNOTATION frame per annotation
+ */
+static void binaryAnnotations(OutputStream *stream, const eCrashAnnotation *annotations, int numAnnotations)
+{
+    int i;
+
+    for (i = 0 ; i < numAnnotations && stream->verbosity != ECRASH_VERBOSITY_MINIMAL ; i++)
+    {
+        binaryFrameStart(stream, ECRASH_RECORD_ANNOTATION,
+                         2 + binaryStrLen(annotations[i].key) + 2 + binaryStrLen(annotations[i].value));
+        binaryAppendStr(stream, annotations[i].key);
+        binaryAppendStr(stream, annotations[i].value);
+        binaryFrameEnd(stream);
+    }
+}
+
+/***
+ * Start a record: its START and HEADER frames
+ */
+static void binaryStart(OutputStream *stream, ReportHeader *header)
+{
+    binaryFrameStart(stream, ECRASH_RECORD_START, 4 + 2);
+    binaryAppendLE(stream, ECRASH_RECORD_MAGIC, 4);
+    binaryAppendLE(stream, ECRASH_RECORD_VERSION, 2);
+    binaryFrameEnd(stream);
+
+    binaryFrameStart(stream, ECRASH_RECORD_HEADER, 4 + 4 + 8 + 8 + 8);
+    binaryAppendLE(stream, header->signo, 4);
+    binaryAppendLE(stream, header->pid, 4);
+    binaryAppendLE(stream, header->time, 8);
+    binaryAppendLE(stream, (unsigned long)header->address, 8);
+    binaryAppendLE(stream, header->signature, 8);
+    binaryFrameEnd(stream);
+}
+
+static void binaryHeader(OutputStream *stream, ReportHeader *header)
+{
+    binaryStart(stream, header);
+
+    if (header->hang)
+    {
+        binaryFrameStart(stream, ECRASH_RECORD_HANG, 8 + 4 + 4 + 2 + binaryStrLen(header->hang->name));
+        binaryAppendLE(stream, header->hang->thread, 8);
+        binaryAppendLE(stream, header->hang->silentMs, 4);
+        binaryAppendLE(stream, header->hang->deadlineMs, 4);
+        binaryAppendStr(stream, header->hang->name);
+        binaryFrameEnd(stream);
+    }
+
+    binaryAnnotations(stream, header->annotations, header->numAnnotations);
+
+    if (reportHasCore(stream, header))
+    {
+        size_t len = 4 + 4;
+        int i;
+
+        for (i = 0 ; i < header->numCoreExclusions ; i++)
+        {
+            len += 8 + 8 + 2 + binaryStrLen(header->coreExclusions[i].name);
+        }
+
+        binaryFrameStart(stream, ECRASH_RECORD_CORE, len);
+        binaryAppendLE(stream, gbl_params.coredumpFilter, 4);
+        binaryAppendLE(stream, header->numCoreExclusions, 4);
+        for (i = 0 ; i < header->numCoreExclusions ; i++)
+        {
+            binaryAppendLE(stream, header->coreExclusions[i].start, 8);
+            binaryAppendLE(stream, header->coreExclusions[i].length, 8);
+            binaryAppendStr(stream, header->coreExclusions[i].name);
+        }
+        binaryFrameEnd(stream);
+    }
+
+    if (header->resources && stream->verbosity != ECRASH_VERBOSITY_MINIMAL)
+    {
+        const ReportResources *res = header->resources;
+        size_t len = 8 * 5 + 4 + 8 + 4 * 3 + 8 + 4 * 2;
+        int i;
+
+        for (i = 0 ; i < res->numMaps ; i++)
+        {
+            len += 8 + 8 + 2 + binaryStrLen(res->maps[i].path);
+        }
+
+        binaryFrameStart(stream, ECRASH_RECORD_RESOURCES, len);
+        binaryAppendLE(stream, res->rssKb, 8);
+        binaryAppendLE(stream, res->peakRssKb, 8);
+        binaryAppendLE(stream, res->virtualKb, 8);
+        binaryAppendLE(stream, res->majorFaults, 8);
+        binaryAppendLE(stream, res->minorFaults, 8);
+        binaryAppendLE(stream, res->fds, 4);
+        binaryAppendLE(stream, res->fdLimit, 8);
+        binaryAppendLE(stream, res->threads, 4);
+        binaryAppendLE(stream, res->mappings, 4);
+        binaryAppendLE(stream, res->anonMappings, 4);
+        binaryAppendLE(stream, res->anonKb, 8);
+        binaryAppendLE(stream, res->mapsOmitted, 4);
+        binaryAppendLE(stream, res->numMaps, 4);
+        for (i = 0 ; i < res->numMaps ; i++)
+        {
+            binaryAppendLE(stream, res->maps[i].start, 8);
+            binaryAppendLE(stream, res->maps[i].end, 8);
+            binaryAppendStr(stream, res->maps[i].path);
+        }
+        binaryFrameEnd(stream);
+    }
+}
+
+static void binaryThread(OutputStream *stream, ReportThread *thread)
+{
+    Backtrace *bt = thread->backtrace;
+    int i;
+
+    binaryFrameStart(stream, ECRASH_RECORD_THREAD, 8 + 1 + 2 + binaryStrLen(thread->name));
+    binaryAppendLE(stream, thread->thread, 8);
+    binaryAppendLE(stream, (thread->offending ? ECRASH_THREAD_OFFENDING : 0) |
+                   (thread->captured ? ECRASH_THREAD_CAPTURED : 0), 1);
+    binaryAppendStr(stream, thread->name);
+    binaryFrameEnd(stream);
+
+    if (thread->captured)
+    {
+        binaryFrameStart(stream, ECRASH_RECORD_FRAMES, 4 + 8 * bt->entries);
+        binaryAppendLE(stream, bt->entries, 4);
+        for (i = 0 ; i < bt->entries ; i++)
+        {
+            binaryAppendLE(stream, (unsigned long)bt->frames[i], 8);
+        }
+        binaryFrameEnd(stream);
+    }
+
+    if (thread->sched && stream->verbosity != ECRASH_VERBOSITY_MINIMAL)
+    {
+        binaryFrameStart(stream, ECRASH_RECORD_SCHED, 1 + 1 + 4 + 8 * 4);
+        binaryAppendLE(stream, thread->sched->state, 1);
+        binaryAppendLE(stream, thread->sched->spinning, 1);
+        binaryAppendLE(stream, thread->sched->cpu, 4);
+        binaryAppendLE(stream, thread->sched->userMs, 8);
+        binaryAppendLE(stream, thread->sched->systemMs, 8);
+        binaryAppendLE(stream, thread->sched->voluntary, 8);
+        binaryAppendLE(stream, thread->sched->involuntary, 8);
+        binaryFrameEnd(stream);
+    }
+
+    for (i = 0 ; i < thread->numMemory && stream->verbosity == ECRASH_VERBOSITY_FULL ; i++)
+    {
+        const MemoryRegion *region = &thread->memory[i];
+
+        binaryFrameStart(stream, ECRASH_RECORD_MEMORY, 2 + binaryStrLen(region->name) + 8 + 4 + region->length);
+        binaryAppendStr(stream, region->name);
+        binaryAppendLE(stream, region->address, 8);
+        binaryAppendLE(stream, region->length, 4);
+        binaryAppend(stream, region->bytes, region->length);
+        binaryFrameEnd(stream);
+    }
+
+    if (thread->numBreadcrumbs && stream->verbosity != ECRASH_VERBOSITY_MINIMAL)
+    {
+        binaryFrameStart(stream, ECRASH_RECORD_BREADCRUMBS, 4 + 20 * thread->numBreadcrumbs);
+        binaryAppendLE(stream, thread->numBreadcrumbs, 4);
+        for (i = 0 ; i < thread->numBreadcrumbs ; i++)
+        {
+            binaryAppendLE(stream, gbl_crashTime - (long long)thread->breadcrumbs[i].time, 8);
+            binaryAppendLE(stream, thread->breadcrumbs[i].id, 4);
+            binaryAppendLE(stream, thread->breadcrumbs[i].arg, 8);
+        }
+        binaryFrameEnd(stream);
+    }
+
+    binaryAnnotations(stream, thread->annotations, thread->numAnnotations);
+}
+
+static void binaryMetrics(OutputStream *stream, ReportMetrics *metrics)
+{
+    const uint64_t *buckets;
+    int count;
+    int i;
+    int b;
+
+    if (stream->verbosity == ECRASH_VERBOSITY_MINIMAL)
+    {
+        return;
+    }
+
+    for (i = 0 ; i < metrics->numCounters ; i++)
+    {
+        binaryFrameStart(stream, ECRASH_RECORD_COUNTER, 2 + binaryStrLen(gbl_counterNames[i]) + 8);
+        binaryAppendStr(stream, gbl_counterNames[i]);
+        binaryAppendLE(stream, metrics->totals->counters[i], 8);
+        binaryFrameEnd(stream);
+    }
+
+    for (i = 0 ; i < metrics->numHistograms ; i++)
+    {
+        buckets = metrics->totals->histograms[i];
+        for (b = 0, count = 0 ; b < ECRASH_HISTOGRAM_BUCKETS ; b++)
+        {
+            count += (buckets[b] != 0);
+        }
+
+        binaryFrameStart(stream, ECRASH_RECORD_HISTOGRAM, 2 + binaryStrLen(gbl_histogramNames[i]) + 4 + 9 * count);
+        binaryAppendStr(stream, gbl_histogramNames[i]);
+        binaryAppendLE(stream, count, 4);
+        for (b = 0 ; b < ECRASH_HISTOGRAM_BUCKETS ; b++)
+        {
+            if (buckets[b])
+            {
+                binaryAppendLE(stream, b, 1);
+                binaryAppendLE(stream, buckets[b], 8);
+            }
+        }
+        binaryFrameEnd(stream);
+    }
+}
+
+static void binarySinkDropped(OutputStream *stream, OutputSink *sink)
+{
+    binaryFrameStart(stream, ECRASH_RECORD_DROPPED, 4 + 4 + 1 + 2 + binaryStrLen(sink->name));
+    binaryAppendLE(stream, sink->fd, 4);
+    binaryAppendLE(stream, sink->failures, 4);
+    binaryAppendLE(stream, sink->timedOut, 1);
+    binaryAppendStr(stream, sink->name);
+    binaryFrameEnd(stream);
+}
+
+static void binaryFooter(OutputStream *stream)
+{
+    size_t len = 4 + 8 + 1;
+    int count = 0;
+    int s;
+
+    for (s = 0 ; s < gbl_numSinks ; s++)
+    {
+        if (!gbl_sinks[s].idle)
+        {
+            len += 4 + 1 + 8 + 8 + 2 + binaryStrLen(gbl_sinks[s].name);
+            count++;
+        }
+    }
+
+    binaryFrameStart(stream, ECRASH_RECORD_OUTPUTS, len);
+    binaryAppendLE(stream, count, 4);
+    for (s = 0 ; s < gbl_numSinks ; s++)
+    {
+        if (gbl_sinks[s].idle)
+        {
+            continue;
+        }
+        binaryAppendLE(stream, gbl_sinks[s].fd, 4);
+        binaryAppendLE(stream, gbl_sinks[s].dropped, 1);
+        binaryAppendLE(stream, gbl_sinks[s].bytes, 8);
+        binaryAppendLE(stream, gbl_sinks[s].nanoseconds, 8);
+        binaryAppendStr(stream, gbl_sinks[s].name);
+    }
+    binaryAppendLE(stream, gbl_dumpTime, 8);
+    binaryAppendLE(stream, gbl_dumpDisposition, 1);
+    binaryFrameEnd(stream);
+
+    binaryFrameStart(stream, ECRASH_RECORD_END, 0);
+    binaryFrameEnd(stream);
+}
+
+static void binaryRepeat(OutputStream *stream, ReportHeader *header)
+{
+    binaryStart(stream, header);
+
+    binaryFrameStart(stream, ECRASH_RECORD_REPEAT, 4 + 4);
+    binaryAppendLE(stream, header->occurrence, 4);
+    binaryAppendLE(stream, header->loopSeconds, 4);
+    binaryFrameEnd(stream);
+
+    binaryFrameStart(stream, ECRASH_RECORD_END, 0);
+    binaryFrameEnd(stream);
+}
+
+static const ReportEncoder gbl_binaryEncoder =
+{
+    binaryHeader, binaryThread, binaryMetrics, binarySinkDropped, binaryFooter, binaryRepeat
+};
+
+/***
+ * Hand a thread's backtrace to every stream that wants it
+ *
+ * Minimal streams only get the offending thread.
+ *
+ * @param thread Thread to report
+ */
+static void reportThread(ReportThread *thread)
+{
+    int i;
+
+    for (i = 0 ; i < gbl_numStreams ; i++)
+    {
+        if (thread->offending || gbl_streams[i].verbosity != ECRASH_VERBOSITY_MINIMAL)
+        {
+            gbl_streams[i].encoder->thread(&gbl_streams[i], thread);
+        }
+    }
+}
+
+/***
+ * Open a file of /proc/self/task/<tid>, without allocating
+ *
+ * @param tid  Thread
+ * @param file File name ("stat", "status", ...)
+ *
+ * @returns the fd, or -1
+ */
+static int taskOpen(pid_t tid, const char *file)
+{
+    char digits[24];
+    char *p = formatUDec(&digits[sizeof(digits)], tid);
+    size_t len = &digits[sizeof(digits)] - p;
+    char path[48];
+
+    if (gbl_taskDirFd < 0 || len + 1 + strlen(file) >= sizeof(path))
+    {
+        return -1;
+    }
+    memcpy(path, p, len);
+    path[len] = '/';
+    strcpy(path + len + 1, file);
+
+    return openat(gbl_taskDirFd, path, O_RDONLY | O_CLOEXEC);
+}
+
+/***
+ * Read a file of /proc/self/task/<tid>, without allocating
+ *
+ * @param tid  Thread
+ * @param file File name ("stat", "status", ...)
+ * @param buf  Where to read it (terminated)
+ * @param size Its size
+ *
+ * @returns the number of bytes read, or -1
+ */
+static ssize_t taskRead(pid_t tid, const char *file, char *buf, size_t size)
+{
+    ssize_t got;
+    int fd;
+
+    fd = taskOpen(tid, file);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    got = read(fd, buf, size - 1);
+    close(fd);
+    if (got < 0)
+    {
+        return -1;
+    }
+
+    buf[got] = '\0';
+    return got;
+}
+
+/***
+ * Parse a decimal number, skipping leading blanks
+ *
+ * @param p Where to start (moved past the number)
+ */
+static unsigned long long parseUDec(const char **p)
+{
+    unsigned long long value = 0;
+
+    while (**p == ' ' || **p == '\t')
+    {
+        (*p)++;
+    }
+    while (**p >= '0' && **p <= '9')
+    {
+        value = value * 10 + (*(*p)++ - '0');
+    }
+
+    return value;
+}
+
+/***
+ * Find a field of a /proc status file
+ *
+ * @param buf  The file
+ * @param name Field name, with its colon
+ *
+ * @returns its value (sizes are in KB), or 0 if it isn't there
+ */
+static unsigned long long statusField(const char *buf, const char *name)
+{
+    size_t len = strlen(name);
+    const char *p = buf;
+
+    /* Fields start lines, and a name may end another (voluntary_ctxt_switches) */
+    while ((p = strstr(p, name)) != NULL)
+    {
+        if (p == buf || p[-1] == '\n')
+        {
+            p += len;
+            return parseUDec(&p);
+        }
+        p += len;
+    }
+
+    return 0;
+}
+
+/***
+ * Read how long a thread has been runnable, in ns: on the CPU, or waiting
+ * for one (the first two fields of schedstat, which counts in ns rather
+ * than clock ticks).  A spinning thread is always runnable, however many
+ * others share its CPU.
+ *
+ * @returns the time, or 0 if it couldn't be read
+ */
+static unsigned long long taskRunnableTime(pid_t tid)
+{
+    char buf[128];
+    const char *p = buf;
+    unsigned long long running;
+
+    if (taskRead(tid, "schedstat", buf, sizeof(buf)) <= 0)
+    {
+        return 0;
+    }
+    running = parseUDec(&p);
+
+    return running + parseUDec(&p);
+}
+
+/***
+ * Note every registered thread's runnable time as the dump starts, to
+ * tell later which of them kept running through it
+ */
+static void schedSampleStart(void)
+{
+    ThreadSlot *slot;
+    int t;
+
+    for (t = 0 ; ThreadSlots && t < gbl_params.maxThreads ; t++)
+    {
+        slot = &ThreadSlots[t];
+        if (__atomic_load_n(&slot->inUse, __ATOMIC_ACQUIRE))
+        {
+            slot->runnableAtStart = taskRunnableTime(slot->tid);
+            slot->sampledAt = nowNs();
+        }
+    }
+}
+
+/***
+ * Read a thread's scheduler state and CPU use
+ *
+ * From stat: the state (field 3), user and system time (14 and 15) and
+ * the last CPU (39); from status: the context switches.  A running
+ * thread that was runnable for at least half of the time since
+ * schedSampleStart is flagged as spinning.
+ *
+ * @param tid   Thread
+ * @param slot  Its slot, for the spin check, or NULL
+ * @param sched Filled in
+ *
+ * @returns false if the thread's stat couldn't be read
+ */
+static bool captureSched(pid_t tid, ThreadSlot *slot, ThreadSched *sched)
+{
+    char buf[4096];
+    const char *p;
+    long long elapsed;
+    long long runnable;
+    int field;
+
+    memset(sched, 0, sizeof(*sched));
+    if (taskRead(tid, "stat", buf, sizeof(buf)) <= 0 || (p = strrchr(buf, ')')) == NULL)
+    {
+        return false;
+    }
+
+    /* The command name may hold anything, so count fields from its closing parenthesis */
+    p++;
+    for (field = 3 ; field <= 39 && *p ; field++)
+    {
+        while (*p == ' ')
+        {
+            p++;
+        }
+        switch (field)
+        {
+        case 3:
+            sched->state = *p;
+            break;
+        case 14:
+            sched->userMs = parseUDec(&p) * 1000 / gbl_clockTicks;
+            break;
+        case 15:
+            sched->systemMs = parseUDec(&p) * 1000 / gbl_clockTicks;
+            break;
+        case 39:
+            sched->cpu = parseUDec(&p);
+            break;
+        }
+        while (*p && *p != ' ')
+        {
+            p++;
+        }
+    }
+
+    if (taskRead(tid, "status", buf, sizeof(buf)) > 0)
+    {
+        sched->voluntary = statusField(buf, "voluntary_ctxt_switches:");
+        sched->involuntary = statusField(buf, "nonvoluntary_ctxt_switches:");
+    }
+
+    if (slot && slot->sampledAt && sched->state == 'R')
+    {
+        elapsed = nowNs() - slot->sampledAt;
+        runnable = taskRunnableTime(tid) - slot->runnableAtStart;
+        sched->spinning = (elapsed >= 1000000 && runnable * 2 >= elapsed);
+    }
+
+    return true;
+}
+
+/***
+ * Open the /proc files for the resource section, so they can still be
+ * read when the process has run out of fds
+ */
+static void resourcesInit(void)
+{
+    gbl_procStatusFd = open("/proc/self/status", O_RDONLY | O_CLOEXEC);
+    gbl_procMapsFd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    gbl_procFdDirFd = open("/proc/self/fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (gbl_procStatusFd < 0 || gbl_procMapsFd < 0 || gbl_procFdDirFd < 0)
+    {
+        DPRINTF(ECRASH_DEBUG_ERROR, "Error: unable to open /proc/self for the resource section: %s\n",
+                strerror(errno));
+    }
+}
+
+/***
+ * Parse a hex number
+ *
+ * @param p Where to start (moved past the number)
+ */
+static unsigned long parseHex(const char **p)
+{
+    unsigned long value = 0;
+    int digit;
+
+    for (;;)
+    {
+        if (**p >= '0' && **p <= '9')
+        {
+            digit = **p - '0';
+        }
+        else if (**p >= 'a' && **p <= 'f')
+        {
+            digit = **p - 'a' + 10;
+        }
+        else
+        {
+            return value;
+        }
+        value = value * 16 + digit;
+        (*p)++;
+    }
+}
+
+/***
+ * Count one line of /proc/self/maps
+ *
+ * Anonymous mappings are only summed.  A file's consecutive mappings
+ * (text, data, ...) are merged into one entry, until
+ * ECRASH_MAX_RESOURCE_MAPS files are listed; the rest are counted.
+ *
+ * @param res     Resources, as counted so far
+ * @param line    The line, terminated
+ * @param omitted Path of the last file counted but not listed
+ */
+static void resourcesMapLine(ReportResources *res, const char *line, char *omitted)
+{
+    const char *p = line;
+    unsigned long start;
+    unsigned long end;
+    ResourceMap *map;
+    int field;
+
+    start = parseHex(&p);
+    if (*p++ != '-')
+    {
+        return;
+    }
+    end = parseHex(&p);
+
+    /* Skip the permissions, offset, device and inode */
+    for (field = 0 ; field < 4 ; field++)
+    {
+        while (*p == ' ')
+        {
+            p++;
+        }
+        while (*p && *p != ' ')
+        {
+            p++;
+        }
+    }
+    while (*p == ' ')
+    {
+        p++;
+    }
+
+    res->mappings++;
+    if (*p == '\0')
+    {
+        res->anonMappings++;
+        res->anonKb += (end - start) / 1024;
+        return;
+    }
+
+    map = res->numMaps ? &res->maps[res->numMaps - 1] : NULL;
+    if (map && strncmp(map->path, p, RESOURCE_PATH_LEN - 1) == 0)
+    {
+        map->end = end;
+    }
+    else if (res->numMaps < ECRASH_MAX_RESOURCE_MAPS)
+    {
+        map = &res->maps[res->numMaps++];
+        map->start = start;
+        map->end = end;
+        strncpy(map->path, p, RESOURCE_PATH_LEN - 1);
+        map->path[RESOURCE_PATH_LEN - 1] = '\0';
+    }
+    else if (strncmp(omitted, p, RESOURCE_PATH_LEN - 1) != 0)
+    {
+        res->mapsOmitted++;
+        strncpy(omitted, p, RESOURCE_PATH_LEN - 1);
+        omitted[RESOURCE_PATH_LEN - 1] = '\0';
+    }
+}
+
+/***
+ * Read /proc/self/maps, a line at a time, through the fd opened at init
+ */
+static void resourcesMaps(ReportResources *res)
+{
+    char omitted[RESOURCE_PATH_LEN] = "";
+    char buf[4096];
+    size_t have = 0;
+    ssize_t got;
+    char *line;
+    char *nl;
+
+    if (gbl_procMapsFd < 0 || lseek(gbl_procMapsFd, 0, SEEK_SET) != 0)
+    {
+        return;
+    }
+
+    while ((got = read(gbl_procMapsFd, buf + have, sizeof(buf) - 1 - have)) > 0)
+    {
+        have += got;
+        buf[have] = '\0';
+        for (line = buf ; (nl = strchr(line, '\n')) != NULL ; line = nl + 1)
+        {
+            *nl = '\0';
+            resourcesMapLine(res, line, omitted);
+        }
+
+        /* Keep the partial last line for the next read, unless it fills the buffer */
+        have = &buf[have] - line;
+        memmove(buf, line, have);
+        if (have == sizeof(buf) - 1)
+        {
+            have = 0;
+        }
+    }
+}
+
+/***
+ * Count the open fds, listing /proc/self/fd through the fd opened at init
+ * (which is left out)
+ */
+static unsigned int resourcesFds(void)
+{
+    struct linux_dirent64
+    {
+        unsigned long long d_ino;
+        long long d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[];
+    } *entry;
+    char buf[4096];
+    unsigned int fds = 0;
+    long got;
+    long pos;
+
+    if (gbl_procFdDirFd < 0 || lseek(gbl_procFdDirFd, 0, SEEK_SET) != 0)
+    {
+        return 0;
+    }
+
+    while ((got = syscall(SYS_getdents64, gbl_procFdDirFd, buf, sizeof(buf))) > 0)
+    {
+        for (pos = 0 ; pos < got ; pos += entry->d_reclen)
+        {
+            entry = (struct linux_dirent64 *)(buf + pos);
+            if (entry->d_name[0] != '.')
+            {
+                fds++;
+            }
+        }
+    }
+
+    return fds ? fds - 1 : 0;
+}
+
+/***
+ * Capture the process's resource use
+ *
+ * @param res Filled in
+ *
+ * @returns res
+ */
+static const ReportResources *captureResources(ReportResources *res)
+{
+    struct rusage usage;
+    struct rlimit limit;
+    char buf[4096];
+    ssize_t got;
+
+    memset(res, 0, sizeof(*res));
+    res->maps = gbl_resourceMaps;
+
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+    {
+        res->peakRssKb = usage.ru_maxrss;
+        res->majorFaults = usage.ru_majflt;
+        res->minorFaults = usage.ru_minflt;
+    }
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+    {
+        res->fdLimit = limit.rlim_cur;
+    }
+
+    if (gbl_procStatusFd > -1 && lseek(gbl_procStatusFd, 0, SEEK_SET) == 0 &&
+        (got = read(gbl_procStatusFd, buf, sizeof(buf) - 1)) > 0)
+    {
+        buf[got] = '\0';
+        res->rssKb = statusField(buf, "VmRSS:");
+        res->virtualKb = statusField(buf, "VmSize:");
+        res->threads = statusField(buf, "Threads:");
+
+        /* ru_maxrss is only brought up to date now and then; the status high water mark is as of now */
+        if (statusField(buf, "VmHWM:") > res->peakRssKb)
+        {
+            res->peakRssKb = statusField(buf, "VmHWM:");
+        }
+    }
+
+    res->fds = resourcesFds();
+    if (res->maps)
+    {
+        resourcesMaps(res);
+    }
+
+    return res;
+}
+
+/***
+ * Check whether any stream wants more than the offending thread
+ *
+ * @returns true if the other threads should be backtraced
+ */
+static bool reportWantsThreads(void)
+{
+    int i;
+
+    for (i = 0 ; i < gbl_numStreams ; i++)
+    {
+        if (gbl_streams[i].verbosity != ECRASH_VERBOSITY_MINIMAL)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/***
+ * Wait for the threads asked for their stacks to answer
+ *
+ * Gives up once they all have, a crash comes along, or the deadline
+ * passes.  The caller holds the thread list.
+ *
+ * @param only     The tid of the one thread asked, or 0 for all of them
+ * @param deadline When to give up, in nowNs() time
+ */
+static void waitBacktraces(pid_t only, long long deadline)
+{
+    struct timespec pollInterval = { 0, BACKTRACE_POLL_NS };
+    ThreadSlot *slot;
+    bool pending;
+    int t;
+
+    for ( ; ; )
+    {
+        pending = false;
+        for (t = 0 ; ThreadSlots && t < gbl_params.maxThreads && !pending ; t++)
+        {
+            slot = &ThreadSlots[t];
+            pending = slot->inUse && !slot->backtraceDone && (!only || slot->tid == only);
+        }
+        if (!pending || gbl_crashing || nowNs() >= deadline)
+        {
+            break;
+        }
+
+        nanosleep(&pollInterval, NULL);
+        if (pollInterval.tv_nsec < BACKTRACE_MAX_POLL_NS)
+        {
+            pollInterval.tv_nsec *= 2;
+        }
+    }
+}
+
+/***
+ * Dump every registered thread
+ *
+ * The crash handler asks the threads one at a time, each getting
+ * threadWaitTime to answer.  A live dump holds the thread list, so it
+ * asks them all at once, and waits for them all just LIVE_DUMP_WAIT_MS.
+ *
+ * @param live True for a live dump, which gives up as soon as a crash
+ *             needs the outputs
+ * @param only The tid of the one thread to dump, or 0 for all of them
+ */
+static void outputBacktraceThreads(bool live, pid_t only)
+{
+    struct timespec pollInterval = { 0, 1000000 };
+    eCrashBreadcrumb crumbs[ECRASH_NUM_BREADCRUMBS];
+    eCrashAnnotation annotations[ECRASH_MAX_THREAD_ANNOTATIONS];
+    ThreadSched sched;
+    ReportThread thread;
+    ThreadSlot *slot;
+    int t;
+    int i;
+
+    /* When we're backtracing, don't worry about the mutex . . hopefully
+     * we're in a safe place.
+     */
+
+    if (live)
+    {
+        for (t = 0 ; t < gbl_params.maxThreads ; t++)
+        {
+            slot = &ThreadSlots[t];
+            if (slot->inUse && (!only || slot->tid == only))
+            {
+                slot->backtraceDepth = gbl_params.maxStackDepth;
+                slot->backtraceDone = 0;
+                pthread_kill(slot->thread, slot->backtraceSignal);
+            }
+        }
+        waitBacktraces(only, nowNs() + LIVE_DUMP_WAIT_MS * 1000000LL);
+    }
+
+    for (t = 0 ; t < gbl_params.maxThreads ; t++)
+    {
+        slot = &ThreadSlots[t];
+        if (live && gbl_crashing)
+        {
+            break;
+        }
+        if (!__atomic_load_n(&slot->inUse, __ATOMIC_ACQUIRE) || (only && slot->tid != only))
+        {
+            continue;
+        }
+
+        if (!live)
+        {
+            slot->backtraceDepth = gbl_params.maxStackDepth;
+            slot->backtraceDone = 0;
+            pthread_kill(slot->thread, slot->backtraceSignal);
+
+            /* Poll, so a prompt thread doesn't cost us a whole second */
+            for (i = 0 ; i < gbl_params.threadWaitTime * 1000 ; i++)
+            {
+                if (slot->backtraceDone)
+                {
+                    break;
+                }
+                nanosleep(&pollInterval, NULL);
+            }
+        }
+
+        thread.name = slot->threadName;
+        thread.thread = (unsigned long)slot->thread;
+        thread.offending = false;
+        thread.captured = (slot->backtraceDone != 0);
+        thread.backtrace = &slot->backtrace;
+        thread.breadcrumbs = crumbs;
+        thread.numBreadcrumbs = captureBreadcrumbs(slot->breadcrumbs, crumbs);
+        thread.annotations = annotations;
+        thread.numAnnotations = captureAnnotations(slot->annotations, ECRASH_MAX_THREAD_ANNOTATIONS, annotations);
+        thread.memory = NULL;
+        thread.numMemory = 0;
+        thread.sched = captureSched(slot->tid, slot, &sched) ? &sched : NULL;
+        reportThread(&thread);
+
+        /* One block, and one write per destination, per thread; a live dump writes after letting go of the
+           thread list, as a slow sink mustn't hold up registration */
+        if (!live)
+        {
+            outputFlush();
+        }
+    }
+}
+
+/***
+ * Check whether a signal's siginfo carries a fault address
+ */
+static bool signalHasAddress(int signo)
+{
+    return signo == SIGSEGV || signo == SIGBUS || signo == SIGILL || signo == SIGFPE;
+}
+
+/***
+ * Open and allocate the crash record file
+ *
+ * The blocks are allocated, and the file's size synced, here, so the
+ * crash handler's fdatasync only has the record itself to write.
+ * Failing is not fatal: the report still goes to its outputs.
+ *
+ * @returns zero on success
+ */
+static int crashRecordInit(void)
+{
+    int fd;
+
+    fd = open(gbl_params.crashRecordFile, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        DPRINTF(ECRASH_DEBUG_ERROR, "Error: unable to open crash record file %s: %s\n", gbl_params.crashRecordFile,
+                strerror(errno));
+        return -1;
+    }
+
+    if (posix_fallocate(fd, 0, ECRASH_CRASH_RECORD_SIZE) != 0 || fdatasync(fd) != 0)
+    {
+        DPRINTF(ECRASH_DEBUG_ERROR, "Error: unable to allocate crash record file %s\n", gbl_params.crashRecordFile);
+        close(fd);
+        return -1;
+    }
+
+    gbl_crashRecordFd = fd;
+    return 0;
+}
+
+/***
+ * Start a frame of the crash record
+ *
+ * @returns where its payload goes
+ */
+static unsigned char *crashRecordFrameStart(unsigned char *p, eCrashRecordType type, size_t len)
+{
+    storeLE(p, type, 2);
+    storeLE(p + 2, len, 4);
+    return p + ECRASH_RECORD_FRAME_HEADER_LEN;
+}
+
+/***
+ * Finish a frame of the crash record, with the CRC of everything from
+ * its start up to the end of its payload
+ *
+ * @returns where the next frame goes
+ */
+static unsigned char *crashRecordFrameEnd(unsigned char *start, unsigned char *end)
+{
+    storeLE(end, eCrashRecord_Crc32(0, start, end - start), 4);
+    return end + ECRASH_RECORD_FRAME_TRAILER_LEN;
+}
+
+/***
+ * Phase one of a crash: write and sync the crash record
+ *
+ * The record (see eCrashRecord.h) holds only what was known the moment
+ * the crash was caught, with the offending thread's stack as raw PCs:
+ * nothing here resolves symbols, takes a lock, or waits on a sink, so it
+ * reaches the disk even if the enrichment that follows hangs or crashes.
+ *
+ * @param header Report header
+ * @param bt     Offending thread's backtrace
+ */
+static void crashRecordWrite(ReportHeader *header, Backtrace *bt)
+{
+    ThreadSlot *slot = currentSlot();
+    const char *name = slot ? slot->threadName : NULL;
+    size_t nameLen = name ? strnlen(name, ECRASH_BLACKBOX_NAME_LEN) : 0;
+    int count = bt->entries < ECRASH_CRASH_RECORD_MAX_FRAMES ? bt->entries : ECRASH_CRASH_RECORD_MAX_FRAMES;
+    unsigned char *frame = gbl_crashRecord;
+    unsigned char *p;
+    int i;
+
+    if (gbl_crashRecordFd < 0)
+    {
+        return;
+    }
+
+    memset(gbl_crashRecord, 0, sizeof(gbl_crashRecord));
+
+    p = crashRecordFrameStart(frame, ECRASH_RECORD_START, 4 + 2);
+    storeLE(p, ECRASH_RECORD_MAGIC, 4);
+    storeLE(p + 4, ECRASH_RECORD_VERSION, 2);
+    frame = crashRecordFrameEnd(frame, p + 6);
+
+    p = crashRecordFrameStart(frame, ECRASH_RECORD_HEADER, 4 + 4 + 8 + 8);
+    storeLE(p, header->signo, 4);
+    storeLE(p + 4, header->pid, 4);
+    storeLE(p + 8, header->time, 8);
+    storeLE(p + 16, (unsigned long)header->address, 8);
+    frame = crashRecordFrameEnd(frame, p + 24);
+
+    p = crashRecordFrameStart(frame, ECRASH_RECORD_THREAD, 8 + 1 + 2 + nameLen);
+    storeLE(p, (unsigned long)pthread_self(), 8);
+    storeLE(p + 8, ECRASH_THREAD_OFFENDING | ECRASH_THREAD_CAPTURED, 1);
+    storeLE(p + 9, nameLen, 2);
+    memcpy(p + 11, name ? name : "", nameLen);
+    frame = crashRecordFrameEnd(frame, p + 11 + nameLen);
+
+    p = crashRecordFrameStart(frame, ECRASH_RECORD_FRAMES, 4 + 8 * count);
+    storeLE(p, count, 4);
+    for (i = 0 ; i < count ; i++)
+    {
+        storeLE(p + 4 + 8 * i, (unsigned long)bt->frames[i], 8);
+    }
+    frame = crashRecordFrameEnd(frame, p + 4 + 8 * count);
+
+    p = crashRecordFrameStart(frame, ECRASH_RECORD_END, 0);
+    crashRecordFrameEnd(frame, p);
+
+    /* One write, in place, over blocks that are already allocated */
+    if (pwrite(gbl_crashRecordFd, gbl_crashRecord, sizeof(gbl_crashRecord), 0) == sizeof(gbl_crashRecord))
+    {
+        fdatasync(gbl_crashRecordFd);
+    }
+}
+
+/***
+ * Lock the crash loop file against the other processes sharing it, or unlock it
+ *
+ * An open file description lock: it is the process's, whichever thread
+ * takes it, and goes with the process.  Polled rather than waited for,
+ * so the crash handler is never held up for long by another process.
+ *
+ * @param fd   The crash loop file
+ * @param type F_WRLCK, or F_UNLCK
+ *
+ * @returns zero on success, -1 if the lock was not to be had
+ */
+static int crashLoopLock(int fd, short type)
+{
+    struct timespec pollInterval = { 0, 1000000 };
+    struct flock lock;
+    int i;
+
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+
+    for (i = 0 ; i < CRASH_LOOP_LOCK_WAIT_MS ; i++)
+    {
+        if (fcntl(fd, F_OFD_SETLK, &lock) == 0)
+        {
+            return 0;
+        }
+        if (errno != EAGAIN && errno != EACCES)
+        {
+            break;
+        }
+        nanosleep(&pollInterval, NULL);
+    }
+
+    return -1;
+}
+
+/***
+ * Read the crash loop file's state into gbl_crashLoop
+ *
+ * A missing or unreadable state starts out empty.
+ *
+ * @param fd The crash loop file
+ */
+static void crashLoopRead(int fd)
+{
+    if (pread(fd, &gbl_crashLoop, sizeof(gbl_crashLoop), 0) != sizeof(gbl_crashLoop) ||
+        gbl_crashLoop.magic != ECRASH_CRASH_LOOP_MAGIC || gbl_crashLoop.version != ECRASH_CRASH_LOOP_VERSION)
+    {
+        memset(&gbl_crashLoop, 0, sizeof(gbl_crashLoop));
+        gbl_crashLoop.magic = ECRASH_CRASH_LOOP_MAGIC;
+        gbl_crashLoop.version = ECRASH_CRASH_LOOP_VERSION;
+    }
+}
+
+/***
+ * Open the crash loop file, and read what earlier crashes left in it
+ *
+ * Failing to open it is not fatal: every crash just gets a full report.
+ *
+ * @returns zero on success
+ */
+static int crashLoopInit(void)
+{
+    bool locked;
+    int fd;
+    int rc = 0;
+
+    fd = open(gbl_params.crashLoopFile, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        DPRINTF(ECRASH_DEBUG_ERROR, "Error: unable to open crash loop file %s: %s\n", gbl_params.crashLoopFile,
+                strerror(errno));
+        return -1;
+    }
+
+    /* Allocate it now, so the handler only rewrites blocks in place */
+    locked = (crashLoopLock(fd, F_WRLCK) == 0);
+    crashLoopRead(fd);
+    if (pwrite(fd, &gbl_crashLoop, sizeof(gbl_crashLoop), 0) != sizeof(gbl_crashLoop) || fdatasync(fd) != 0)
+    {
+        DPRINTF(ECRASH_DEBUG_ERROR, "Error: unable to write crash loop file %s\n", gbl_params.crashLoopFile);
+        rc = -1;
+    }
+    if (locked)
+    {
+        crashLoopLock(fd, F_UNLCK);
+    }
+
+    if (rc != 0)
+    {
+        close(fd);
+        return rc;
+    }
+
+    gbl_crashLoopFd = fd;
+    return 0;
+}
+
+/*
+ * A frame being placed in its module, by crashSignatureModule
+ */
+typedef struct
+{
+    unsigned long pc;
+    unsigned long offset;
+    const char *module;
+} SignatureFrame;
+
+/***
+ * dl_iterate_phdr callback: find the module a PC is in
+ */
+static int crashSignatureModule(struct dl_phdr_info *info, size_t size, void *data)
+{
+    SignatureFrame *frame = data;
+    unsigned long start;
+    int i;
+
+    for (i = 0 ; i < info->dlpi_phnum ; i++)
+    {
+        if (info->dlpi_phdr[i].p_type != PT_LOAD)
+        {
+            continue;
+        }
+
+        start = info->dlpi_addr + info->dlpi_phdr[i].p_vaddr;
+        if (frame->pc >= start && frame->pc < start + info->dlpi_phdr[i].p_memsz)
+        {
+            frame->offset = frame->pc - info->dlpi_addr;
+            frame->module = info->dlpi_name;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/***
+ * Add bytes to an FNV-1a hash
+ */
+static unsigned long long crashSignatureHash(unsigned long long hash, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+
+    while (len--)
+    {
+        hash = (hash ^ *p++) * 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+/***
+ * Compute a crash's signature
+ *
+ * The signal, and each frame of the offending stack as the base name of
+ * its module and its offset there, so the signature is the same from one
+ * run to the next whatever the address space layout.  Frames outside any
+ * module (JIT code, a smashed stack) only count by their number.
+ *
+ * @param signo Crash signal
+ * @param bt    Offending thread's backtrace
+ *
+ * @returns the signature, never 0
+ */
+static unsigned long long crashSignature(int signo, Backtrace *bt)
+{
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+    SignatureFrame frame;
+    const char *base;
+    int i;
+
+    hash = crashSignatureHash(hash, &signo, sizeof(signo));
+    for (i = 0 ; i < bt->entries ; i++)
+    {
+        frame.pc = (unsigned long)bt->frames[i];
+        frame.offset = 0;
+        frame.module = NULL;
+        if (dl_iterate_phdr(crashSignatureModule, &frame) && frame.module)
+        {
+            base = strrchr(frame.module, '/');
+            base = base ? base + 1 : frame.module;
+            hash = crashSignatureHash(hash, base, strlen(base));
+        }
+        hash = crashSignatureHash(hash, &frame.offset, sizeof(frame.offset));
+    }
+
+    return hash ? hash : 1;
+}
+
+/***
+ * Count this crash in the crash loop file
+ *
+ * A signature seen less than crashLoopWindow seconds ago continues its
+ * loop; otherwise it starts a new one, in its old entry or in the one
+ * least recently crashed in.  The file is read again, as other processes
+ * may have counted crashes in it since init, and rewritten and synced,
+ * all under its lock.
+ *
+ * @param header Report header, with its signature; the occurrence and
+ *               loop length are filled in
+ *
+ * @returns true if this crash continues a loop
+ */
+static bool crashLoopCount(ReportHeader *header)
+{
+    CrashLoopEntry *entry = NULL;
+    unsigned long long now = header->time;
+    bool loop = false;
+    bool locked;
+    int i;
+
+    /* Counted anyway if another process sits on the lock: a lost count beats a lost report */
+    locked = (crashLoopLock(gbl_crashLoopFd, F_WRLCK) == 0);
+    crashLoopRead(gbl_crashLoopFd);
+
+    for (i = 0 ; i < ECRASH_CRASH_LOOP_SIGNATURES ; i++)
+    {
+        if (gbl_crashLoop.entries[i].signature == header->signature)
+        {
+            entry = &gbl_crashLoop.entries[i];
+            break;
+        }
+        if (!entry || gbl_crashLoop.entries[i].last < entry->last)
+        {
+            entry = &gbl_crashLoop.entries[i];
+        }
+    }
+
+    if (entry->signature == header->signature && now - entry->last <= gbl_params.crashLoopWindow)
+    {
+        entry->count++;
+        loop = true;
+    }
+    else
+    {
+        if (entry->signature != header->signature)
+        {
+            entry->signature = header->signature;
+            entry->total = 0;
+        }
+        entry->first = now;
+        entry->count = 1;
+    }
+    entry->last = now;
+    entry->total++;
+
+    header->occurrence = entry->count;
+    header->loopSeconds = now - entry->first;
+
+    if (pwrite(gbl_crashLoopFd, &gbl_crashLoop, sizeof(gbl_crashLoop), 0) == sizeof(gbl_crashLoop))
+    {
+        fdatasync(gbl_crashLoopFd);
+    }
+    if (locked)
+    {
+        crashLoopLock(gbl_crashLoopFd, F_UNLCK);
+    }
+
+    return loop;
+}
+
+/***
+ * Check whether any stream is a full one
+ *
+ * @returns true if the memory snapshot should be taken
+ */
+static bool reportWantsFull(void)
+{
+    int i;
+
+    for (i = 0 ; i < gbl_numStreams ; i++)
+    {
+        if (gbl_streams[i].verbosity == ECRASH_VERBOSITY_FULL)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/***
+ * Read our own memory, without faulting
+ *
+ * process_vm_readv checks the addresses for us, and stops at the first
+ * page that isn't readable.  If the very first one isn't, try again from
+ * each following page boundary (4 KB steps: every page size is a
+ * multiple), so a window straddling the start of a mapping still gets
+ * the mapped part.
+ *
+ * @param region  Filled in with what could be read
+ * @param name    Region name
+ * @param address Start of the window
+ * @param len     Its length
+ * @param buf     Where to copy it
+ */
+static void memoryCapture(MemoryRegion *region, const char *name, unsigned long address, unsigned int len,
+                          unsigned char *buf)
+{
+    struct iovec local;
+    struct iovec remote;
+    unsigned long next;
+    ssize_t got;
+
+    region->name = name;
+    region->address = address;
+    region->length = 0;
+    region->bytes = buf;
+
+    while (len > 0)
+    {
+        local.iov_base = buf;
+        local.iov_len = len;
+        remote.iov_base = (void *)address;
+        remote.iov_len = len;
+        got = process_vm_readv(getpid(), &local, 1, &remote, 1, 0);
+        if (got > 0)
+        {
+            region->address = address;
+            region->length = got;
+            return;
+        }
+
+        next = (address | 4095) + 1;
+        if (next <= address || next - address >= len)
+        {
+            return;
+        }
+        len -= next - address;
+        address = next;
+    }
+}
+
+/***
+ * Capture the memory around a crash: the code around the PC, the bytes
+ * around the fault address, and the stack from the stack pointer up
+ *
+ * @param header  Report header, for the fault address
+ * @param context The signal's ucontext, for the registers
+ * @param regions Filled in
+ *
+ * @returns the number of regions
+ */
+static int memorySnapshot(ReportHeader *header, void *context, MemoryRegion *regions)
+{
+    ucontext_t *uc = context;
+    unsigned long pc = 0;
+    unsigned long sp = 0;
+    unsigned int codeLen = gbl_params.memorySnapshotSize / 4 < 64 ? gbl_params.memorySnapshotSize / 4 : 64;
+    unsigned int faultLen = gbl_params.memorySnapshotSize / 4 < 128 ? gbl_params.memorySnapshotSize / 4 : 128;
+    unsigned char *buf = gbl_memorySnapshot;
+    unsigned long address;
+    int count = 0;
+
+    if (!buf)
+    {
+        return 0;
+    }
+
+    if (uc)
+    {
+#if defined(__x86_64__)
+        pc = uc->uc_mcontext.gregs[REG_RIP];
+        sp = uc->uc_mcontext.gregs[REG_RSP];
+#elif defined(__i386__)
+        pc = uc->uc_mcontext.gregs[REG_EIP];
+        sp = uc->uc_mcontext.gregs[REG_ESP];
+#elif defined(__aarch64__)
+        pc = uc->uc_mcontext.pc;
+        sp = uc->uc_mcontext.sp;
+#endif
+    }
+
+    if (pc)
+    {
+        memoryCapture(&regions[count++], "code", pc > codeLen / 2 ? pc - codeLen / 2 : 0, codeLen, buf);
+        buf += codeLen;
+    }
+
+    if (header->hasAddress)
+    {
+        address = (unsigned long)header->address & ~15UL;
+        memoryCapture(&regions[count++], "fault", address > faultLen / 2 ? address - faultLen / 2 : 0, faultLen,
+                      buf);
+        buf += faultLen;
+    }
+
+    if (sp)
+    {
+        memoryCapture(&regions[count++], "stack", sp, gbl_params.memorySnapshotSize - (buf - gbl_memorySnapshot),
+                      buf);
+    }
+
+    return count;
+}
+
+/***
+ * Let go of the process, once the report is written
+ *
+ * @param signo   Signal being handled
+ * @param info    Its siginfo
+ * @param context Its context
+ */
+static void crashDispose(int signo, siginfo_t *info, void *context)
+{
+    struct sigaction *old = NULL;
+    struct sigaction dfl;
+    sigset_t set;
+    int i;
+
+    if (gbl_blackBox)
+    {
+        gbl_blackBox->disposition = gbl_params.disposition;
+        gbl_blackBox->exitTime = realtimeNs();
+    }
+
+    switch (gbl_params.disposition)
+    {
+    case ECRASH_DISPOSITION_QUICK_EXIT:
+        _exit(signo);
+    case ECRASH_DISPOSITION_CHAIN:
+        for (i = 0 ; gbl_params.signals[i] != 0 ; i++)
+        {
+            if (gbl_params.signals[i] == signo)
+            {
+                old = &gbl_oldCrashActions[i];
+            }
+        }
+        if (old && old->sa_handler == SIG_IGN)
+        {
+            /* There is no carrying on from a fault */
+            _exit(signo);
+        }
+        if (old && old->sa_handler != SIG_DFL)
+        {
+            sigaction(signo, old, NULL);
+            if (old->sa_flags & SA_SIGINFO)
+            {
+                old->sa_sigaction(signo, info, context);
+            }
+            else
+            {
+                old->sa_handler(signo);
+            }
+        }
+        /* It returned (or there was none): fall through */
+    case ECRASH_DISPOSITION_RERAISE:
+        memset(&dfl, 0, sizeof(dfl));
+        dfl.sa_handler = SIG_DFL;
+        sigemptyset(&dfl.sa_mask);
+        sigaction(signo, &dfl, NULL);
+
+        /* The signal is blocked while we handle it */
+        sigemptyset(&set);
+        sigaddset(&set, signo);
+        pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+        raise(signo);
+        _exit(signo);
+    default:
+        exit(signo);
+    }
+}
+
+/***
+ * Handle signals (crash signals)
+ *
+ * This function will catch all crash signals, and will output the
+ * crash dump.  
+ *
+ * The report is written in two phases.  The first captures the
+ * offending thread's stack, and writes and syncs the crash record and
+ * the black box; only then does the second build the full report, with
+ * symbols, the other threads and the metrics, for every output.
+ *
+ * Each section of the report is captured once, and handed to the
+ * encoder of every output stream.
+ *
+ * Nothing in here allocates: all the memory it needs was carved out of
+ * the crash arena by eCrash_Init.
+ * 
+ * @param signum  Signal received.
+ * @param info    Its siginfo, for the fault address
+ * @param context Its context, for a chained handler
+ */
+static void crash_handler(int signo, siginfo_t *info, void *context)
+{
+    eCrashBreadcrumb crumbs[ECRASH_NUM_BREADCRUMBS];
+    eCrashAnnotation annotations[ECRASH_MAX_ANNOTATIONS];
+    CoreExclusion coreExclusions[ECRASH_MAX_CORE_EXCLUSIONS];
+    MemoryRegion memory[NUM_MEMORY_REGIONS];
+    ThreadSched sched;
+    ReportResources resources;
+    ReportMetrics metrics;
+    ReportHeader header;
+    ReportThread thread;
+    ThreadSlot *slot = currentSlot();
+    int i;
+
+    gbl_crashing = 1;
+    gbl_crashTime = nowNs();
+
+    /* Phase one: the minimal record, on disk before anything else */
+    captureBacktrace(&gbl_crashBacktrace, gbl_params.maxStackDepth);
+
+    header.signo = signo;
+    header.pid = getpid();
+    header.time = time(NULL);
+    header.hasAddress = (info != NULL && signalHasAddress(signo));
+    header.address = header.hasAddress ? info->si_addr : NULL;
+    header.signature = 0;
+    header.occurrence = 0;
+    header.loopSeconds = 0;
+    header.resources = NULL;
+    header.hang = gbl_hangAborting ? &gbl_hang : NULL;
+    crashRecordWrite(&header, &gbl_crashBacktrace);
+
+    if (gbl_blackBox)
+    {
+        gbl_blackBox->signo = signo;
+        blackBoxPublish(&gbl_blackBox->crashStack, gbl_crashBacktrace.frames, gbl_crashBacktrace.entries);
+        gbl_blackBox->state = ECRASH_BLACKBOX_CRASHED;
+    }
+
+    outputClaim();
+
+    /* The same crash again, not long after the last: one line will do */
+    if (gbl_crashLoopFd > -1)
+    {
+        header.signature = crashSignature(signo, &gbl_crashBacktrace);
+        if (crashLoopCount(&header))
+        {
+            outputBegin();
+            for (i = 0 ; i < gbl_numStreams ; i++)
+            {
+                gbl_streams[i].encoder->repeat(&gbl_streams[i], &header);
+            }
+            outputFlush();
+            outputFini();
+
+            crashDispose(signo, info, context);
+            return;
+        }
+    }
+
+    /* Phase two: the full report */
+    outputBegin();
+    schedSampleStart();
+
+    header.annotations = annotations;
+    header.numAnnotations = captureAnnotations(gbl_annotations, ECRASH_MAX_ANNOTATIONS, annotations);
+    header.numCoreExclusions = __atomic_load_n(&gbl_numCoreExclusions, __ATOMIC_ACQUIRE);
+    memcpy(coreExclusions, gbl_coreExclusions, sizeof(CoreExclusion) * header.numCoreExclusions);
+    header.coreExclusions = coreExclusions;
+    header.resources = (gbl_params.dumpResources != false && reportWantsThreads()) ? captureResources(&resources)
+                                                                                    : NULL;
+    for (i = 0 ; i < gbl_numStreams ; i++)
+    {
+        gbl_streams[i].encoder->header(&gbl_streams[i], &header);
+    }
+
+    thread.name = slot ? slot->threadName : NULL;
+    thread.thread = (unsigned long)pthread_self();
+    thread.offending = true;
+    thread.captured = true;
+    thread.backtrace = &gbl_crashBacktrace;
+    thread.breadcrumbs = crumbs;
+    thread.numBreadcrumbs = captureBreadcrumbs(slot ? slot->breadcrumbs : NULL, crumbs);
+
+    /* The process wide ones are done with: reuse their buffer */
+    thread.annotations = annotations;
+    thread.numAnnotations = captureAnnotations(slot ? slot->annotations : NULL,
+                                               ECRASH_MAX_THREAD_ANNOTATIONS, annotations);
+    thread.memory = memory;
+    thread.numMemory = reportWantsFull() ? memorySnapshot(&header, context, memory) : 0;
+    thread.sched = captureSched(syscall(SYS_gettid), NULL, &sched) ? &sched : NULL;
+    reportThread(&thread);
+    outputFlush();
+
+    if (gbl_params.dumpAllThreads != false && reportWantsThreads())
+    {
+        outputBacktraceThreads(false, 0);
+    }
+
+    metricsTotal(&metrics);
+    for (i = 0 ; i < gbl_numStreams ; i++)
+    {
+        gbl_streams[i].encoder->metrics(&gbl_streams[i], &metrics);
+    }
+
+    gbl_dumpTime = nowNs() - gbl_crashTime;
+    gbl_dumpDisposition = gbl_params.disposition;
+    for (i = 0 ; i < gbl_numStreams ; i++)
+    {
+        gbl_streams[i].encoder->footer(&gbl_streams[i]);
+    }
+    outputFlush();
+
+    outputFini();
+
+    crashDispose(signo, info, context);
+}
+
+/***
+ * Handle signals (bt signals)
+ *
+ * This function shoudl be called to generate a crashdump into our
+ * thread's slot.  Once the dump has been completed, this function will
+ * return after tickling the slot's done flag.  Since mutexes are not async
+ * signal safe, the main thread, after signaling us to generate our
+ * own backtrace, will sleep for a few seconds waiting for us to complete.
+ *
+ * @param signum Signal received.
+ */
+static void bt_handler(int signo)
+{
+    ThreadSlot *slot = currentSlot();
+
+    if (slot)
+    {
+        captureBacktrace(&slot->backtrace, slot->backtraceDepth);
+        if (slot->box)
+        {
+            blackBoxPublish(&slot->box->stack, slot->backtrace.frames, slot->backtrace.entries);
+        }
+        slot->backtraceDone = 1;
+    }
+}
+
+/***
+ * Run a live dump: the crash report, without the crash
+ *
+ * The caller owns gbl_dumpOwner.  Should a crash come along meanwhile,
+ * we stop after the thread being dumped and leave the outputs to the
+ * crash handler.
+ *
+ * @param selector Sinks to write to (ECRASH_DUMP_ALL_SINKS for all)
+ * @param only     The tid of the one thread to dump, or 0 for all of them
+ * @param hang     The hang the dump is for, or NULL
+ */
+static void liveDump(unsigned int selector, pid_t only, const ReportHang *hang)
+{
+    eCrashAnnotation annotations[ECRASH_MAX_ANNOTATIONS];
+    CoreExclusion coreExclusions[ECRASH_MAX_CORE_EXCLUSIONS];
+    ReportResources resources;
+    ReportMetrics metrics;
+    ReportHeader header;
+    int i;
+
+    gbl_crashTime = nowNs();
+    outputLiveBegin(selector);
+    schedSampleStart();
+
+    memset(&header, 0, sizeof(header));
+    header.pid = getpid();
+    header.time = time(NULL);
+    header.hang = hang;
+    header.annotations = annotations;
+    header.numAnnotations = captureAnnotations(gbl_annotations, ECRASH_MAX_ANNOTATIONS, annotations);
+    header.numCoreExclusions = __atomic_load_n(&gbl_numCoreExclusions, __ATOMIC_ACQUIRE);
+    memcpy(coreExclusions, gbl_coreExclusions, sizeof(CoreExclusion) * header.numCoreExclusions);
+    header.coreExclusions = coreExclusions;
+    header.resources = (gbl_params.dumpResources != false) ? captureResources(&resources) : NULL;
+    for (i = 0 ; i < gbl_numStreams ; i++)
+    {
+        gbl_streams[i].encoder->header(&gbl_streams[i], &header);
+    }
+    outputFlush();
+
+    /* Hold the threads where they are: none can unregister in the middle (short of the arena running dry) */
+    pthread_mutex_lock(&ThreadListMutex);
+    tls_threadListHeld = true;
+    if (ThreadSlots)
+    {
+        outputBacktraceThreads(true, only);
+    }
+    tls_threadListHeld = false;
+    pthread_mutex_unlock(&ThreadListMutex);
+
+    if (gbl_crashing)
+    {
+        tls_liveOutput = false;
+        return;
+    }
+    outputFlush();
+
+    metricsTotal(&metrics);
+    for (i = 0 ; i < gbl_numStreams ; i++)
+    {
+        gbl_streams[i].encoder->metrics(&gbl_streams[i], &metrics);
+    }
+
+    gbl_dumpTime = nowNs() - gbl_crashTime;
+    gbl_dumpDisposition = ECRASH_DISPOSITION_LIVE;
+    for (i = 0 ; i < gbl_numStreams ; i++)
+    {
+        gbl_streams[i].encoder->footer(&gbl_streams[i]);
+    }
+    outputFlush();
+
+    outputLiveEnd();
+}
+
+/***
+ * Run a live dump, unless one is running already
+ *
+ * @param selector Sinks to write to (ECRASH_DUMP_ALL_SINKS for all)
+ * @param only     The tid of the one thread to dump, or 0 for all of them
+ * @param hang     The hang the dump is for, or NULL
+ *
+ * @returns zero once dumped, 1 if coalesced into a dump already running, -1 if eCrash isn't set up or the
+ *          process is crashing
+ */
+static int dumpNow(unsigned int selector, pid_t only, const ReportHang *hang)
+{
+    struct timespec pollInterval = { 0, 1000000 };
+    pid_t owner = 0;
+
+    if (gbl_arenaBase == NULL || gbl_crashing)
+    {
+        return -1;
+    }
+
+    while (!__atomic_compare_exchange_n(&gbl_dumpOwner, &owner, (pid_t)syscall(SYS_gettid), false, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE))
+    {
+        /* A wall clock sample is no dump to coalesce into, and is over within a few ms */
+        if (owner != __atomic_load_n(&gbl_profileTid, __ATOMIC_RELAXED) || gbl_crashing)
+        {
+            return gbl_crashing ? -1 : 1;
+        }
+        nanosleep(&pollInterval, NULL);
+        owner = 0;
+    }
+
+    liveDump(selector, only, hang);
+    __atomic_store_n(&gbl_dumpOwner, 0, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/***
+ * Handle the dump signal (dumpSignal)
+ *
+ * All we do here is wake the dump thread: a full pipe means a dump is
+ * already on its way.
+ *
+ * @param signo Signal received.
+ */
+static void dumpSignalHandler(int signo)
+{
+    int savedErrno = errno;
+    char request = 'd';
+
+    if (write(gbl_dumpPipe[1], &request, 1) < 0)
+    {
+        /* Nothing else we can do */
+    }
+    errno = savedErrno;
+}
+
+/***
+ * Merge two sink selectors
+ */
+static unsigned int dumpSelectorMerge(unsigned int a, unsigned int b)
+{
+    return (a == ECRASH_DUMP_ALL_SINKS || b == ECRASH_DUMP_ALL_SINKS) ? ECRASH_DUMP_ALL_SINKS : a | b;
+}
+
+/***
+ * The dump thread: waits for dump requests (the dump signal, or
+ * datagrams on the dump socket) and runs them
+ *
+ * Every request queued by the time it wakes up is served by one dump,
+ * written to all the sinks any of them asked for.
+ */
+static void *dumpTriggerThread(void *arg)
+{
+    struct pollfd fds[2];
+    char requests[64];
+    unsigned int selector;
+    unsigned long value;
+    bool stop = false;
+    bool dump;
+    ssize_t n;
+    int i;
+
+    fds[0].fd = gbl_dumpPipe[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = gbl_dumpSocketFd;
+    fds[1].events = POLLIN;
+
+    while (!stop)
+    {
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            DPRINTF(ECRASH_DEBUG_ERROR, "Error: dump thread poll failed: %s\n", strerror(errno));
+            break;
+        }
+
+        dump = false;
+        selector = gbl_params.dumpSinks;
+        while ((n = read(gbl_dumpPipe[0], requests, sizeof(requests))) > 0)
+        {
+            for (i = 0 ; i < n ; i++)
+            {
+                stop = stop || requests[i] == 'q';
+                dump = dump || requests[i] == 'd';
+            }
+        }
+
+        while (gbl_dumpSocketFd > -1 &&
+               (n = recv(gbl_dumpSocketFd, requests, sizeof(requests) - 1, MSG_DONTWAIT)) >= 0)
+        {
+            requests[n] = '\0';
+            value = strtoul(requests, NULL, 10);
+            value = value ? value : gbl_params.dumpSinks;
+            selector = dump ? dumpSelectorMerge(selector, value) : value;
+            dump = true;
+        }
+
+        if (dump && !stop)
+        {
+            eCrash_DumpNow(selector);
+        }
+    }
+
+    return NULL;
+}
+
+/***
+ * Start one of our own threads
+ *
+ * It inherits our mask, so everything but the crash signals is blocked
+ * while it is created: the application's signals must not land in it.
+ *
+ * @param thread Where to put its id
+ * @param func   What it runs
+ * @param name   Its name, as ps shows it
+ *
+ * @returns zero, or -1 if it could not be started
+ */
+static int helperThreadStart(pthread_t *thread, void *(*func)(void *), const char *name)
+{
+    sigset_t signals;
+    sigset_t oldSignals;
+    int sigIndex;
+    int rc;
+
+    sigfillset(&signals);
+    for (sigIndex = 0 ; gbl_params.signals[sigIndex] != 0 ; sigIndex++)
+    {
+        sigdelset(&signals, gbl_params.signals[sigIndex]);
+    }
+    pthread_sigmask(SIG_SETMASK, &signals, &oldSignals);
+    rc = pthread_create(thread, NULL, func, NULL);
+    pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+    if (rc != 0)
+    {
+        DPRINTF(ECRASH_DEBUG_ERROR, "Error: unable to start %s: %s\n", name, strerror(rc));
+        return -1;
+    }
+    pthread_setname_np(*thread, name);
+
+    return 0;
+}
+
+/***
+ * Start the dump thread, with its socket and signal
+ *
+ * @returns zero, or -1 if the thread could not be started
+ */
+static int dumpTriggerInit(void)
+{
+    struct sockaddr_un addr;
+    struct sigaction act;
+    socklen_t len;
+
+    if (pipe2(gbl_dumpPipe, O_CLOEXEC | O_NONBLOCK) != 0)
+    {
+        DPRINTF(ECRASH_DEBUG_ERROR, "Error: unable to create the dump pipe: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (gbl_params.dumpSocket)
+    {
+        /* Abstract (a leading NUL): nothing in the file system to clean up after us */
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path + 1, gbl_params.dumpSocket, sizeof(addr.sun_path) - 2);
+        len = offsetof(struct sockaddr_un, sun_path) + 1 + strlen(addr.sun_path + 1);
+
+        gbl_dumpSocketFd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (gbl_dumpSocketFd > -1 && bind(gbl_dumpSocketFd, (struct sockaddr *)&addr, len) != 0)
+        {
+            close(gbl_dumpSocketFd);
+            gbl_dumpSocketFd = -1;
+        }
+        if (gbl_dumpSocketFd < 0)
+        {
+            DPRINTF(ECRASH_DEBUG_ERROR, "Error: unable to set up dump socket %s: %s\n", gbl_params.dumpSocket,
+                    strerror(errno));
+        }
+    }
+
+    if (helperThreadStart(&gbl_dumpThread, dumpTriggerThread, "ecrash-dump") != 0)
+    {
+        return -1;
+    }
+    gbl_dumpThreadRunning = true;
+
+    if (gbl_params.dumpSignal)
+    {
+        memset(&act, 0, sizeof(act));
+        act.sa_handler = dumpSignalHandler;
+        sigemptyset(&act.sa_mask);
+        act.sa_flags = SA_RESTART;
+        sigaction(gbl_params.dumpSignal, &act, &gbl_oldDumpAction);
+    }
+
+    return 0;
+}
+
+/***
+ * Stop the dump thread, and close its pipe and socket
+ */
+static void dumpTriggerFini(void)
+{
+    char request = 'q';
+
+    if (gbl_params.dumpSignal && gbl_dumpThreadRunning)
+    {
+        sigaction(gbl_params.dumpSignal, &gbl_oldDumpAction, NULL);
+    }
+
+    if (gbl_dumpThreadRunning && write(gbl_dumpPipe[1], &request, 1) == 1)
+    {
+        pthread_join(gbl_dumpThread, NULL);
+    }
+    gbl_dumpThreadRunning = false;
+
+    if (gbl_dumpSocketFd > -1)
+    {
+        close(gbl_dumpSocketFd);
+        gbl_dumpSocketFd = -1;
+    }
+    if (gbl_dumpPipe[0] > -1)
+    {
+        close(gbl_dumpPipe[0]);
+        close(gbl_dumpPipe[1]);
+        gbl_dumpPipe[0] = gbl_dumpPipe[1] = -1;
+    }
+}
+
+/***
+ * Wait for a helper thread's next round, or for it to be told to stop
+ *
+ * @param fd Read end of its pipe, which gets a byte when it should stop
+ * @param ms How long to wait
+ *
+ * @returns true if the thread should stop
+ */
+static bool helperThreadWait(int fd, int ms)
+{
+    struct pollfd pfd;
+    char request;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    return poll(&pfd, 1, ms) > 0 && read(fd, &request, 1) == 1;
+}
+
+/***
+ * Look for a watched thread past its heartbeat deadline
+ *
+ * A hang is only reported once: the thread has to beat again before it
+ * can be caught again.  The thread is named by its tid, not its slot:
+ * once the thread list is unlocked, the slot may go to another thread.
+ *
+ * @param hang Filled in with the hang found
+ *
+ * @returns the hung thread's tid, or 0 if none is
+ */
+static pid_t watchdogFindHang(ReportHang *hang)
+{
+    long long now = nowNs();
+    pid_t hung = 0;
+    ThreadSlot *slot;
+    uint64_t heartbeat;
+    unsigned int deadlineMs;
+    int i;
+
+    pthread_mutex_lock(&ThreadListMutex);
+    for (i = 0 ; ThreadSlots && i < gbl_params.maxThreads && !hung ; i++)
+    {
+        slot = &ThreadSlots[i];
+        heartbeat = __atomic_load_n(&slot->heartbeat, __ATOMIC_RELAXED);
+        deadlineMs = __atomic_load_n(&slot->deadlineMs, __ATOMIC_RELAXED);
+        if (!slot->inUse || heartbeat == 0 || deadlineMs == 0 || heartbeat == slot->hangReported ||
+            now - (long long)heartbeat <= (long long)deadlineMs * 1000000)
+        {
+            continue;
+        }
+
+        hung = slot->tid;
+        slot->hangReported = heartbeat;
+        memcpy(hang->name, slot->threadName, sizeof(hang->name));
+        hang->thread = (unsigned long)slot->thread;
+        hang->silentMs = (now - (long long)heartbeat) / 1000000;
+        hang->deadlineMs = deadlineMs;
+    }
+    pthread_mutex_unlock(&ThreadListMutex);
+
+    return hung;
+}
+
+/***
+ * Act on a hang found by watchdogFindHang, if the thread is still there
+ *
+ * Looked up again, under the thread list lock, as the thread may have
+ * unregistered (and its slot been reused) since it was found.
+ *
+ * @param tid       The hung thread
+ * @param hang      The hang, for the crash report
+ * @param sendAbort True to send the thread SIGABRT, false to let the hang
+ *                  be caught again next time
+ *
+ * @returns true if the thread was still registered
+ */
+static bool watchdogAct(pid_t tid, const ReportHang *hang, bool sendAbort)
+{
+    ThreadSlot *slot = NULL;
+    int i;
+
+    pthread_mutex_lock(&ThreadListMutex);
+    for (i = 0 ; ThreadSlots && i < gbl_params.maxThreads && !slot ; i++)
+    {
+        if (ThreadSlots[i].inUse && ThreadSlots[i].tid == tid)
+        {
+            slot = &ThreadSlots[i];
+        }
+    }
+
+    if (slot && !sendAbort)
+    {
+        slot->hangReported = 0;
+    }
+    else if (slot)
+    {
+        /* The crash handler runs on the hung thread, and puts the hang in its header */
+        gbl_hang = *hang;
+        gbl_hangAborting = 1;
+        syscall(SYS_tgkill, getpid(), tid, SIGABRT);
+    }
+    pthread_mutex_unlock(&ThreadListMutex);
+
+    return slot != NULL;
+}
+
+/***
+ * The hang watchdog: checks the heartbeats every
+ * ECRASH_WATCHDOG_INTERVAL_MS, and dumps (then maybe aborts) on a hang
+ */
+static void *watchdogThread(void *arg)
+{
+    ReportHang hang;
+    pid_t hung;
+
+    while (!helperThreadWait(gbl_watchdogPipe[0], ECRASH_WATCHDOG_INTERVAL_MS))
+    {
+        if (gbl_crashing || (hung = watchdogFindHang(&hang)) == 0)
+        {
+            continue;
+        }
+
+        DPRINTF(ECRASH_DEBUG_ERROR, "Error: thread %s sent no heartbeat for %u ms\n", hang.name, hang.silentMs);
+        if (dumpNow(gbl_params.dumpSinks, gbl_params.hangAction == ECRASH_HANG_DUMP_THREAD ? hung : 0,
+                    &hang) == 1)
+        {
+            /* Another dump has the outputs: catch it again next time */
+            watchdogAct(hung, &hang, false);
+            continue;
+        }
+
+        if (gbl_params.hangAbort != false && !gbl_crashing && watchdogAct(hung, &hang, true))
+        {
+            /* Unless the thread can't take signals (stuck in the kernel, or blocking SIGABRT): then we abort */
+            if (!helperThreadWait(gbl_watchdogPipe[0], gbl_params.threadWaitTime * 1000) && !gbl_crashing)
+            {
+                abort();
+            }
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/***
+ * Start the hang watchdog
+ *
+ * @returns zero, or -1 if the thread could not be started
+ */
+static int watchdogInit(void)
+{
+    if (pipe2(gbl_watchdogPipe, O_CLOEXEC | O_NONBLOCK) != 0)
+    {
+        DPRINTF(ECRASH_DEBUG_ERROR, "Error: unable to create the watchdog pipe: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (helperThreadStart(&gbl_watchdogThread, watchdogThread, "ecrash-watchdog") != 0)
+    {
+        return -1;
+    }
+    gbl_watchdogRunning = true;
+
+    return 0;
+}
+
+/***
+ * Stop the hang watchdog, and close its pipe
+ */
+static void watchdogFini(void)
+{
+    char request = 'q';
+
+    if (gbl_watchdogRunning && write(gbl_watchdogPipe[1], &request, 1) == 1)
+    {
+        pthread_join(gbl_watchdogThread, NULL);
+    }
+    gbl_watchdogRunning = false;
+
+    if (gbl_watchdogPipe[0] > -1)
+    {
+        close(gbl_watchdogPipe[0]);
+        close(gbl_watchdogPipe[1]);
+        gbl_watchdogPipe[0] = gbl_watchdogPipe[1] = -1;
+    }
+}
+
+/***
+ * Count a sampled stack
+ *
+ * Called from the sampling signal handler, so it only touches the
+ * table, with atomics.  Should two threads add the same new stack at
+ * once, it may get two entries; the folded output just lists it twice,
+ * which flame graph tools add up.
+ *
+ * @param table     Profile to count it in
+ * @param tag       What else the sample is keyed on (0 for CPU samples)
+ * @param frames    The stack, innermost first
+ * @param numFrames How many frames (at most ECRASH_PROFILE_MAX_FRAMES)
+ * @param truncated Whether the outer frames are missing
+ */
+static void profileRecord(ProfileTable *table, uint32_t tag, void **frames, int numFrames, bool truncated)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL ^ tag;
+    ProfileStack *entry;
+    uint64_t key;
+    int probe;
+    int i;
+
+    for (i = 0 ; i < numFrames ; i++)
+    {
+        hash = (hash ^ (uintptr_t)frames[i]) * 0x100000001b3ULL;
+    }
+    hash ^= hash >> 29;
+    hash += 2 * (hash < 2);
+
+    __atomic_add_fetch(&table->samples, 1, __ATOMIC_RELAXED);
+    for (probe = 0 ; probe < PROFILE_MAX_PROBES ; probe++)
+    {
+        entry = &table->stacks[(hash + probe) & (ECRASH_PROFILE_MAX_STACKS - 1)];
+        key = __atomic_load_n(&entry->key, __ATOMIC_ACQUIRE);
+        if (key == 0 && __atomic_compare_exchange_n(&entry->key, &key, 1, false, __ATOMIC_ACQUIRE,
+                                                    __ATOMIC_ACQUIRE))
+        {
+            memcpy(entry->frames, frames, sizeof(void *) * numFrames);
+            entry->tag = tag;
+            entry->numFrames = numFrames;
+            entry->truncated = truncated;
+            entry->count = 1;
+            __atomic_store_n(&entry->key, hash, __ATOMIC_RELEASE);
+            return;
+        }
+
+        if (key == hash && entry->tag == tag && entry->numFrames == (uint32_t)numFrames &&
+            entry->truncated == truncated && memcmp(entry->frames, frames, sizeof(void *) * numFrames) == 0)
+        {
+            __atomic_add_fetch(&entry->count, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    __atomic_add_fetch(&table->dropped, 1, __ATOMIC_RELAXED);
+}
+
+/***
+ * Handle the profiler's signal: sample the stack we were running
+ *
+ * @param signo Signal received.
+ */
+static void profileHandler(int signo)
+{
+    void *frames[PROFILE_SKIP_FRAMES + ECRASH_PROFILE_MAX_FRAMES + 1];
+    int savedErrno = errno;
+    int count;
+
+    if (currentSlot() && gbl_cpuProfile.stacks && !gbl_crashing)
+    {
+        /* One frame more than we keep, to tell a deeper stack */
+        count = backtrace(frames, PROFILE_SKIP_FRAMES + ECRASH_PROFILE_MAX_FRAMES + 1) - PROFILE_SKIP_FRAMES;
+        if (count > ECRASH_PROFILE_MAX_FRAMES)
+        {
+            profileRecord(&gbl_cpuProfile, 0, frames + PROFILE_SKIP_FRAMES, ECRASH_PROFILE_MAX_FRAMES, true);
+        }
+        else if (count > 0)
+        {
+            profileRecord(&gbl_cpuProfile, 0, frames + PROFILE_SKIP_FRAMES, count, false);
+        }
+    }
+    errno = savedErrno;
+}
+
+/***
+ * Start sampling a thread: a timer on its CPU clock, signalling it
+ *
+ * Must be called by the thread itself (CLOCK_THREAD_CPUTIME_ID is the
+ * caller's clock).
+ *
+ * @param slot The thread's slot
+ */
+static void profileThreadStart(ThreadSlot *slot)
+{
+    struct itimerspec interval;
+    struct sigevent event;
+    long long ns = 1000000000LL / gbl_params.profileHz;
+
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = gbl_params.profileSignal;
+    event.sigev_notify_thread_id = slot->tid;
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &slot->profileTimer) != 0)
+    {
+        DPRINTF(ECRASH_DEBUG_ERROR, "Error: unable to create the profiling timer of %s: %s\n", slot->threadName,
+                strerror(errno));
+        return;
+    }
+
+    interval.it_interval.tv_sec = ns / 1000000000LL;
+    interval.it_interval.tv_nsec = ns % 1000000000LL;
+    interval.it_value = interval.it_interval;
+    timer_settime(slot->profileTimer, 0, &interval, NULL);
+    slot->profiling = true;
+}
+
+/***
+ * Stop sampling a thread
+ */
+static void profileThreadStop(ThreadSlot *slot)
+{
+    if (slot->profiling)
+    {
+        timer_delete(slot->profileTimer);
+        slot->profiling = false;
+    }
+}
+
+/***
+ * Find (or add) a thread's wall clock role: its name, less any trailing
+ * number ("worker-12" is a "worker")
+ *
+ * @returns the role's index, or WALL_MAX_ROLES once they are all taken
+ */
+static int wallRole(const char *name)
+{
+    size_t len = strlen(name);
+    int i;
+
+    while (len > 0 && strchr("0123456789 -_#.", name[len - 1]))
+    {
+        len--;
+    }
+    if (len == 0)
+    {
+        len = strlen(name);
+    }
+
+    for (i = 0 ; i < gbl_numWallRoles ; i++)
+    {
+        if (strncmp(gbl_wallRoles[i], name, len) == 0 && gbl_wallRoles[i][len] == '\0')
+        {
+            return i;
+        }
+    }
+    if (i == WALL_MAX_ROLES)
+    {
+        return WALL_MAX_ROLES;
+    }
+
+    memcpy(gbl_wallRoles[i], name, len);
+    gbl_wallRoles[i][len] = '\0';
+    __atomic_store_n(&gbl_numWallRoles, i + 1, __ATOMIC_RELEASE);
+
+    return i;
+}
+
+/***
+ * Take one wall clock sample of every registered thread
+ *
+ * Their states are read first, since the signals are about to wake them
+ * all.  Then every thread is signalled before any is waited for, so they
+ * unwind their stacks in parallel, and the slowest sets the pace rather
+ * than their sum.  Each only unwinds the frames a sample keeps, however
+ * deep maxStackDepth lets a dump go.  The capture slots are the dumps'
+ * own, so the sample is skipped while a dump runs (and a crash waits for
+ * it, as for a dump).
+ */
+static void wallSample(void)
+{
+    int depth = WALL_SAMPLE_FRAMES < gbl_params.maxStackDepth ? WALL_SAMPLE_FRAMES : gbl_params.maxStackDepth;
+    char stat[512];
+    const char *p;
+    ThreadSlot *slot;
+    pid_t none = 0;
+    bool truncated;
+    ssize_t got;
+    int count;
+    int t;
+
+    if (gbl_crashing || !__atomic_compare_exchange_n(&gbl_dumpOwner, &none, (pid_t)syscall(SYS_gettid), false,
+                                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&ThreadListMutex);
+    for (t = 0 ; ThreadSlots && t < gbl_params.maxThreads ; t++)
+    {
+        slot = &ThreadSlots[t];
+        if (!slot->inUse)
+        {
+            continue;
+        }
+
+        slot->wallState = '?';
+        if (slot->statFd > -1 && (got = pread(slot->statFd, stat, sizeof(stat) - 1, 0)) > 0)
+        {
+            stat[got] = '\0';
+            p = strrchr(stat, ')');
+            if (p && p[1] == ' ')
+            {
+                slot->wallState = p[2];
+            }
+        }
+        slot->backtraceDepth = depth;
+        slot->backtraceDone = 0;
+    }
+
+    for (t = 0 ; ThreadSlots && t < gbl_params.maxThreads ; t++)
+    {
+        if (ThreadSlots[t].inUse)
+        {
+            pthread_kill(ThreadSlots[t].thread, ThreadSlots[t].backtraceSignal);
+        }
+    }
+
+    /* A thread that can't take signals just now (in D state, say) is counted without its stack */
+    waitBacktraces(0, nowNs() + WALL_SAMPLE_WAIT_MS * 1000000LL);
+
+    for (t = 0 ; ThreadSlots && t < gbl_params.maxThreads ; t++)
+    {
+        slot = &ThreadSlots[t];
+        if (!slot->inUse)
+        {
+            continue;
+        }
+
+        if (slot->wallRole < 0)
+        {
+            slot->wallRole = wallRole(slot->threadName);
+        }
+
+        count = slot->backtraceDone ? slot->backtrace.entries - BT_HANDLER_FRAMES : 0;
+        truncated = count > 0 && slot->backtrace.entries >= depth;
+        if (count > ECRASH_PROFILE_MAX_FRAMES)
+        {
+            count = ECRASH_PROFILE_MAX_FRAMES;
+        }
+        profileRecord(&gbl_wallProfile, (uint32_t)slot->wallRole << 8 | (unsigned char)slot->wallState,
+                      slot->backtrace.frames + BT_HANDLER_FRAMES, count > 0 ? count : 0, truncated);
+    }
+    pthread_mutex_unlock(&ThreadListMutex);
+
+    __atomic_store_n(&gbl_dumpOwner, 0, __ATOMIC_RELEASE);
+}
+
+/***
+ * Name a frame for the folded output
+ *
+ * Just the function, when it resolves to one, so all the samples in a
+ * function fold together, whatever the line.
+ */
+static void profileFrameName(void *address, char *name, size_t len)
+{
+    const char *module;
+    FrameInfo info;
+
+    if (!resolveFrame(address, &info))
+    {
+        snprintf(name, len, "%p", address);
+    }
+    else if (info.function)
+    {
+        snprintf(name, len, "%s", info.function);
+    }
+    else
+    {
+        module = strrchr(info.module, '/');
+        snprintf(name, len, "%s+0x%lx", module ? module + 1 : info.module, info.offset);
+    }
+}
+
+/***
+ * Write a profile out, as folded stacks: one line per stack, its frames
+ * outermost first, separated by semicolons, then its count
+ *
+ * Wall clock stacks start with their role and state ("worker;[S];...").
+ * The file is written aside and renamed over the old one, so readers
+ * never see half of it.
+ *
+ * @param table The profile
+ *
+ * @returns zero, or -1 if it could not be written
+ */
+static int profileTableFlush(ProfileTable *table)
+{
+    char path[PATH_MAX];
+    char name[256];
+    ProfileStack *entry;
+    uint64_t dropped;
+    unsigned int role;
+    FILE *f;
+    int i;
+    int j;
+
+    snprintf(path, sizeof(path), "%s.tmp", table->file);
+    f = fopen(path, "we");
+    if (f == NULL)
+    {
+        DPRINTF(ECRASH_DEBUG_ERROR, "Error: unable to write profile %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    for (i = 0 ; i < ECRASH_PROFILE_MAX_STACKS ; i++)
+    {
+        entry = &table->stacks[i];
+        if (__atomic_load_n(&entry->key, __ATOMIC_ACQUIRE) < 2)
+        {
+            continue;
+        }
+
+        if (table == &gbl_wallProfile)
+        {
+            role = entry->tag >> 8;
+            fprintf(f, "%s;[%c];", role < (unsigned int)__atomic_load_n(&gbl_numWallRoles, __ATOMIC_ACQUIRE) ?
+                                   gbl_wallRoles[role] : "[other]", (char)(entry->tag & 0xff));
+        }
+        if (entry->truncated)
+        {
+            fputs("[truncated];", f);
+        }
+        if (entry->numFrames == 0)
+        {
+            fputs("[no answer] ", f);
+        }
+        for (j = entry->numFrames - 1 ; j >= 0 ; j--)
+        {
+            profileFrameName(entry->frames[j], name, sizeof(name));
+            fprintf(f, "%s%c", name, j ? ';' : ' ');
+        }
+        fprintf(f, "%llu\n", (unsigned long long)__atomic_load_n(&entry->count, __ATOMIC_RELAXED));
+    }
+
+    dropped = __atomic_load_n(&table->dropped, __ATOMIC_RELAXED);
+    if (dropped)
+    {
+        fprintf(f, "[dropped] %llu\n", (unsigned long long)dropped);
+    }
+
+    if (fclose(f) != 0 || rename(path, table->file) != 0)
+    {
+        DPRINTF(ECRASH_DEBUG_ERROR, "Error: unable to write profile %s: %s\n", table->file, strerror(errno));
+        unlink(path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/***
+ * Write out every running profile
+ *
+ * @returns zero, or -1 if any could not be written
+ */
+static int profileFlush(void)
+{
+    int rc = 0;
+
+    if (gbl_cpuProfile.stacks && profileTableFlush(&gbl_cpuProfile) != 0)
+    {
+        rc = -1;
+    }
+    if (gbl_wallProfile.stacks && profileTableFlush(&gbl_wallProfile) != 0)
+    {
+        rc = -1;
+    }
+
+    return rc;
+}
+
+/***
+ * The profiler thread: takes the wall clock samples, every wallSampleMs,
+ * and writes the profiles out every profileFlushSeconds
+ */
+static void *profileThread(void *arg)
+{
+    long long flushPeriod = gbl_params.profileFlushSeconds * 1000000000LL;
+    long long flushAt = nowNs() + flushPeriod;
+    int period = gbl_wallProfile.stacks ? (int)gbl_params.wallSampleMs : (int)gbl_params.profileFlushSeconds * 1000;
+
+    __atomic_store_n(&gbl_profileTid, (pid_t)syscall(SYS_gettid), __ATOMIC_RELAXED);
+    while (!helperThreadWait(gbl_profilePipe[0], period))
+    {
+        if (gbl_wallProfile.stacks)
+        {
+            wallSample();
+        }
+        if (nowNs() >= flushAt)
+        {
+            profileFlush();
+            flushAt = nowNs() + flushPeriod;
+        }
+    }
+
+    return NULL;
+}
+
+/***
+ * Map a profile's table
+ *
+ * @returns zero, or -1 if it could not be mapped
+ */
+static int profileTableInit(ProfileTable *table, const char *file)
+{
+    void *stacks;
+
+    stacks = mmap(NULL, sizeof(ProfileStack) * ECRASH_PROFILE_MAX_STACKS, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (stacks == MAP_FAILED)
+    {
+        DPRINTF(ECRASH_DEBUG_ERROR, "Error: unable to map the profile for %s: %s\n", file, strerror(errno));
+        return -1;
+    }
+
+    table->file = file;
+    table->samples = 0;
+    table->dropped = 0;
+    table->stacks = stacks;
+
+    return 0;
+}
+
+/***
+ * Unmap a profile's table
+ */
+static void profileTableFini(ProfileTable *table)
+{
+    if (table->stacks)
+    {
+        munmap(table->stacks, sizeof(ProfileStack) * ECRASH_PROFILE_MAX_STACKS);
+        table->stacks = NULL;
+    }
+}
+
+/***
+ * Set up the profilers: their tables, the CPU profiler's signal, and
+ * the profiler thread
+ *
+ * Threads get their CPU timers (and /proc stat fds, for the wall clock
+ * sampler) as they register.
+ *
+ * @returns zero, or -1 if nothing could be set up
+ */
+static int profileInit(void)
+{
+    struct sigaction act;
+
+    if (pipe2(gbl_profilePipe, O_CLOEXEC | O_NONBLOCK) != 0)
+    {
+        DPRINTF(ECRASH_DEBUG_ERROR, "Error: unable to create the profiler pipe: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (gbl_params.wallSampleMs && gbl_params.wallProfileFile)
+    {
+        gbl_numWallRoles = 0;
+        profileTableInit(&gbl_wallProfile, gbl_params.wallProfileFile);
+    }
+
+    if (gbl_params.profileHz && gbl_params.profileFile &&
+        profileTableInit(&gbl_cpuProfile, gbl_params.profileFile) == 0)
+    {
+        memset(&act, 0, sizeof(act));
+        act.sa_handler = profileHandler;
+        sigemptyset(&act.sa_mask);
+        act.sa_flags = SA_RESTART;
+        sigaction(gbl_params.profileSignal, &act, &gbl_oldProfileAction);
+    }
+
+    if ((gbl_cpuProfile.stacks || gbl_wallProfile.stacks) &&
+        helperThreadStart(&gbl_profileThread, profileThread, "ecrash-profile") == 0)
+    {
+        gbl_profileRunning = true;
+    }
+
+    return (gbl_cpuProfile.stacks || gbl_wallProfile.stacks) ? 0 : -1;
+}
+
+/***
+ * Stop the profilers, and write the profiles out a last time
+ */
+static void profileFini(void)
+{
+    char request = 'q';
+    int i;
+
+    if (gbl_profileRunning && write(gbl_profilePipe[1], &request, 1) == 1)
+    {
+        pthread_join(gbl_profileThread, NULL);
+    }
+    gbl_profileRunning = false;
+    gbl_profileTid = 0;
+    if (gbl_profilePipe[0] > -1)
+    {
+        close(gbl_profilePipe[0]);
+        close(gbl_profilePipe[1]);
+        gbl_profilePipe[0] = gbl_profilePipe[1] = -1;
+    }
+
+    if (gbl_cpuProfile.stacks)
+    {
+        pthread_mutex_lock(&ThreadListMutex);
+        for (i = 0 ; ThreadSlots && i < gbl_params.maxThreads ; i++)
+        {
+            profileThreadStop(&ThreadSlots[i]);
+        }
+        pthread_mutex_unlock(&ThreadListMutex);
+    }
+
+    profileFlush();
+
+    if (gbl_cpuProfile.stacks)
+    {
+        /* A sample still on its way must not get the default action (SIGPROF's kills) */
+        if (gbl_oldProfileAction.sa_handler == SIG_DFL)
+        {
+            gbl_oldProfileAction.sa_handler = SIG_IGN;
+        }
+        sigaction(gbl_params.profileSignal, &gbl_oldProfileAction, NULL);
+    }
+
+    profileTableFini(&gbl_cpuProfile);
+    profileTableFini(&gbl_wallProfile);
+}
+/***
+ * Warm up the crash path
+ *
+ * The first call to backtrace() loads libgcc_s and initializes the
+ * unwinder, and both of those allocate.  Do it now, while it's safe,
+ * so the handler never has to.
+ */
+static void prewarmCrashPath(void)
+{
+    void *frames[4];
+    Dl_info info;
+
+    backtrace(frames, 4);
+
+    if (gbl_params.useBacktraceSymbols != false)
+    {
+        dladdr((void *)prewarmCrashPath, &info);
+    }
+}
+
+/***
+ * Validate a passed-in symbol table
+ *
+ * For now, just print it out (if verbose), and make sure it's
+ * sorted and none of the pointers are zero.
+ */
+static int ValidateSymbolTable(void)
+{
+    int i;
+    int rc = 0;
+    unsigned long lastAddress = 0;
+
+    /* Get out of here if the table is empty */
+    if (!gbl_params.symbolTable)
+    {
+        return 0;
+    }
+
+    /* Dump it in verbose mode */
+    DPRINTF(ECRASH_DEBUG_VERBOSE, "Symbol Table Provided with %d symbols\n", gbl_params.symbolTable->numSymbols);
+    for (i = 0 ; i < gbl_params.symbolTable->numSymbols ; i++)
+    {
+        /* Dump it in verbose mode */
+        DPRINTF(ECRASH_DEBUG_VERBOSE, "%-30s %p\n", gbl_params.symbolTable->symbols[i].function,
+                gbl_params.symbolTable->symbols[i].address);
+        if (lastAddress > (unsigned long)gbl_params.symbolTable->symbols[i].address)
+        {
+            DPRINTF(ECRASH_DEBUG_ERROR, "Error: symbol table is not sorted (last=%p, current=%p)\n",
+                    (void *)lastAddress, gbl_params.symbolTable->symbols[i].address);
+            rc = -1;
+        }
+
+    }
+
+    return rc;
+
+}
+
+/*********************************************************************
+ *********************************************************************
+ **      P  U  B  L  I  C      F  U  N  C  T  I  O  N  S
+ *********************************************************************
+ ********************************************************************/
+
+/***
+ * Initialize eCrash.
+ * 
+ * This function must be called before calling any other eCrash
+ * functions.  It sets up the global behavior of the system, and
+ * registers the calling thread for crash dumps.
+ *
+ * @param params Our input parameters.  The passed in structure will be copied.
+ *
+ * @return Zero on success.
+ */
+int eCrash_Init(eCrashParameters *params)
+{
+    struct sigaction act;
+    int sigIndex;
+    int i;
+    int ret = 0;
+
+    DPRINTF(ECRASH_DEBUG_VERY_VERBOSE, "Init Starting params = %p\n", params);
+
+    memset(&act, 0, sizeof(act));
+    sigemptyset(&act.sa_mask);
+    act.sa_sigaction = crash_handler;
+    act.sa_flags = SA_SIGINFO | SA_RESTART;
+
+    if (params != NULL)
+    {
+        /* Make ourselves a global copy of params. */
+        gbl_params = *params;
+
+        /* Set our defaults, if they weren't specified */
+        if (gbl_params.maxStackDepth == 0)
+        {
+            gbl_params.maxStackDepth = ECRASH_DEFAULT_STACK_DEPTH;
+        }
+
+        if (gbl_params.stackHeadFrames == 0)
+        {
+            gbl_params.stackHeadFrames = ECRASH_DEFAULT_STACK_HEAD_FRAMES;
+        }
+
+        if (gbl_params.stackTailFrames == 0)
+        {
+            gbl_params.stackTailFrames = ECRASH_DEFAULT_STACK_TAIL_FRAMES;
+        }
+
+        if (gbl_params.maxCyclePeriod == 0)
+        {
+            gbl_params.maxCyclePeriod = ECRASH_DEFAULT_MAX_CYCLE_PERIOD;
+        }
+
+        if (gbl_params.maxThreads == 0)
+        {
+            gbl_params.maxThreads = ECRASH_DEFAULT_MAX_THREADS;
+        }
+
+        if (gbl_params.sinkTimeoutMs == 0)
+        {
+            gbl_params.sinkTimeoutMs = ECRASH_DEFAULT_SINK_TIMEOUT_MS;
+        }
+
+        if (gbl_params.sinkMaxFailures == 0)
+        {
+            gbl_params.sinkMaxFailures = ECRASH_DEFAULT_SINK_MAX_FAILURES;
+        }
+
+        if (gbl_params.crashArenaSize == 0)
+        {
+            gbl_params.crashArenaSize = ECRASH_DEFAULT_CRASH_ARENA_SIZE;
+        }
+
+        if (gbl_params.defaultBacktraceSignal == 0)
+        {
+            gbl_params.defaultBacktraceSignal = ECRASH_DEFAULT_BACKTRACE_SIGNAL;
+        }
+
+        if (gbl_params.threadWaitTime == 0)
+        {
+            gbl_params.threadWaitTime = ECRASH_DEFAULT_THREAD_WAIT_TIME;
+        }
+
+        if (gbl_params.memorySnapshotSize == 0)
+        {
+            gbl_params.memorySnapshotSize = ECRASH_DEFAULT_MEMORY_SNAPSHOT_SIZE;
+        }
+
+        if (gbl_params.crashLoopWindow == 0)
+        {
+            gbl_params.crashLoopWindow = ECRASH_DEFAULT_CRASH_LOOP_WINDOW;
+        }
+
+        if (gbl_params.disposition == ECRASH_DISPOSITION_DEFAULT)
+        {
+            gbl_params.disposition = ECRASH_DISPOSITION_EXIT;
+        }
+
+        if (gbl_params.profileFlushSeconds == 0)
+        {
+            gbl_params.profileFlushSeconds = ECRASH_DEFAULT_PROFILE_FLUSH_SECONDS;
+        }
+
+        if (gbl_params.profileSignal == 0)
+        {
+            gbl_params.profileSignal = ECRASH_DEFAULT_PROFILE_SIGNAL;
+        }
 
         if (gbl_params.debugLevel == 0)
         {
             gbl_params.debugLevel = ECRASH_DEBUG_DEFAULT;
         }
 
+        /* Allocate our crash arena, now that we know how big everything is */
+        if (arenaInit(arenaSizeNeeded(&gbl_params)) != 0)
+        {
+            DPRINTF(ECRASH_DEBUG_ERROR, "   Error:  Unable to map crash arena!\n");
+            return -1;
+        }
+
+        gbl_crashBacktrace.frames = arenaAlloc(sizeof(void *) * (gbl_params.maxStackDepth + FRAME_SLACK));
+        gbl_memorySnapshot = arenaAlloc(gbl_params.memorySnapshotSize);
+        if (gbl_params.dumpResources != false)
+        {
+            gbl_resourceMaps = arenaAlloc(sizeof(ResourceMap) * ECRASH_MAX_RESOURCE_MAPS);
+        }
+        ThreadSlots = arenaAlloc(sizeof(ThreadSlot) * gbl_params.maxThreads);
+        for (i = 0 ; i < gbl_params.maxThreads ; i++)
+        {
+            ThreadSlots[i].backtrace.frames = arenaAlloc(sizeof(void *) * (gbl_params.maxStackDepth + FRAME_SLACK));
+        }
+
+        /* Threads pick their role's deadline when they register */
+        memset(gbl_heartbeatRoles, 0, sizeof(gbl_heartbeatRoles));
+        for (i = 0 ; i < ECRASH_MAX_HEARTBEAT_ROLES && params->heartbeatRoles[i].role ; i++)
+        {
+            strncpy(gbl_heartbeatRoles[i].role, params->heartbeatRoles[i].role, ECRASH_MAX_THREAD_NAME_LEN - 1);
+            gbl_heartbeatRoles[i].deadlineMs = params->heartbeatRoles[i].deadlineMs;
+        }
+        gbl_numHeartbeatRoles = i;
+
+        if (params->filename)
+        {
+            gbl_params.filename = arenaAlloc(strlen(params->filename) + 1);
+            strcpy(gbl_params.filename, params->filename);
+        }
+
+        if (params->profileFile)
+        {
+            gbl_params.profileFile = arenaAlloc(strlen(params->profileFile) + 1);
+            strcpy(gbl_params.profileFile, params->profileFile);
+        }
+
+        if (params->wallProfileFile)
+        {
+            gbl_params.wallProfileFile = arenaAlloc(strlen(params->wallProfileFile) + 1);
+            strcpy(gbl_params.wallProfileFile, params->wallProfileFile);
+        }
+
         /* Copy our symbol table */
         if (gbl_params.symbolTable)
         {
             DPRINTF(ECRASH_DEBUG_VERBOSE, "symbolTable @ %p -- %d symbols\n", gbl_params.symbolTable,
                     gbl_params.symbolTable->numSymbols);
             /* Make a copy of our symbol table */
-            gbl_params.symbolTable = malloc(sizeof(eCrashSymbolTable));
+            gbl_params.symbolTable = arenaAlloc(sizeof(eCrashSymbolTable));
             memcpy(gbl_params.symbolTable, params->symbolTable, sizeof(eCrashSymbolTable));
 
             /* Now allocate / copy the actual table. */
-            gbl_params.symbolTable->symbols = malloc(sizeof(eCrashSymbol) * gbl_params.symbolTable->numSymbols);
+            gbl_params.symbolTable->symbols = arenaAlloc(sizeof(eCrashSymbol) * gbl_params.symbolTable->numSymbols);
             memcpy(gbl_params.symbolTable->symbols, params->symbolTable->symbols,
                    sizeof(eCrashSymbol) * gbl_params.symbolTable->numSymbols);
 
             ValidateSymbolTable();
         }
 
+        /* Open our output now, rather than from inside the handler */
+        outputInit();
+
+        memset(gbl_ownAnnotations, 0, sizeof(gbl_ownAnnotations));
+        gbl_annotations = gbl_ownAnnotations;
+
+        if (gbl_params.blackBoxDir)
+        {
+            blackBoxInit();
+        }
+
+        if (gbl_params.crashRecordFile)
+        {
+            crashRecordInit();
+        }
+
+        if (gbl_params.crashLoopFile)
+        {
+            crashLoopInit();
+        }
+
+        if (gbl_params.coredumpFilter)
+        {
+            coreSetFilter(gbl_params.coredumpFilter);
+        }
+
+        if (gbl_params.dumpResources != false)
+        {
+            resourcesInit();
+        }
+
+        /* For the threads' scheduler state, read relative to it from the handler */
+        gbl_clockTicks = sysconf(_SC_CLK_TCK);
+        if (gbl_clockTicks <= 0)
+        {
+            gbl_clockTicks = 100;
+        }
+        gbl_taskDirFd = open("/proc/self/task", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (gbl_taskDirFd < 0)
+        {
+            DPRINTF(ECRASH_DEBUG_ERROR, "Error: unable to open /proc/self/task: %s\n", strerror(errno));
+        }
+
+        /* Get the allocations backtrace() does on first use out of the way */
+        prewarmCrashPath();
+
+        if (gbl_params.dumpSignal || gbl_params.dumpSocket)
+        {
+            dumpTriggerInit();
+        }
+
+        if (gbl_params.hangAction != ECRASH_HANG_NONE)
+        {
+            bool abortCaught = false;
+
+            for (sigIndex = 0 ; gbl_params.signals[sigIndex] != 0 ; sigIndex++)
+            {
+                abortCaught |= (gbl_params.signals[sigIndex] == SIGABRT);
+            }
+            if (gbl_params.hangAbort != false && !abortCaught)
+            {
+                DPRINTF(ECRASH_DEBUG_WARN, "Warning: hangAbort without SIGABRT in signals: a hung thread will be "
+                        "killed with no crash report\n");
+            }
+            watchdogInit();
+        }
+
+        if ((gbl_params.profileHz && gbl_params.profileFile) ||
+            (gbl_params.wallSampleMs && gbl_params.wallProfileFile))
+        {
+            profileInit();
+        }
+
         /* And, finally, register for our signals */
         for (sigIndex = 0 ; gbl_params.signals[sigIndex] != 0 ; sigIndex++)
         {
             DPRINTF(ECRASH_DEBUG_VERY_VERBOSE, "   Catching signal[%d] %d\n", sigIndex, gbl_params.signals[sigIndex]);
-
-            /* I know there's a better way to catch signals with pthreads.
-             * I'll do it later TODO
-             */
-            signal(gbl_params.signals[sigIndex], crash_handler);
+            sigaction(gbl_params.signals[sigIndex], &act, &gbl_oldCrashActions[sigIndex]);
         }
     }
     else
@@ -635,11 +7780,121 @@ int eCrash_Init(eCrashParameters *params)
  */
 int eCrash_Uninit(void)
 {
-    NIY();
+    int sigIndex;
+    int i;
+
+    /* No more live dumps, or samples */
+    watchdogFini();
+    dumpTriggerFini();
+    profileFini();
+
+    /* Put back the crash handlers we replaced */
+    for (sigIndex = 0 ; gbl_params.signals[sigIndex] != 0 ; sigIndex++)
+    {
+        sigaction(gbl_params.signals[sigIndex], &gbl_oldCrashActions[sigIndex], NULL);
+    }
+
+    if (gbl_crashRecordFd > -1)
+    {
+        close(gbl_crashRecordFd);
+        gbl_crashRecordFd = -1;
+    }
+
+    if (gbl_crashLoopFd > -1)
+    {
+        close(gbl_crashLoopFd);
+        gbl_crashLoopFd = -1;
+    }
+
+    if (gbl_taskDirFd > -1)
+    {
+        close(gbl_taskDirFd);
+        gbl_taskDirFd = -1;
+    }
+
+    if (gbl_procStatusFd > -1)
+    {
+        close(gbl_procStatusFd);
+        gbl_procStatusFd = -1;
+    }
+    if (gbl_procMapsFd > -1)
+    {
+        close(gbl_procMapsFd);
+        gbl_procMapsFd = -1;
+    }
+    if (gbl_procFdDirFd > -1)
+    {
+        close(gbl_procFdDirFd);
+        gbl_procFdDirFd = -1;
+    }
+
+    /* Forget every registered thread (which will notice, at its next call, by the generation) */
+    pthread_mutex_lock(&ThreadListMutex);
+    __atomic_add_fetch(&eCrash_generation, 1, __ATOMIC_RELEASE);
+    for (i = 0 ; ThreadSlots && i < gbl_params.maxThreads ; i++)
+    {
+        if (ThreadSlots[i].inUse)
+        {
+            ThreadSlots[i].inUse = 0;
+            signal(ThreadSlots[i].backtraceSignal, ThreadSlots[i].oldHandler);
+            if (ThreadSlots[i].statFd > -1)
+            {
+                close(ThreadSlots[i].statFd);
+            }
+        }
+    }
+    blackBoxFini();
+    gbl_annotations = NULL;
+    ThreadSlots = NULL;
+    pthread_mutex_unlock(&ThreadListMutex);
+
+    for (i = 0 ; i < gbl_numSinks ; i++)
+    {
+        if (gbl_sinks[i].owned)
+        {
+            close(gbl_sinks[i].fd);
+        }
+        if (gbl_sinks[i].liveFd > -1)
+        {
+            close(gbl_sinks[i].liveFd);
+        }
+    }
+    gbl_numSinks = 0;
+
+    for (i = 0 ; i < gbl_numStreams ; i++)
+    {
+        if (gbl_streams[i].memfd > -1)
+        {
+            close(gbl_streams[i].memfd);
+        }
+    }
+    gbl_numStreams = 0;
+
+    /* The filename and symbol table copies went away with the arena */
+    gbl_crashBacktrace.frames = NULL;
+    gbl_memorySnapshot = NULL;
+    gbl_resourceMaps = NULL;
+    arenaFini();
+    memset(&gbl_params, 0, sizeof(gbl_params));
 
     return 0;
 }
 
+/***
+ * Get the fd of the report memfd.
+ *
+ * In memfd mode (useMemfd) every report is assembled in a memfd before
+ * being copied out to the sinks.  The memfd holds everything written so
+ * far, even if the dump was cut short, so a collector can read it back
+ * (through this fd, or /proc/<pid>/fd/<fd> from outside).
+ *
+ * @return The memfd, or -1 when not in memfd mode.
+ */
+int eCrash_GetReportFd(void)
+{
+    return gbl_numStreams > 0 ? gbl_streams[0].memfd : -1;
+}
+
 /***
  * Register a thread for backtracing on crash.
  * 
@@ -654,6 +7909,8 @@ int eCrash_Uninit(void)
 int eCrash_RegisterThread(char *name, int signo)
 {
     sighandler_t old_handler;
+    ThreadSlot *slot;
+    int i;
 
     /* Register for our signal */
     if (signo == 0)
@@ -662,8 +7919,43 @@ int eCrash_RegisterThread(char *name, int signo)
     }
 
     old_handler = signal(signo, bt_handler);
-    return addThreadToList(name, pthread_self(), signo, old_handler);
+    if (old_handler == bt_handler)
+    {
+        /* Another thread already hooked this signal: remember what it replaced */
+        for (i = 0 ; ThreadSlots && i < gbl_params.maxThreads ; i++)
+        {
+            if (ThreadSlots[i].inUse && ThreadSlots[i].backtraceSignal == signo)
+            {
+                old_handler = ThreadSlots[i].oldHandler;
+                break;
+            }
+        }
+    }
+
+    slot = addThreadToList(name, pthread_self(), signo, old_handler);
+    if (!slot)
+    {
+        return -1;
+    }
 
+    tls_threadSlot = slot;
+    eCrash_tlsGeneration = eCrash_generation;
+    eCrash_tlsBreadcrumbs = slot->breadcrumbs;
+    eCrash_tlsMetrics = &slot->metrics;
+    eCrash_tlsHeartbeat = &slot->heartbeat;
+
+    if (gbl_cpuProfile.stacks)
+    {
+        profileThreadStart(slot);
+    }
+    if (gbl_wallProfile.stacks)
+    {
+        /* Kept open, as a pread of it costs a third of an open and read */
+        pthread_mutex_lock(&ThreadListMutex);
+        slot->statFd = taskOpen(slot->tid, "stat");
+        pthread_mutex_unlock(&ThreadListMutex);
+    }
+    return 0;
 }
 
 /***
@@ -676,6 +7968,237 @@ int eCrash_RegisterThread(char *name, int signo)
  */
 int eCrash_UnregisterThread(void)
 {
+    ThreadSlot *slot = currentSlot();
+
+    /* Hand our counts to the shared shard, so they outlive our slot */
+    eCrash_tlsMetrics = NULL;
+    if (slot)
+    {
+        profileThreadStop(slot);
+        metricsAdd(&eCrash_sharedMetrics, &slot->metrics);
+        memset(&slot->metrics, 0, sizeof(slot->metrics));
+    }
+
+    tls_threadSlot = NULL;
+    eCrash_tlsBreadcrumbs = NULL;
+    eCrash_tlsHeartbeat = NULL;
     return removeThreadFromList(pthread_self());
 }
 
+/***
+ * Publish the calling thread's stack to the black box.
+ *
+ * The stack is unwound into a local buffer (this frame left out) and
+ * copied into the thread's black box record; see blackBoxPublish.
+ *
+ * @return Zero on success, -1 if there is no black box or the thread is not registered.
+ */
+int eCrash_Snapshot(void)
+{
+    void *frames[ECRASH_BLACKBOX_MAX_FRAMES + 1];
+    ThreadSlot *slot = currentSlot();
+    int count;
+
+    if (!slot || !slot->box)
+    {
+        return -1;
+    }
+
+    count = backtrace(frames, ECRASH_BLACKBOX_MAX_FRAMES + 1);
+    blackBoxPublish(&slot->box->stack, frames + 1, count - 1);
+
+    return 0;
+}
+
+/***
+ * Dump all registered threads now, without a crash.
+ *
+ * @param sinkSelector Sinks to write to (ECRASH_DUMP_ALL_SINKS for all)
+ *
+ * @return Zero once dumped, 1 if coalesced into a dump already running, -1 if eCrash isn't set up or the
+ *         process is crashing.
+ */
+int eCrash_DumpNow(unsigned int sinkSelector)
+{
+    return dumpNow(sinkSelector, 0, NULL);
+}
+
+/***
+ * Write the CPU and wall clock profiles now.
+ *
+ * @return Zero on success, -1 if neither profiler is running or the file could not be written.
+ */
+int eCrash_ProfileFlush(void)
+{
+    return (gbl_cpuProfile.stacks || gbl_wallProfile.stacks) ? profileFlush() : -1;
+}
+
+/***
+ * Set the calling thread's heartbeat deadline.
+ *
+ * @param deadlineMs Longest the thread may go without a heartbeat, or 0 not to watch it
+ *
+ * @return Zero on success, -1 if the thread is not registered.
+ */
+int eCrash_SetHeartbeatDeadline(unsigned int deadlineMs)
+{
+    ThreadSlot *slot = currentSlot();
+
+    if (!slot)
+    {
+        return -1;
+    }
+
+    /* Watched from the next heartbeat on */
+    __atomic_store_n(&slot->heartbeat, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->deadlineMs, deadlineMs, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+/***
+ * Set a process wide annotation.
+ *
+ * @param key   Name of the annotation
+ * @param value Its new value, or NULL to clear it
+ *
+ * @return Zero on success, -1 if eCrash is not initialized or all the slots are taken.
+ */
+int eCrash_SetAnnotation(const char *key, const char *value)
+{
+    if (!gbl_annotations || !key)
+    {
+        return -1;
+    }
+
+    return annotationSet(gbl_annotations, ECRASH_MAX_ANNOTATIONS, key, value);
+}
+
+/***
+ * Set an annotation of the calling thread.
+ *
+ * @param key   Name of the annotation
+ * @param value Its new value, or NULL to clear it
+ *
+ * @return Zero on success, -1 if the thread is not registered or all its slots are taken.
+ */
+int eCrash_SetThreadAnnotation(const char *key, const char *value)
+{
+    ThreadSlot *slot = currentSlot();
+
+    if (!slot || !key)
+    {
+        return -1;
+    }
+
+    return annotationSet(slot->annotations, ECRASH_MAX_THREAD_ANNOTATIONS, key, value);
+}
+
+/***
+ * Register a named counter.
+ *
+ * @param name Name to print it under
+ *
+ * @return The counter's id, or -1 if there is no room for it.
+ */
+int eCrash_RegisterCounter(const char *name)
+{
+    return name ? metricRegister(gbl_counterNames, &gbl_numCounters, ECRASH_MAX_COUNTERS, name) : -1;
+}
+
+/***
+ * Register a named histogram.
+ *
+ * @param name Name to print it under
+ *
+ * @return The histogram's id, or -1 if there is no room for it.
+ */
+int eCrash_RegisterHistogram(const char *name)
+{
+    return name ? metricRegister(gbl_histogramNames, &gbl_numHistograms, ECRASH_MAX_HISTOGRAMS, name) : -1;
+}
+
+/***
+ * Leave a range of memory out of core dumps.
+ *
+ * @param ptr  Start of the range
+ * @param len  Its length, in bytes
+ * @param name What it is, for the report
+ *
+ * @return Zero on success, -1 on failure.
+ */
+int eCrash_ExcludeFromCore(const void *ptr, size_t len, const char *name)
+{
+    CoreExclusion *range;
+    unsigned long start;
+    unsigned long end;
+    int ret = 0;
+
+    if (!corePages(ptr, len, &start, &end))
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&CoreMutex);
+
+    /* Excluding part of a range again just renames that part */
+    if (coreExclusionsRemove(start, end) != 0 || gbl_numCoreExclusions == ECRASH_MAX_CORE_EXCLUSIONS)
+    {
+        DPRINTF(ECRASH_DEBUG_ERROR, "Error: no room to exclude %s from cores\n", name ? name : "memory");
+        ret = -1;
+    }
+    else if (madvise((void *)start, end - start, MADV_DONTDUMP) != 0)
+    {
+        DPRINTF(ECRASH_DEBUG_ERROR, "Error: unable to exclude %s from cores: %s\n", name ? name : "memory",
+                strerror(errno));
+        ret = -1;
+    }
+    else
+    {
+        range = &gbl_coreExclusions[gbl_numCoreExclusions];
+        range->start = start;
+        range->length = end - start;
+        strncpy(range->name, name ? name : "", sizeof(range->name) - 1);
+        range->name[sizeof(range->name) - 1] = '\0';
+        __atomic_store_n(&gbl_numCoreExclusions, gbl_numCoreExclusions + 1, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&CoreMutex);
+
+    return ret;
+}
+
+/***
+ * Put a range back into core dumps.
+ *
+ * @param ptr Start of the range
+ * @param len Its length, in bytes
+ *
+ * @return Zero on success, -1 on failure.
+ */
+int eCrash_IncludeInCore(const void *ptr, size_t len)
+{
+    unsigned long start;
+    unsigned long end;
+    int ret = 0;
+
+    if (!corePages(ptr, len, &start, &end))
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&CoreMutex);
+    if (coreExclusionsRemove(start, end) != 0)
+    {
+        DPRINTF(ECRASH_DEBUG_ERROR, "Error: no room to split a range excluded from cores\n");
+        ret = -1;
+    }
+    else if (madvise((void *)start, end - start, MADV_DODUMP) != 0)
+    {
+        DPRINTF(ECRASH_DEBUG_ERROR, "Error: unable to include memory in cores: %s\n", strerror(errno));
+        ret = -1;
+    }
+    pthread_mutex_unlock(&CoreMutex);
+
+    return ret;
+}
@@ -10,17 +10,57 @@
 #define _ECRASH_H_
 
 #include <stdio.h>
+#include <stdint.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <time.h>
 
 typedef void (*sighandler_t)(int);
 
-#define MAX_LINE_LEN 256
-
 #define ECRASH_DEFAULT_STACK_DEPTH 10
+#define ECRASH_DEFAULT_STACK_HEAD_FRAMES 8
+#define ECRASH_DEFAULT_STACK_TAIL_FRAMES 8
+#define ECRASH_DEFAULT_MAX_CYCLE_PERIOD 16
+#define ECRASH_MIN_CYCLE_REPEATS 3
 #define ECRASH_DEFAULT_BACKTRACE_SIGNAL SIGUSR2
 #define ECRASH_DEFAULT_THREAD_WAIT_TIME 10
 #define ECRASH_MAX_NUM_SIGNALS 30
+#define ECRASH_DEFAULT_MAX_THREADS 64
+#define ECRASH_MAX_THREAD_NAME_LEN 32
+#define ECRASH_DEFAULT_CRASH_ARENA_SIZE (256 * 1024)
+#define ECRASH_DEFAULT_SINK_TIMEOUT_MS 2000
+#define ECRASH_DEFAULT_SINK_MAX_FAILURES 3
+#define ECRASH_MAX_NUM_SINKS 8
+#define ECRASH_DEFAULT_SLOT_SIZE (256 * 1024)
+#define ECRASH_NUM_BREADCRUMBS 16   /* Per thread; must be a power of two */
+#define ECRASH_MAX_ANNOTATIONS 16           /* Process wide */
+#define ECRASH_MAX_THREAD_ANNOTATIONS 4     /* Per thread */
+#define ECRASH_ANNOTATION_KEY_LEN 32        /* Including the terminator, as are... */
+#define ECRASH_ANNOTATION_VALUE_LEN 64      /* ...values; longer ones are cut */
+#define ECRASH_MAX_COUNTERS 32
+#define ECRASH_MAX_HISTOGRAMS 8
+#define ECRASH_HISTOGRAM_BUCKETS 64         /* Bucket b counts values in [2^b, 2^(b+1)) (and 0, in bucket 0) */
+#define ECRASH_METRIC_NAME_LEN 32
+#define ECRASH_MAX_CORE_EXCLUSIONS 32
+#define ECRASH_CRASH_LOOP_SIGNATURES 8      /* Crash signatures kept in the crash loop file */
+#define ECRASH_BLACKBOX_KEEP 8              /* Black boxes of dead processes kept in blackBoxDir */
+#define ECRASH_DEFAULT_CRASH_LOOP_WINDOW 300
+#define ECRASH_DEFAULT_MEMORY_SNAPSHOT_SIZE 2048
+#define ECRASH_MAX_RESOURCE_MAPS 64         /* Mapped files listed in the resource section */
+#define ECRASH_MAX_HEARTBEAT_ROLES 8
+#define ECRASH_WATCHDOG_INTERVAL_MS 100     /* How often the watchdog looks at the heartbeats */
+#define ECRASH_PROFILE_MAX_STACKS 4096      /* Distinct stacks the profiler counts; must be a power of two */
+#define ECRASH_PROFILE_MAX_FRAMES 32        /* Innermost frames kept of each sample */
+#define ECRASH_DEFAULT_PROFILE_SIGNAL SIGPROF
+#define ECRASH_DEFAULT_PROFILE_FLUSH_SECONDS 10
+
+/* eCrash_DumpNow sink selector: bit n selects sinks[n] (or, with the old style outputs, bit 0 filename, bit 1
+ * filep and bit 2 fd).  Zero selects them all. */
+#define ECRASH_DUMP_ALL_SINKS 0
+
+/* eCrashParameters.coredumpFilter for an eCrash report plus a minimal core: anonymous private memory (stacks,
+ * heap) and ELF headers only, less whatever was excluded with eCrash_ExcludeFromCore */
+#define ECRASH_COREDUMP_FILTER_MINIMAL 0x11
 
 /***
  * \struct eCrashSymbol
@@ -49,6 +89,187 @@ typedef struct
     eCrashSymbol *symbols;
 } eCrashSymbolTable;
 
+/***
+ * \enum eCrashSinkType
+ * \brief Kind of destination a sink writes to
+ */
+typedef enum
+{
+    ECRASH_SINK_NONE = 0,       /* Ends the sink list */
+    ECRASH_SINK_FILENAME,       /* File, opened (for append) by eCrash_Init */
+    ECRASH_SINK_FILEP,          /* Caller's FILE * (written through its fd) */
+    ECRASH_SINK_FD              /* Caller's fd */
+} eCrashSinkType;
+
+/***
+ * \enum eCrashFormat
+ * \brief Encoding of the report written to a sink
+ */
+typedef enum
+{
+    ECRASH_FORMAT_TEXT = 0,     /* The human readable banner format */
+    ECRASH_FORMAT_JSON,         /* One JSON object per line, per report section */
+    ECRASH_FORMAT_BINARY        /* Compact, CRC protected records (see eCrashRecord.h) */
+} eCrashFormat;
+
+/***
+ * \enum eCrashVerbosity
+ * \brief How much of the report a sink gets
+ */
+typedef enum
+{
+    ECRASH_VERBOSITY_DEFAULT = 0,   /* Same as ECRASH_VERBOSITY_NORMAL */
+    ECRASH_VERBOSITY_MINIMAL,       /* Crash header and the offending thread's raw addresses only */
+    ECRASH_VERBOSITY_NORMAL,        /* Everything captured, with symbols */
+    ECRASH_VERBOSITY_FULL           /* NORMAL, plus bulky sections (memory dumps, maps, ...) */
+} eCrashVerbosity;
+
+/***
+ * \enum eCrashDisposition
+ * \brief What the crash handler does once the report is written
+ */
+typedef enum
+{
+    ECRASH_DISPOSITION_DEFAULT = 0, /* Same as ECRASH_DISPOSITION_EXIT */
+    ECRASH_DISPOSITION_EXIT,        /* exit(signo): runs atexit handlers and destructors in the broken process */
+    ECRASH_DISPOSITION_QUICK_EXIT,  /* _exit(signo): leave at once */
+    ECRASH_DISPOSITION_RERAISE,     /* Restore the default action and re-raise: the real signal, and a core */
+    ECRASH_DISPOSITION_CHAIN,       /* Hand the signal to the handler installed before eCrash_Init */
+    ECRASH_DISPOSITION_LIVE         /* Not a crash: marks live dumps (eCrash_DumpNow), after which we carry on */
+} eCrashDisposition;
+
+/***
+ * Name of a disposition, as reports print it
+ */
+static inline const char *eCrash_DispositionName(eCrashDisposition disposition)
+{
+    switch (disposition)
+    {
+    case ECRASH_DISPOSITION_QUICK_EXIT:
+        return "_exit";
+    case ECRASH_DISPOSITION_RERAISE:
+        return "re-raise";
+    case ECRASH_DISPOSITION_CHAIN:
+        return "chain";
+    case ECRASH_DISPOSITION_LIVE:
+        return "kept running";
+    default:
+        return "exit";
+    }
+}
+
+/***
+ * \enum eCrashHangAction
+ * \brief What the watchdog does when a thread misses its heartbeat deadline
+ */
+typedef enum
+{
+    ECRASH_HANG_NONE = 0,           /* No watchdog */
+    ECRASH_HANG_DUMP_THREAD,        /* Live dump of the hung thread */
+    ECRASH_HANG_DUMP_ALL            /* Live dump of every registered thread */
+} eCrashHangAction;
+
+/***
+ * \struct eCrashHeartbeatRole
+ * \brief Heartbeat deadline of the threads whose names start with role
+ */
+typedef struct
+{
+    char *role;                 /* NULL ends the list */
+    unsigned int deadlineMs;
+} eCrashHeartbeatRole;
+
+/***
+ * \struct eCrashSink
+ * \brief One output destination, with its own format and verbosity
+ *
+ * The report is captured once, and encoded separately for each format/verbosity in use, so a terse binary
+ * record can go to flash while a full text report goes to stdout.
+ */
+typedef struct
+{
+    eCrashSinkType type;
+    /*** For ECRASH_SINK_FILENAME */
+    char *filename;
+    /*** ECRASH_SINK_FILENAME: rotate reports across this many preallocated slots (0 to append) */
+    int slots;
+    /*** Size of each slot (or of the space reserved ahead of an appended report).
+     * Default: ECRASH_DEFAULT_SLOT_SIZE */
+    size_t slotSize;
+    /*** For ECRASH_SINK_FILEP */
+    FILE *filep;
+    /*** For ECRASH_SINK_FD */
+    int fd;
+
+    eCrashFormat format;
+    eCrashVerbosity verbosity;
+    /*** LZ compress what this sink gets, in independently checked blocks (see eCrashRecord.h) */
+    bool compress;
+} eCrashSink;
+
+/***
+ * \struct eCrashBreadcrumb
+ * \brief One entry in a thread's flight recorder
+ */
+typedef struct
+{
+    uint64_t time;              /* CLOCK_MONOTONIC, in ns */
+    uint32_t id;
+    uint32_t reserved;
+    uint64_t arg;
+} eCrashBreadcrumb;
+
+/***
+ * \struct eCrashBreadcrumbRing
+ * \brief A thread's last ECRASH_NUM_BREADCRUMBS breadcrumbs
+ *
+ * Only the owning thread writes its ring.  count is the number of breadcrumbs ever recorded, so the newest
+ * is crumbs[(count - 1) % ECRASH_NUM_BREADCRUMBS].
+ */
+typedef struct
+{
+    uint64_t count;
+    eCrashBreadcrumb crumbs[ECRASH_NUM_BREADCRUMBS];
+} eCrashBreadcrumbRing;
+
+/***
+ * Bumped by eCrash_Uninit, which unmaps the thread slots.  The calling thread's slot pointers below are only
+ * good while eCrash_tlsGeneration, set by eCrash_RegisterThread, still matches it.
+ */
+extern unsigned int eCrash_generation;
+extern __thread unsigned int eCrash_tlsGeneration;
+
+/*** Whether the calling thread's slot pointers are still good */
+static inline bool eCrash_TlsCurrent(void)
+{
+    return eCrash_tlsGeneration == __atomic_load_n(&eCrash_generation, __ATOMIC_RELAXED);
+}
+
+/*** The calling thread's ring, set by eCrash_RegisterThread.  @see eCrash_Breadcrumb */
+extern __thread eCrashBreadcrumbRing *eCrash_tlsBreadcrumbs;
+
+/*** The calling thread's last heartbeat (CLOCK_MONOTONIC, in ns), set by eCrash_RegisterThread.
+ * @see eCrash_Heartbeat */
+extern __thread uint64_t *eCrash_tlsHeartbeat;
+
+/***
+ * \struct eCrashMetricShard
+ * \brief One shard of the counters and histograms
+ *
+ * Every registered thread has its own shard, which only it writes, so recording is a relaxed load and
+ * store.  Other threads share eCrash_sharedMetrics, with atomic adds.  Shards are only summed when a report
+ * is written (and a thread's shard is folded into the shared one when it unregisters).
+ */
+typedef struct
+{
+    uint64_t counters[ECRASH_MAX_COUNTERS];
+    uint64_t histograms[ECRASH_MAX_HISTOGRAMS][ECRASH_HISTOGRAM_BUCKETS];
+} eCrashMetricShard;
+
+/*** The calling thread's shard, set by eCrash_RegisterThread.  @see eCrash_CounterAdd */
+extern __thread eCrashMetricShard *eCrash_tlsMetrics;
+extern eCrashMetricShard eCrash_sharedMetrics;
+
 #define ECRASH_DEBUG_ENABLE  /* undef to turn off debug */
 
 #ifdef ECRASH_DEBUG_ENABLE
@@ -75,6 +296,12 @@ typedef struct
 typedef struct
 {
     /* OUTPUT OPTIONS */
+    /***
+     * Array of outputs, ending in one of type ECRASH_SINK_NONE.  If the first entry is ECRASH_SINK_NONE,
+     * the older filename / filep / fd fields below are used instead, as text outputs.
+     */
+    eCrashSink sinks[ECRASH_MAX_NUM_SINKS];
+
     /*** Filename to output to, or NULL */
     char *filename;
     /*** FILE * to output to or NULL */
@@ -82,23 +309,102 @@ typedef struct
     /*** fd to output to or -1 */
     int fd;
 
+    /***
+     * If true, the report is written once into a memfd created at init, and the kernel copies it to each
+     * output (copy_file_range, splice or sendfile) at every checkpoint.  The memfd survives a partial
+     * dump.  @see eCrash_GetReportFd
+     */
+    bool useMemfd;
+
+    /***
+     * How long (in ms) any single write to an output may take.  Outputs are made non-blocking inside the
+     * crash handler (and written without blocking in live dumps, see eCrash_DumpNow); one that misses this
+     * deadline (or fails sinkMaxFailures times) is dropped, with a note in the report, so a stalled pipe or
+     * a hung file system can't stop the others.
+     */
+    unsigned int sinkTimeoutMs;
+    unsigned int sinkMaxFailures;
+
+    /***
+     * File for the crash record, or NULL for none.  Reports are written in two phases: first a short, fixed
+     * size binary record (signal, fault address, time and the offending thread's raw PCs) is written to this
+     * file, allocated at init, and fdatasync'ed; only then is the full report built.  Whatever happens
+     * during the second phase, the first one is already on disk.  ecrash_decode reads it.
+     */
+    char *crashRecordFile;
+
+    /***
+     * File for crash loop detection, or NULL for none.  It keeps the signatures (a hash of the signal and the
+     * offending stack, as module relative PCs) of the last ECRASH_CRASH_LOOP_SIGNATURES kinds of crash, with
+     * their counts and times.  A crash with the same signature as one less than crashLoopWindow seconds
+     * earlier only gets a one line report ("occurrence 37 in 300 s"): the other threads, symbols and
+     * metrics are skipped, so a crash loop restarts quickly and does not fill the disk.
+     */
+    char *crashLoopFile;
+    unsigned int crashLoopWindow;
+
+    /***
+     * Directory for the black box, or NULL for none.  The black box is a file (ecrash.<pid>.bbx) mapped
+     * shared at init, where threads keep their last published stacks.  It lives in the page cache, so it
+     * outlives a process killed in ways no handler sees (SIGKILL, the OOM killer); ecrash_blackbox reads it
+     * back.  eCrash_Uninit, or a clean exit, removes it; of those left by dead processes, init removes all
+     * but the ECRASH_BLACKBOX_KEEP newest.  @see eCrash_Snapshot, eCrashBlackBox.h
+     */
+    char *blackBoxDir;
+
     int debugLevel;
 
     /*** If true, all registered threads will be dumped */
     bool dumpAllThreads;
 
+    /***
+     * If true, reports get a process resource section: RSS and peak RSS, page faults, open fds (against
+     * their limit), threads, and the mapped files (up to ECRASH_MAX_RESOURCE_MAPS, anonymous mappings
+     * summed), to tell resource exhaustion from a real crash.  The /proc files are opened at init, so an
+     * fd leak doesn't hide them.
+     */
+    bool dumpResources;
+
     /*** How far to backtrace each stack */
     unsigned int maxStackDepth;
 
+    /***
+     * Deep stacks (runaway recursion) are compressed: repeating cycles of frames are printed as a single
+     * line with a repeat count, at every verbosity.  The top stackHeadFrames and bottom stackTailFrames
+     * frames are always printed verbatim; ecrash_decode -f prints every frame of a binary report.
+     */
+    unsigned int stackHeadFrames;
+    unsigned int stackTailFrames;
+
+    /*** Longest frame cycle (in frames) to look for when compressing recursion */
+    unsigned int maxCyclePeriod;
+
     /*** Default signal to use to tell a thread to drop its stack. */
     int defaultBacktraceSignal;
 
-    /*** How long to wait for a threads dump */
+    /*** How long to wait for a threads dump (live dumps wait for all the threads at once, for a tenth of a second) */
     unsigned int threadWaitTime;
 
+    /*** Maximum number of threads that may be registered at once (thread slots are allocated at init) */
+    unsigned int maxThreads;
+
+    /***
+     * Scratch space, in bytes, reserved in the crash arena on top of what eCrash_Init computes for
+     * backtrace buffers and thread slots.  All memory used on the crash path comes from this arena.
+     */
+    size_t crashArenaSize;
+
+    /***
+     * Most bytes of memory captured around a crash, for ECRASH_VERBOSITY_FULL outputs: the code around the
+     * faulting PC, the bytes around the fault address, and the rest from the stack pointer up.  Memory is
+     * read with process_vm_readv, so an unmapped or protected address just reads as unreadable.
+     */
+    unsigned int memorySnapshotSize;
+
     /***
-     * If this is non-zero, the dangerous function, backtrace_symbols will be used. That function does a
-     * malloc(), so is not async signal safe, and could cause deadlocks.
+     * If this is non-zero, frames will be resolved with dladdr() and printed the way backtrace_symbols
+     * would print them.  dladdr() does not malloc(), but does take the dynamic loader's lock, so a crash
+     * inside dlopen() could still deadlock.
      */
     bool useBacktraceSymbols;
 
@@ -118,6 +424,68 @@ typedef struct
      */
     int signals[ECRASH_MAX_NUM_SIGNALS];
 
+    /***
+     * What to do once the report is written.  A chained handler that returns, or was SIG_DFL, is
+     * followed by a re-raise.  The report records how long the dump took since the fault, and the black
+     * box when the handler let go of the process.
+     */
+    eCrashDisposition disposition;
+
+    /***
+     * If non-zero, written to /proc/self/coredump_filter by eCrash_Init (see core(5)), for instance
+     * ECRASH_COREDUMP_FILTER_MINIMAL.  Zero leaves the filter alone.
+     */
+    unsigned int coredumpFilter;
+
+    /***
+     * Live dumps (eCrash_DumpNow) can also be asked for from outside the process: with dumpSignal, by that
+     * signal; with dumpSocket, by a datagram to the abstract unix socket of that name (which may hold a sink
+     * selector, in decimal).  A thread started by eCrash_Init waits for either and runs the dump, with
+     * dumpSinks as the sink selector; the signal handler only wakes it.
+     */
+    int dumpSignal;
+    char *dumpSocket;
+    unsigned int dumpSinks;
+
+    /***
+     * Hang watchdog.  A registered thread that has called eCrash_Heartbeat once is then expected to call it
+     * again within its deadline: the one given to eCrash_SetHeartbeatDeadline, or else that of the first of
+     * heartbeatRoles whose role starts its name (threads with neither are not watched).  A thread started
+     * by eCrash_Init looks every ECRASH_WATCHDOG_INTERVAL_MS, and, once per missed deadline, does hangAction
+     * (a live dump to dumpSinks, which names the hung thread).  With hangAbort, it then sends the hung
+     * thread SIGABRT, so the crash report (and the restart) follows from where it is stuck: SIGABRT must be
+     * in signals for that report to be written (eCrash_Init warns if it isn't).
+     */
+    eCrashHangAction hangAction;
+    eCrashHeartbeatRole heartbeatRoles[ECRASH_MAX_HEARTBEAT_ROLES];
+    bool hangAbort;
+
+    /***
+     * CPU profiler.  With profileHz and profileFile set, each registered thread gets a timer on its own CPU
+     * clock, which sends it profileSignal (default ECRASH_DEFAULT_PROFILE_SIGNAL) profileHz times per second
+     * of CPU it uses.  The handler unwinds the stack and counts it, without locks, in a table of up to
+     * ECRASH_PROFILE_MAX_STACKS stacks.  A thread started by eCrash_Init rewrites profileFile with the counts
+     * since eCrash_Init, as folded stacks (flamegraph.pl's input), every profileFlushSeconds (default
+     * ECRASH_DEFAULT_PROFILE_FLUSH_SECONDS), and eCrash_Uninit does a last time.  Frames are named as in
+     * reports, so a symbolTable or useBacktraceSymbols gives names rather than addresses.
+     */
+    unsigned int profileHz;
+    char *profileFile;
+    unsigned int profileFlushSeconds;
+    int profileSignal;
+
+    /***
+     * Wall clock sampler.  With wallSampleMs and wallProfileFile set, the profiler thread samples every
+     * registered thread every wallSampleMs, running or not: it reads each one's state from /proc (R, S, D,
+     * ...), then signals them all at once with their backtrace signals, and counts the stacks they capture
+     * into their own slots.  wallProfileFile is written out as profileFile is, with each stack rooted at the
+     * thread's role (its name less any trailing number) and state, so it shows where each kind of thread
+     * waits.  A thread that does not answer within a few ms (one in D state, say) is counted with no stack.
+     * Samples are skipped while a live dump runs.
+     */
+    unsigned int wallSampleMs;
+    char *wallProfileFile;
+
 } eCrashParameters;
 
 /***
@@ -136,17 +504,31 @@ int eCrash_Init(eCrashParameters *params);
  * UnInitialize eCrash.
  * 
  * This function may be called to de-activate eCrash, release the signal handlers, and free any
- * memory allocated by eCrash.
+ * memory allocated by eCrash.  Threads still registered are unregistered: afterwards, their calls behave
+ * as in unregistered threads.  No other thread may be in an eCrash call while it runs.
  *
  * @return Zero on success.
  */
 int eCrash_Uninit(void);
 
+/***
+ * Get the fd of the report memfd.
+ *
+ * In memfd mode, the report is assembled in a memfd before being copied to the outputs (one memfd per
+ * format / verbosity in use; this returns the one used by the first output).  It holds everything
+ * written so far, even if the dump was cut short, so a collector can read it back through this fd (or
+ * /proc/<pid>/fd/<fd> from another process).
+ *
+ * @return The memfd, or -1 when useMemfd is not set.
+ */
+int eCrash_GetReportFd(void);
+
 /***
  * Register a thread for backtracing on crash.
  * 
  * This function must be called by any thread wanting it's stack dumped in the event of a crash.
  * The thread my specify what signal should be used, or the default, SIGUSR1 will be used.
+ * At most maxThreads threads may be registered at once.
  *
  * @param name String used to refer to us in crash dumps
  * @param signo Signal to use to generate dump (default: SIGUSR1)
@@ -164,4 +546,233 @@ int eCrash_RegisterThread(char *name, int signo);
  */
 int eCrash_UnregisterThread(void);
 
+/***
+ * Publish the calling thread's stack to the black box.
+ *
+ * Cheap enough to call from a main loop: the stack is unwound into a local buffer and copied into the
+ * thread's record with plain stores; nothing is written to disk.  Threads that crash, or are backtraced
+ * by a crash dump, have their stacks published automatically.
+ *
+ * @return Zero on success, -1 if there is no black box or the thread is not registered.
+ */
+int eCrash_Snapshot(void);
+
+/***
+ * Dump all registered threads now, without a crash.
+ *
+ * Runs the crash report (annotations, every thread's stack, metrics...) into the selected sinks, then
+ * returns.  The process is never stopped: each thread is only interrupted for as long as it takes to unwind
+ * its own stack, though, as with any signal, a sleep it was in (sleep, nanosleep, poll...) may end early.
+ * Sinks are written from the calling thread, under sinkTimeoutMs as in a crash, but fds shared with the
+ * application are left in their mode: pipes and ttys are written through a non-blocking open of their own
+ * made at init (a sink that could not be opened again is left out of live dumps), and sockets with
+ * MSG_DONTWAIT.  Writes to regular files are not timed.  A call made while another dump is running returns
+ * at once: that dump serves it.
+ *
+ * @param sinkSelector Sinks to write to (ECRASH_DUMP_ALL_SINKS for all)
+ *
+ * @return Zero once dumped, 1 if coalesced into a dump already running, -1 if eCrash isn't set up or the
+ *         process is crashing.
+ */
+int eCrash_DumpNow(unsigned int sinkSelector);
+
+/***
+ * Write the CPU and wall clock profiles now.
+ *
+ * Rewrites profileFile and wallProfileFile with the folded stacks counted so far, as the profiler thread
+ * does every profileFlushSeconds.
+ *
+ * @return Zero on success, -1 if neither profiler is running or a file could not be written.
+ */
+int eCrash_ProfileFlush(void);
+
+/***
+ * Set the calling thread's heartbeat deadline.
+ *
+ * Overrides the deadline of its role (see eCrashParameters.heartbeatRoles).  The watchdog starts watching
+ * the thread at its next eCrash_Heartbeat.
+ *
+ * @param deadlineMs Longest the thread may go without a heartbeat, or 0 not to watch it
+ *
+ * @return Zero on success, -1 if the thread is not registered.
+ */
+int eCrash_SetHeartbeatDeadline(unsigned int deadlineMs);
+
+/***
+ * Set a process wide annotation.
+ *
+ * Annotations (build, config generation, ...) are printed in every crash report, and kept in the black box.
+ * Setting a key for the first time takes a lock and one of the ECRASH_MAX_ANNOTATIONS slots, for good; after
+ * that, updates are lock free (values live in place, behind a sequence lock), so they can be made from hot
+ * paths.  Nothing is allocated, then or at crash time.
+ *
+ * @param key   Name of the annotation
+ * @param value Its new value, or NULL to clear it (the key keeps its slot)
+ *
+ * @return Zero on success, -1 if eCrash is not initialized or all the slots are taken.
+ */
+int eCrash_SetAnnotation(const char *key, const char *value);
+
+/***
+ * Set an annotation of the calling thread.
+ *
+ * As eCrash_SetAnnotation, but printed next to the thread's backtrace (request ID, tenant, shard, ...), with
+ * ECRASH_MAX_THREAD_ANNOTATIONS slots per thread.  Only the thread writes its own annotations, so updates
+ * are wait free.
+ *
+ * @return Zero on success, -1 if the thread is not registered or all its slots are taken.
+ */
+int eCrash_SetThreadAnnotation(const char *key, const char *value);
+
+/***
+ * Leave a range of memory out of core dumps.
+ *
+ * For big caches and arenas, which would make a core take minutes to write, and that a post-mortem can do
+ * without.  Only the whole pages inside the range are excluded (MADV_DONTDUMP).  Every excluded range is
+ * listed in the crash report, so a core that is small on purpose is not mistaken for a broken one.
+ *
+ * @param ptr  Start of the range
+ * @param len  Its length, in bytes
+ * @param name What it is, for the report
+ *
+ * @return Zero on success, -1 if madvise failed or all ECRASH_MAX_CORE_EXCLUSIONS are taken.
+ */
+int eCrash_ExcludeFromCore(const void *ptr, size_t len, const char *name);
+
+/***
+ * Put a range excluded with eCrash_ExcludeFromCore back into core dumps (MADV_DODUMP).
+ *
+ * The range need not match an excluded one: whatever part of the excluded ranges it covers is included
+ * again, and dropped from the report's list.
+ *
+ * @return Zero on success, -1 if madvise failed, or the list had no room to split a range.
+ */
+int eCrash_IncludeInCore(const void *ptr, size_t len);
+
+/***
+ * Register a named counter.
+ *
+ * Counters and histograms are summed over all threads when a report is written, and printed in it.
+ * Registering the same name again returns the same id.
+ *
+ * @param name Name to print it under
+ *
+ * @return The counter's id, for eCrash_CounterAdd, or -1 if all ECRASH_MAX_COUNTERS are taken.
+ */
+int eCrash_RegisterCounter(const char *name);
+
+/***
+ * Register a named histogram (of latencies, sizes, ...), with log2 buckets.
+ *
+ * @param name Name to print it under (say what the unit is)
+ *
+ * @return The histogram's id, for eCrash_HistogramRecord, or -1 if all ECRASH_MAX_HISTOGRAMS are taken.
+ */
+int eCrash_RegisterHistogram(const char *name);
+
+/***
+ * Add to a counter.  About as cheap as an increment.
+ *
+ * @param id    From eCrash_RegisterCounter (anything else is ignored)
+ * @param delta Amount to add
+ */
+static inline void eCrash_CounterAdd(int id, uint64_t delta)
+{
+    eCrashMetricShard *shard = eCrash_TlsCurrent() ? eCrash_tlsMetrics : NULL;
+    uint64_t *counter;
+
+    if ((unsigned int)id >= ECRASH_MAX_COUNTERS)
+    {
+        return;
+    }
+
+    if (shard)
+    {
+        counter = &shard->counters[id];
+        __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + delta, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        __atomic_fetch_add(&eCrash_sharedMetrics.counters[id], delta, __ATOMIC_RELAXED);
+    }
+}
+
+/***
+ * Record a value in a histogram.  About as cheap as an increment.
+ *
+ * @param id    From eCrash_RegisterHistogram (anything else is ignored)
+ * @param value Value to record
+ */
+static inline void eCrash_HistogramRecord(int id, uint64_t value)
+{
+    eCrashMetricShard *shard = eCrash_TlsCurrent() ? eCrash_tlsMetrics : NULL;
+    uint64_t *bucket;
+
+    if ((unsigned int)id >= ECRASH_MAX_HISTOGRAMS)
+    {
+        return;
+    }
+
+    bucket = &(shard ? shard : &eCrash_sharedMetrics)->histograms[id][63 - __builtin_clzll(value | 1)];
+    if (shard)
+    {
+        __atomic_store_n(bucket, __atomic_load_n(bucket, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        __atomic_fetch_add(bucket, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/***
+ * Record a breadcrumb in the calling thread's flight recorder.
+ *
+ * The last ECRASH_NUM_BREADCRUMBS breadcrumbs of every registered thread are printed next to its backtrace
+ * (and kept in the black box, when there is one).  Recording takes no lock and makes no system call (the
+ * clock is read through the vDSO), so it can stay in hot paths.  Does nothing in unregistered threads (nor
+ * in threads still registered when eCrash_Uninit ran).
+ *
+ * @param id  What happened (the application's own numbering)
+ * @param arg Anything worth knowing about it
+ */
+static inline void eCrash_Breadcrumb(uint32_t id, uint64_t arg)
+{
+    eCrashBreadcrumbRing *ring = eCrash_tlsBreadcrumbs;
+    eCrashBreadcrumb *crumb;
+    struct timespec ts;
+    uint64_t count;
+
+    if (ring && eCrash_TlsCurrent())
+    {
+        count = ring->count;
+        crumb = &ring->crumbs[count & (ECRASH_NUM_BREADCRUMBS - 1)];
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        crumb->time = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        crumb->id = id;
+        crumb->arg = arg;
+
+        /* Entries are complete before they are counted */
+        __atomic_store_n(&ring->count, count + 1, __ATOMIC_RELEASE);
+    }
+}
+
+/***
+ * Tell the hang watchdog the calling thread is making progress.
+ *
+ * One clock read (through the vDSO) and one relaxed store into the thread's slot: call it from the top of
+ * a main loop, or wherever the thread proves it isn't stuck.  Does nothing in unregistered threads.
+ * @see eCrashParameters.hangAction
+ */
+static inline void eCrash_Heartbeat(void)
+{
+    uint64_t *heartbeat = eCrash_tlsHeartbeat;
+    struct timespec ts;
+
+    if (heartbeat && eCrash_TlsCurrent())
+    {
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        __atomic_store_n(heartbeat, (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec, __ATOMIC_RELAXED);
+    }
+}
+
 #endif /* _E_CRASH_H_ */
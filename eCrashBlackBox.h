@@ -0,0 +1,111 @@
+/***
+ * \file eCrashBlackBox.h
+ *
+ * Layout of the eCrash black box, shared by the library and
+ * ecrash_blackbox.
+ *
+ * The black box is a file mapped MAP_SHARED by eCrash_Init (see
+ * eCrashParameters.blackBoxDir).  Threads publish their state into it
+ * with plain stores while the process runs.  The pages belong to the page
+ * cache, not to the process, so they survive deaths no handler can catch
+ * (SIGKILL, the OOM killer), and can be read back once the process is
+ * gone.
+ *
+ * The file is a header (with the process annotations), then one record
+ * per thread slot, holding the thread's last published stack, its
+ * breadcrumbs and its annotations.  Records are
+ * headerSize + n * threadSize bytes into the file; readers should use
+ * those sizes, not sizeof, so records can grow.  The file is read on the
+ * machine that wrote it, so the structures are stored as they are.
+ *
+ */
+
+#ifndef _ECRASH_BLACKBOX_H_
+#define _ECRASH_BLACKBOX_H_
+
+#include <stdint.h>
+#include "eCrash.h"
+
+#define ECRASH_BLACKBOX_MAGIC 0x58424365    /* "eCBX" */
+#define ECRASH_BLACKBOX_VERSION 2
+#define ECRASH_BLACKBOX_MAX_FRAMES 32
+#define ECRASH_BLACKBOX_NAME_LEN 32
+
+/* Name of the black box of a process, in blackBoxDir */
+#define ECRASH_BLACKBOX_FILE_FORMAT "%s/ecrash.%d.bbx"
+
+/* eCrashBlackBoxHeader.state */
+#define ECRASH_BLACKBOX_RUNNING 1           /* Still running, or killed */
+#define ECRASH_BLACKBOX_CRASHED 2           /* Caught a crash signal (see signo) */
+#define ECRASH_BLACKBOX_EXITED 3            /* eCrash_Uninit was called, or the process exited */
+
+/***
+ * A stack, as last published
+ *
+ * seq is a sequence lock: it is odd while the stack is being written, so
+ * a stack whose seq is odd (or changed while it was read) is torn.
+ */
+typedef struct
+{
+    uint64_t seq;
+    uint64_t time;                          /* CLOCK_REALTIME, in ns */
+    uint32_t numFrames;
+    uint32_t reserved;
+    uint64_t frames[ECRASH_BLACKBOX_MAX_FRAMES];
+} eCrashBlackBoxStack;
+
+/***
+ * An annotation (see eCrash_SetAnnotation)
+ *
+ * inUse is 1 while the slot is claimed and its key written, 2 once the
+ * key is set.  The value is behind a sequence lock, as stacks are; an
+ * empty value was cleared.
+ */
+typedef struct
+{
+    uint64_t seq;
+    uint32_t inUse;
+    uint32_t reserved;
+    char key[ECRASH_ANNOTATION_KEY_LEN];
+    char value[ECRASH_ANNOTATION_VALUE_LEN];
+} eCrashAnnotation;
+
+/***
+ * \struct eCrashBlackBoxHeader
+ * \brief Start of the black box
+ */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t headerSize;
+    uint32_t threadSize;
+    uint32_t numThreads;
+    int32_t pid;
+    uint64_t startTime;                     /* CLOCK_REALTIME, in ns */
+    uint64_t startMonotonic;                /* CLOCK_MONOTONIC at startTime, to date breadcrumbs */
+    uint32_t state;                         /* ECRASH_BLACKBOX_* */
+    int32_t signo;                          /* For ECRASH_BLACKBOX_CRASHED */
+    uint64_t exitTime;                      /* CLOCK_REALTIME, in ns, when the handler let go, or 0 */
+    uint32_t disposition;                   /* ECRASH_DISPOSITION_*, with exitTime */
+    uint32_t reserved;
+    eCrashBlackBoxStack crashStack;         /* Offending thread's, for ECRASH_BLACKBOX_CRASHED */
+    eCrashAnnotation annotations[ECRASH_MAX_ANNOTATIONS];
+} eCrashBlackBoxHeader;
+
+/***
+ * \struct eCrashBlackBoxThread
+ * \brief One registered thread's record
+ */
+typedef struct
+{
+    uint32_t inUse;
+    int32_t tid;
+    uint64_t thread;
+    char name[ECRASH_BLACKBOX_NAME_LEN];
+    eCrashBlackBoxStack stack;              /* From eCrash_Snapshot, or the last dump */
+    eCrashBreadcrumbRing breadcrumbs;       /* See eCrash_Breadcrumb */
+    eCrashAnnotation annotations[ECRASH_MAX_THREAD_ANNOTATIONS];
+} eCrashBlackBoxThread;
+
+#endif /* _ECRASH_BLACKBOX_H_ */
@@ -0,0 +1,174 @@
+/***
+ * \file eCrashRecord.h
+ *
+ * The eCrash binary crash record format, shared by the crash handler
+ * (ECRASH_FORMAT_BINARY outputs) and ecrash_decode.
+ *
+ * A record is a sequence of frames, one per report section.  Every
+ * frame is:
+ *
+ *     u16 type
+ *     u32 payload length
+ *     payload
+ *     u32 CRC-32 of the type, length and payload
+ *
+ * All integers are little endian, strings are a u16 length followed by
+ * the bytes (no terminator), and addresses are always 64 bits wide.  A
+ * record starts with an ECRASH_RECORD_START frame and ends with an
+ * ECRASH_RECORD_END frame; records are simply appended one after the
+ * other.  A record torn by a crash during the dump can still be decoded
+ * up to its last frame with a good CRC.
+ *
+ * A compressed output (eCrashSink.compress) is a sequence of
+ * ECRASH_RECORD_LZ_BLOCK frames instead, whatever its format.  Once
+ * decompressed and joined, the blocks give back exactly what the output
+ * would have been without compression.  Blocks may refer back to the
+ * data of earlier blocks (up to ECRASH_LZ_WINDOW bytes back), so a torn
+ * stream still decompresses up to its last complete block.
+ *
+ * The LZ block payload is a u32 uncompressed length, followed by
+ * sequences of:
+ *
+ *     u8 token           literal count (high nibble), match length - 4 (low nibble)
+ *     u8 extra[]         while the nibble (or extra byte) was 15/255, add the next byte
+ *     literals
+ *     u16 offset         back from the current position (not present in the last sequence)
+ *     u8 extra[]         extra match length bytes, as for literals
+ *
+ * The last sequence holds only literals.
+ *
+ * The crash record file (eCrashParameters.crashRecordFile) holds one
+ * short record, written before anything else when a crash is caught:
+ * START, HEADER, the offending THREAD and its raw FRAMES (at most
+ * ECRASH_CRASH_RECORD_MAX_FRAMES), END.  It is padded with zeros to
+ * ECRASH_CRASH_RECORD_SIZE bytes and replaces the previous crash's.
+ *
+ * A slot log (eCrashSink.slots) is a header of ECRASH_SLOTLOG_HEADER_SIZE
+ * bytes, then a fixed number of fixed size slots, all allocated when the
+ * log is opened.  Each report goes into the slot after the previous
+ * report's, replacing the oldest one.  The header is:
+ *
+ *     u32 magic, u32 version, u32 slots, u32 next slot, u64 slot size
+ *
+ * then, for each slot:
+ *
+ *     u64 sequence number, u64 report length, u32 pid, u32 state (ECRASH_SLOT_*)
+ *
+ * Only the first "report length" bytes of a slot belong to its report.
+ *
+ */
+
+#ifndef _ECRASH_RECORD_H_
+#define _ECRASH_RECORD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ECRASH_RECORD_MAGIC 0x52436365      /* "eCCR" */
+#define ECRASH_RECORD_VERSION 1
+
+/* Bytes of framing around every payload */
+#define ECRASH_RECORD_FRAME_HEADER_LEN 6
+#define ECRASH_RECORD_FRAME_TRAILER_LEN 4
+
+/* Largest payload a decoder should believe */
+#define ECRASH_RECORD_MAX_PAYLOAD (16 * 1024 * 1024)
+
+/***
+ * \enum eCrashRecordType
+ * \brief Frame types, with the layout of their payloads
+ */
+typedef enum
+{
+    ECRASH_RECORD_START = 1,        /* u32 magic, u16 version */
+    ECRASH_RECORD_HEADER = 2,       /* u32 signo, u32 pid, u64 time (seconds since the epoch), u64 fault address,
+                                       u64 signature (0 if none) */
+    ECRASH_RECORD_THREAD = 3,       /* u64 thread, u8 flags (ECRASH_THREAD_*), string name */
+    ECRASH_RECORD_FRAMES = 4,       /* u32 count, u64 pc[count]: the stack of the last THREAD */
+    ECRASH_RECORD_ANNOTATION = 5,   /* string key, string value: of the last THREAD, or the process before any */
+    ECRASH_RECORD_DROPPED = 6,      /* u32 fd, u32 failures, u8 timed out, string name */
+    ECRASH_RECORD_OUTPUTS = 7,      /* u32 count, then for each: u32 fd, u8 dropped, u64 bytes, u64 ns, string name;
+                                       then u64 ns from the fault, u8 disposition (ECRASH_DISPOSITION_*) */
+    ECRASH_RECORD_END = 8,          /* empty */
+    ECRASH_RECORD_LZ_BLOCK = 9,     /* u32 uncompressed length, LZ sequences */
+    ECRASH_RECORD_BREADCRUMBS = 10, /* u32 count, then oldest first: i64 ns before the crash, u32 id, u64 arg */
+    ECRASH_RECORD_COUNTER = 11,     /* string name, u64 value */
+    ECRASH_RECORD_HISTOGRAM = 12,   /* string name, u32 count, then for each non empty bucket: u8 bucket, u64 n */
+    ECRASH_RECORD_CORE = 13,        /* u32 coredump filter (0 if not set), u32 count, then for each range
+                                       excluded from the core: u64 start, u64 length, string name */
+    ECRASH_RECORD_REPEAT = 14,      /* u32 occurrence, u32 seconds since the first: a crash loop's abbreviated
+                                       record, in place of the threads and metrics */
+    ECRASH_RECORD_MEMORY = 15,      /* string name, u64 address, u32 length, bytes: memory of the last THREAD
+                                       (length 0 if unreadable) */
+    ECRASH_RECORD_SCHED = 16,       /* u8 state, u8 spinning, u32 cpu, u64 user ms, u64 system ms,
+                                       u64 voluntary switches, u64 involuntary switches: of the last THREAD */
+    ECRASH_RECORD_RESOURCES = 17,   /* u64 RSS KB, u64 peak RSS KB, u64 virtual KB, u64 major faults,
+                                       u64 minor faults, u32 fds, u64 fd limit (0 if none), u32 threads,
+                                       u32 mappings, u32 anonymous mappings, u64 anonymous KB, u32 files
+                                       omitted, u32 count, then for each mapped file: u64 start, u64 end,
+                                       string path */
+    ECRASH_RECORD_HANG = 18         /* u64 thread, u32 ms since its last heartbeat, u32 deadline ms, string name:
+                                       the thread the watchdog caught */
+} eCrashRecordType;
+
+/* LZ parameters */
+#define ECRASH_LZ_WINDOW (64 * 1024)       /* Furthest a match may reach back */
+#define ECRASH_LZ_BLOCK_SIZE (64 * 1024)   /* Most uncompressed bytes in one block */
+#define ECRASH_LZ_MIN_MATCH 4
+
+/* Worst case size of a compressed block */
+#define ECRASH_LZ_BOUND(len) ((len) + (len) / 255 + 16)
+
+/* The crash record file */
+#define ECRASH_CRASH_RECORD_SIZE 512
+#define ECRASH_CRASH_RECORD_MAX_FRAMES 32
+
+/* Slot logs */
+#define ECRASH_SLOTLOG_MAGIC 0x4c534365     /* "eCSL" */
+#define ECRASH_SLOTLOG_VERSION 1
+#define ECRASH_SLOTLOG_HEADER_SIZE 4096
+#define ECRASH_SLOTLOG_ENTRIES 24           /* Offset of the first slot entry */
+#define ECRASH_SLOTLOG_ENTRY_SIZE 24
+#define ECRASH_SLOTLOG_MAX_SLOTS 128
+
+#define ECRASH_SLOT_EMPTY 0
+#define ECRASH_SLOT_WRITING 1               /* The process died while writing it */
+#define ECRASH_SLOT_COMPLETE 2
+#define ECRASH_SLOT_TRUNCATED 3             /* Complete, but cut to the slot size */
+
+/* ECRASH_RECORD_THREAD flags */
+#define ECRASH_THREAD_OFFENDING 0x01
+#define ECRASH_THREAD_CAPTURED  0x02
+
+/***
+ * Update a CRC-32 (IEEE 802.3) with some bytes
+ *
+ * Bitwise rather than table driven: it needs no table to be built or
+ * stored, so it is safe to use from the crash handler, and the records
+ * are small.
+ *
+ * @param crc  CRC so far (start with 0)
+ * @param data Bytes to add
+ * @param len  Number of bytes
+ *
+ * @returns the updated CRC
+ */
+static inline uint32_t eCrashRecord_Crc32(uint32_t crc, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    int bit;
+
+    crc = ~crc;
+    while (len--)
+    {
+        crc ^= *p++;
+        for (bit = 0 ; bit < 8 ; bit++)
+        {
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+        }
+    }
+
+    return ~crc;
+}
+
+#endif /* _ECRASH_RECORD_H_ */
@@ -0,0 +1,490 @@
+/***
+ * \file ecrash_bench.c
+ *
+ * Measure how long eCrash takes to dump a crash, and how big the dump
+ * is, with and without compression.
+ *
+ * Each run forks a child which starts some threads, recurses a while in
+ * every one of them, and crashes.  The time is taken from just before
+ * the crash to the child's exit, so it covers the whole dump.
+ *
+ * With --profile, it measures the CPU profiler's overhead instead: the
+ * children run the same CPU bound work in every thread, with and
+ * without the profiler, and the best times are compared.  --wall does
+ * the same for the wall clock sampler.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "eCrash.h"
+
+#define OUTPUT_FILE "ecrash_bench.out"
+#define PROFILE_FILE "ecrash_bench.folded"
+#define WALL_PROFILE_FILE "ecrash_bench.wall.folded"
+
+/* Options */
+static int numRuns = 20;
+static int numThreads = 8;
+static int recursionDepth = 50;
+static int stackDepth = 100;
+static eCrashFormat format = ECRASH_FORMAT_TEXT;
+static int profileHz = 0;
+static int wallSampleMs = 0;
+static long workMillions = 100;
+
+static pthread_barrier_t ready;
+
+static long long cpuNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long long nowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/***
+ * Wait for everybody, then park (or crash, for the main thread)
+ */
+static void park(int crash)
+{
+    volatile int *bad = NULL;
+
+    pthread_barrier_wait(&ready);
+    if (crash)
+    {
+        *bad = 1;
+    }
+    for ( ; ; )
+    {
+        pause();
+    }
+}
+
+/***
+ * Recurse a while before parking, to give the dump some frames
+ */
+static int recurse(int depth, int crash)
+{
+    if (depth > 0)
+    {
+        return recurse(depth - 1, crash) + 1;
+    }
+
+    park(crash);
+    return 0;
+}
+
+static void *benchThread(void *arg)
+{
+    char name[32];
+
+    snprintf(name, sizeof(name), "Bench %ld", (long)arg);
+    eCrash_RegisterThread(name, 0);
+    recurse(recursionDepth, 0);
+
+    return NULL;
+}
+
+/***
+ * CPU bound work, some frames down
+ */
+static unsigned long burn(int depth, long iterations)
+{
+    volatile unsigned long sum = 0;
+    long i;
+
+    if (depth > 0)
+    {
+        return burn(depth - 1, iterations) + 1;
+    }
+
+    for (i = 0 ; i < iterations ; i++)
+    {
+        sum += i ^ (sum >> 3);
+    }
+
+    return sum;
+}
+
+static void *profileThread(void *arg)
+{
+    char name[32];
+
+    snprintf(name, sizeof(name), "Bench %ld", (long)arg);
+    eCrash_RegisterThread(name, 0);
+    pthread_barrier_wait(&ready);
+    burn(recursionDepth, workMillions * 1000000);
+    eCrash_UnregisterThread();
+
+    return NULL;
+}
+
+/***
+ * The profiled child: runs the work in every thread, and sends back the
+ * CPU time it took (ours included: the handlers and the profiler thread)
+ *
+ * @param hz     Sampling rate, or 0 not to profile
+ * @param wallMs Wall clock sampling interval, or 0 not to sample
+ * @param timing Pipe to send the time down
+ */
+static void profileChild(int hz, int wallMs, int timing)
+{
+    eCrashParameters params;
+    pthread_t threads[numThreads];
+    long long elapsed;
+    long i;
+
+    memset(&params, 0, sizeof(params));
+    params.maxStackDepth = stackDepth;
+    params.maxThreads = numThreads;
+    params.useBacktraceSymbols = true;
+    params.profileHz = hz;
+    params.profileFile = PROFILE_FILE;
+    params.profileFlushSeconds = 1;
+    params.wallSampleMs = wallMs;
+    params.wallProfileFile = WALL_PROFILE_FILE;
+
+    if (eCrash_Init(&params) != 0)
+    {
+        _exit(1);
+    }
+
+    pthread_barrier_init(&ready, NULL, numThreads + 1);
+    for (i = 0 ; i < numThreads ; i++)
+    {
+        pthread_create(&threads[i], NULL, profileThread, (void *)(i + 1));
+    }
+
+    pthread_barrier_wait(&ready);
+    elapsed = cpuNs();
+    for (i = 0 ; i < numThreads ; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    elapsed = cpuNs() - elapsed;
+
+    eCrash_Uninit();
+    write(timing, &elapsed, sizeof(elapsed));
+    _exit(0);
+}
+
+/***
+ * Count the samples in a folded profile
+ */
+static long long profileSamples(const char *file)
+{
+    char line[4096];
+    long long samples = 0;
+    char *count;
+    FILE *f;
+
+    f = fopen(file, "r");
+    if (f == NULL)
+    {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f))
+    {
+        count = strrchr(line, ' ');
+        samples += count ? atoll(count + 1) : 0;
+    }
+    fclose(f);
+
+    return samples;
+}
+
+/***
+ * Time the work, with and without the profiler (or the wall clock
+ * sampler), runs alternating
+ */
+static void benchProfile(void)
+{
+    const char *file = wallSampleMs ? WALL_PROFILE_FILE : PROFILE_FILE;
+    long long best[2] = { 0, 0 };
+    long long samples = 0;
+    int run;
+    int on;
+
+    for (run = 0 ; run < numRuns * 2 ; run++)
+    {
+        long long elapsed = 0;
+        int timing[2];
+        int status;
+        pid_t pid;
+
+        on = run & 1;
+        unlink(file);
+        if (pipe(timing) != 0)
+        {
+            perror("pipe");
+            exit(1);
+        }
+
+        fflush(stdout);
+        pid = fork();
+        if (pid == 0)
+        {
+            freopen("/dev/null", "w", stdout);
+            close(timing[0]);
+            profileChild(on ? profileHz : 0, on ? wallSampleMs : 0, timing[1]);
+        }
+        close(timing[1]);
+
+        if (read(timing[0], &elapsed, sizeof(elapsed)) != sizeof(elapsed))
+        {
+            elapsed = 0;
+        }
+        waitpid(pid, &status, 0);
+        close(timing[0]);
+
+        if (elapsed == 0)
+        {
+            printf("Run %d failed\n", run);
+            continue;
+        }
+
+        if (best[on] == 0 || elapsed < best[on])
+        {
+            best[on] = elapsed;
+        }
+        if (on)
+        {
+            samples += profileSamples(file);
+        }
+    }
+    unlink(file);
+
+    printf("%-12s %10.3f\n", "off", best[0] / 1e6);
+    printf("%-12s %10.3f %10lld\n", "on", best[1] / 1e6, samples / numRuns);
+    if (best[0] && best[1])
+    {
+        printf("overhead     %9.2f%%\n", (best[1] - best[0]) * 100.0 / best[0]);
+    }
+    if (wallSampleMs && best[0] && best[1] && samples)
+    {
+        /* A sample is one of every thread, taken together */
+        printf("per sample   %9.3f us\n", (best[1] - best[0]) / 1e3 / (samples / numRuns / numThreads));
+    }
+}
+
+/***
+ * The crashing child
+ *
+ * @param compress True to compress the output
+ * @param timing   Pipe to send the crash time down
+ */
+static void crashChild(bool compress, int timing)
+{
+    eCrashParameters params;
+    pthread_t thread;
+    long long start;
+    long i;
+
+    memset(&params, 0, sizeof(params));
+    params.sinks[0].type = ECRASH_SINK_FILENAME;
+    params.sinks[0].filename = OUTPUT_FILE;
+    params.sinks[0].format = format;
+    params.sinks[0].compress = compress;
+    params.dumpAllThreads = true;
+    params.maxStackDepth = stackDepth;
+    params.maxThreads = numThreads + 1;
+    params.signals[0] = SIGSEGV;
+
+    if (eCrash_Init(&params) != 0)
+    {
+        _exit(1);
+    }
+
+    pthread_barrier_init(&ready, NULL, numThreads + 1);
+    for (i = 0 ; i < numThreads ; i++)
+    {
+        pthread_create(&thread, NULL, benchThread, (void *)(i + 1));
+    }
+
+    /* Let everybody get into position, then go */
+    start = nowNs();
+    write(timing, &start, sizeof(start));
+    recurse(recursionDepth, 1);
+}
+
+/***
+ * Time a number of crashes
+ *
+ * @param compress True to compress the output
+ */
+static void bench(bool compress)
+{
+    long long total = 0;
+    long long best = 0;
+    long long bytes = 0;
+    int run;
+
+    for (run = 0 ; run < numRuns ; run++)
+    {
+        struct stat st;
+        long long start = 0;
+        int timing[2];
+        int status;
+        pid_t pid;
+
+        unlink(OUTPUT_FILE);
+        if (pipe(timing) != 0)
+        {
+            perror("pipe");
+            exit(1);
+        }
+
+        fflush(stdout);
+        pid = fork();
+        if (pid == 0)
+        {
+            /* Keep eCrash's own chatter out of the table */
+            freopen("/dev/null", "w", stdout);
+            close(timing[0]);
+            crashChild(compress, timing[1]);
+            _exit(1);
+        }
+        close(timing[1]);
+
+        if (read(timing[0], &start, sizeof(start)) != sizeof(start))
+        {
+            start = 0;
+        }
+        waitpid(pid, &status, 0);
+        close(timing[0]);
+
+        if (start == 0 || stat(OUTPUT_FILE, &st) != 0)
+        {
+            printf("Run %d failed\n", run);
+            continue;
+        }
+
+        start = nowNs() - start;
+        total += start;
+        if (best == 0 || start < best)
+        {
+            best = start;
+        }
+        bytes += st.st_size;
+    }
+
+    printf("%-12s %10.3f %10.3f %10lld\n", compress ? "compressed" : "plain", total / 1e6 / numRuns, best / 1e6,
+           bytes / numRuns);
+}
+
+#define USAGE "USAGE: %s [options]\n\
+   Where options are one or more of:\n\
+      -n,--runs <num>                  Crashes per mode (20 default)\n\
+      -t,--threads <num>               Threads to dump (8 default)\n\
+      -r,--recursion_depth <num>       Recursion in every thread (50 default)\n\
+      -d,--stack_depth <num>           Maximum backtrace depth (100 default)\n\
+      -f,--format <text|json|binary>   Report format (text default)\n\
+      -p,--profile <hz>                Measure the CPU profiler at <hz> instead\n\
+      -W,--wall <ms>                   Measure the wall clock sampler, sampling\n\
+                                       every <ms>, instead\n\
+      -w,--work <millions>             Loop iterations per thread, for --profile\n\
+                                       and --wall (100 default)\n\
+      -h,-?,--help                     This message\n\n"
+
+int main(int argc, char *argv[])
+{
+    static struct option long_options[] = {
+        {"runs",            required_argument, 0, 'n'},
+        {"threads",         required_argument, 0, 't'},
+        {"recursion_depth", required_argument, 0, 'r'},
+        {"stack_depth",     required_argument, 0, 'd'},
+        {"format",          required_argument, 0, 'f'},
+        {"profile",         required_argument, 0, 'p'},
+        {"wall",            required_argument, 0, 'W'},
+        {"work",            required_argument, 0, 'w'},
+        {"help",            no_argument,       0, 'h'},
+        {0,                 0,                 0, 0},
+    };
+    int c;
+
+    while ((c = getopt_long(argc, argv, "n:t:r:d:f:p:W:w:h?", long_options, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'n':
+            numRuns = atol(optarg);
+            break;
+        case 't':
+            numThreads = atol(optarg);
+            break;
+        case 'r':
+            recursionDepth = atol(optarg);
+            break;
+        case 'd':
+            stackDepth = atol(optarg);
+            break;
+        case 'f':
+            format = !strcmp(optarg, "json") ? ECRASH_FORMAT_JSON :
+                     !strcmp(optarg, "binary") ? ECRASH_FORMAT_BINARY : ECRASH_FORMAT_TEXT;
+            break;
+        case 'p':
+            profileHz = atol(optarg);
+            break;
+        case 'W':
+            wallSampleMs = atol(optarg);
+            break;
+        case 'w':
+            workMillions = atol(optarg);
+            break;
+        default:
+            printf(USAGE, argv[0]);
+            return 1;
+        }
+    }
+
+    if (numRuns < 1)
+    {
+        numRuns = 1;
+    }
+
+    if (wallSampleMs)
+    {
+        profileHz = 0;
+        printf("%d runs of %d threads, %ldM iterations each, sampled every %d ms\n", numRuns, numThreads,
+               workMillions, wallSampleMs);
+        printf("%-12s %10s %10s\n", "sampler", "CPU ms", "samples");
+        benchProfile();
+        return 0;
+    }
+
+    if (profileHz)
+    {
+        printf("%d runs of %d threads, %ldM iterations each, profiled at %d Hz\n", numRuns, numThreads,
+               workMillions, profileHz);
+        printf("%-12s %10s %10s\n", "profiler", "CPU ms", "samples");
+        benchProfile();
+        return 0;
+    }
+
+    printf("%d crashes of %d threads, %d deep\n", numRuns, numThreads + 1, recursionDepth);
+    printf("%-12s %10s %10s %10s\n", "mode", "avg ms", "best ms", "bytes");
+    bench(false);
+    bench(true);
+    unlink(OUTPUT_FILE);
+
+    return 0;
+}
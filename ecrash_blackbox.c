@@ -0,0 +1,316 @@
+/***
+ * \file ecrash_blackbox.c
+ *
+ * Render the black box (see eCrashBlackBox.h) a process left behind.
+ *
+ * This is for the deaths the crash handler never sees: a process killed
+ * with SIGKILL, or by the OOM killer, leaves no report, but its black box
+ * still holds its annotations, and the last stack and breadcrumbs of
+ * every registered thread.  It works
+ * on a live process too.
+ *
+ * Addresses are printed raw; feed them to addr2line with the binary.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include "eCrash.h"
+#include "eCrashBlackBox.h"
+
+/* Options */
+static const char *blackBoxDir = ".";
+
+/***
+ * Print a CLOCK_REALTIME time, in ns
+ */
+static void printTime(uint64_t ns)
+{
+    time_t seconds = ns / 1000000000ULL;
+    struct tm tm;
+    char text[32];
+
+    localtime_r(&seconds, &tm);
+    strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", &tm);
+    printf("%s.%03u", text, (unsigned)(ns % 1000000000ULL / 1000000));
+}
+
+/***
+ * Print a published stack
+ *
+ * A stack with an odd sequence number was being written when the
+ * process died (or when the file was read).
+ *
+ * @returns zero, or -1 if the stack was torn
+ */
+static int printStack(const char *what, const eCrashBlackBoxStack *stack)
+{
+    unsigned int i;
+
+    if (stack->seq == 0)
+    {
+        printf("   %s: none published\n", what);
+        return 0;
+    }
+
+    printf("   %s: ", what);
+    printTime(stack->time);
+    printf(", %u frames", stack->numFrames);
+    if (stack->seq & 1)
+    {
+        printf(" (torn)\n");
+        return -1;
+    }
+    printf("\n");
+
+    for (i = 0 ; i < stack->numFrames && i < ECRASH_BLACKBOX_MAX_FRAMES ; i++)
+    {
+        printf("      #%-2u 0x%016llx\n", i, (unsigned long long)stack->frames[i]);
+    }
+
+    return 0;
+}
+
+/***
+ * Print a thread's breadcrumbs, oldest first, dated from the black box's
+ * clocks
+ */
+static void printBreadcrumbs(const eCrashBlackBoxHeader *header, const eCrashBreadcrumbRing *ring)
+{
+    const eCrashBreadcrumb *crumb;
+    uint64_t first;
+    uint64_t n;
+
+    if (ring->count == 0)
+    {
+        return;
+    }
+
+    first = ring->count > ECRASH_NUM_BREADCRUMBS ? ring->count - ECRASH_NUM_BREADCRUMBS : 0;
+    printf("   Breadcrumbs (%llu recorded):\n", (unsigned long long)ring->count);
+    for (n = first ; n < ring->count ; n++)
+    {
+        crumb = &ring->crumbs[n % ECRASH_NUM_BREADCRUMBS];
+        printf("      ");
+        printTime(header->startTime + (crumb->time - header->startMonotonic));
+        printf(": id %u, arg 0x%llx\n", crumb->id, (unsigned long long)crumb->arg);
+    }
+}
+
+/***
+ * Print the set annotations of a table
+ */
+static void printAnnotations(const char *indent, const eCrashAnnotation *annotations, int size)
+{
+    bool any = false;
+    int i;
+
+    for (i = 0 ; i < size ; i++)
+    {
+        if (annotations[i].inUse != 2 || annotations[i].value[0] == '\0')
+        {
+            continue;
+        }
+        if (!any)
+        {
+            printf("%sAnnotations:\n", indent);
+            any = true;
+        }
+        printf("%s   %.*s: %.*s%s\n", indent, ECRASH_ANNOTATION_KEY_LEN, annotations[i].key,
+               ECRASH_ANNOTATION_VALUE_LEN, annotations[i].value, (annotations[i].seq & 1) ? " (torn)" : "");
+    }
+}
+
+/***
+ * Render one black box
+ *
+ * @returns zero, 1 if it could not be read, or 2 if anything in it was torn
+ */
+static int render(const char *name, const unsigned char *data, size_t len)
+{
+    const eCrashBlackBoxHeader *header = (const eCrashBlackBoxHeader *)data;
+    const eCrashBlackBoxThread *thread;
+    unsigned int threads = 0;
+    unsigned int i;
+    int rc = 0;
+
+    if (len < sizeof(*header) || header->magic != ECRASH_BLACKBOX_MAGIC)
+    {
+        fprintf(stderr, "%s: not an eCrash black box\n", name);
+        return 1;
+    }
+    if (header->version != ECRASH_BLACKBOX_VERSION || header->headerSize < sizeof(*header) ||
+        header->threadSize < sizeof(*thread) ||
+        len < header->headerSize + (size_t)header->threadSize * header->numThreads)
+    {
+        fprintf(stderr, "%s: unsupported or truncated black box (version %u)\n", name, header->version);
+        return 1;
+    }
+
+    printf("=== %s: pid %d, started ", name, header->pid);
+    printTime(header->startTime);
+    printf("\n");
+
+    printAnnotations("", header->annotations, ECRASH_MAX_ANNOTATIONS);
+
+    switch (header->state)
+    {
+    case ECRASH_BLACKBOX_CRASHED:
+        printf("State: crashed on signal %d (%s)\n", header->signo, strsignal(header->signo));
+        if (printStack("Crashing thread", &header->crashStack) != 0)
+        {
+            rc = 2;
+        }
+        if (header->exitTime && header->crashStack.time)
+        {
+            long long ns = (long long)(header->exitTime - header->crashStack.time);
+
+            printf("   Let go %lld.%03lld ms after the fault (%s)\n", ns / 1000000, (ns / 1000) % 1000,
+                   eCrash_DispositionName(header->disposition));
+        }
+        else
+        {
+            printf("   The handler never let go (it died or hung writing the report)\n");
+        }
+        break;
+    case ECRASH_BLACKBOX_EXITED:
+        printf("State: exited\n");
+        break;
+    case ECRASH_BLACKBOX_RUNNING:
+        if (kill(header->pid, 0) != 0 && errno == ESRCH)
+        {
+            printf("State: killed (died without reaching the crash handler)\n");
+        }
+        else
+        {
+            printf("State: running\n");
+        }
+        break;
+    default:
+        printf("State: unknown (%u)\n", header->state);
+        break;
+    }
+
+    for (i = 0 ; i < header->numThreads ; i++)
+    {
+        thread = (const eCrashBlackBoxThread *)(data + header->headerSize + (size_t)header->threadSize * i);
+        if (!thread->inUse)
+        {
+            continue;
+        }
+
+        threads++;
+        printf("Thread \"%.*s\" (0x%llx), tid %d\n", ECRASH_BLACKBOX_NAME_LEN, thread->name,
+               (unsigned long long)thread->thread, thread->tid);
+        if (printStack("Last stack", &thread->stack) != 0)
+        {
+            rc = 2;
+        }
+        printBreadcrumbs(header, &thread->breadcrumbs);
+        printAnnotations("   ", thread->annotations, ECRASH_MAX_THREAD_ANNOTATIONS);
+    }
+    printf("%u registered threads\n", threads);
+
+    return rc;
+}
+
+#define USAGE "USAGE: %s [options] <pid|file>...\n\
+   Render the black box of each process (ecrash.<pid>.bbx in the\n\
+   black box directory), or of each black box file.\n\
+   Where options are one or more of:\n\
+      -d,--dir <directory>             Black box directory (default .)\n\
+      -h,-?,--help                     This message\n\n"
+
+int main(int argc, char *argv[])
+{
+    static struct option long_options[] = {
+        {"dir",  required_argument, 0, 'd'},
+        {"help", no_argument,       0, 'h'},
+        {0,      0,                 0, 0},
+    };
+    int rc = 0;
+    int c;
+    int i;
+
+    while ((c = getopt_long(argc, argv, "d:h?", long_options, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'd':
+            blackBoxDir = optarg;
+            break;
+        default:
+            printf(USAGE, argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind >= argc)
+    {
+        printf(USAGE, argv[0]);
+        return 1;
+    }
+
+    for (i = optind ; i < argc ; i++)
+    {
+        char path[4096];
+        unsigned char *data = NULL;
+        size_t len = 0;
+        size_t size = 0;
+        size_t got;
+        char *end;
+        FILE *f;
+        int ret;
+
+        /* A bare number is a pid */
+        strtol(argv[i], &end, 10);
+        if (*argv[i] != '\0' && *end == '\0')
+        {
+            snprintf(path, sizeof(path), ECRASH_BLACKBOX_FILE_FORMAT, blackBoxDir, atoi(argv[i]));
+        }
+        else
+        {
+            snprintf(path, sizeof(path), "%s", argv[i]);
+        }
+
+        f = fopen(path, "rb");
+        if (f == NULL)
+        {
+            perror(path);
+            rc = 1;
+            continue;
+        }
+
+        do
+        {
+            if (len == size)
+            {
+                size = size ? size * 2 : 65536;
+                data = realloc(data, size);
+                if (data == NULL)
+                {
+                    perror("realloc");
+                    return 1;
+                }
+            }
+            got = fread(data + len, 1, size - len, f);
+            len += got;
+        } while (got > 0);
+        fclose(f);
+
+        ret = render(path, data, len);
+        if (ret > rc)
+        {
+            rc = ret;
+        }
+        free(data);
+    }
+
+    return rc;
+}
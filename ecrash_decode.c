@@ -0,0 +1,1059 @@
+/***
+ * \file ecrash_decode.c
+ *
+ * Decode eCrash binary crash records (ECRASH_FORMAT_BINARY) back into
+ * the text report, and decompress compressed outputs.
+ *
+ * Every frame of a record carries its own CRC, so a record cut short by
+ * a dying process (or a full flash partition) is decoded up to its last
+ * good frame, and the tear is reported.
+ *
+ * A crash record file (eCrashParameters.crashRecordFile) is a single
+ * record followed by zeros, and decodes like any other.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <signal.h>
+#include "eCrash.h"
+#include "eCrashRecord.h"
+
+#define BANNER "*********************************************************\n" \
+               "*               eCrash Crash Handler\n"                        \
+               "*********************************************************\n"
+
+/* Options */
+static int fullReport = 0;
+
+/***
+ * A cursor over a frame's payload
+ */
+typedef struct
+{
+    const unsigned char *data;
+    size_t len;
+    size_t pos;
+    int bad;
+} Cursor;
+
+static unsigned long long getLE(Cursor *c, int bytes)
+{
+    unsigned long long value = 0;
+    int i;
+
+    if (c->pos + bytes > c->len)
+    {
+        c->bad = 1;
+        return 0;
+    }
+    for (i = 0 ; i < bytes ; i++)
+    {
+        value |= (unsigned long long)c->data[c->pos + i] << (8 * i);
+    }
+    c->pos += bytes;
+
+    return value;
+}
+
+/***
+ * Get a length prefixed string
+ *
+ * @param c   Cursor to read from
+ * @param out Buffer for the (terminated) string
+ * @param max Size of out
+ */
+static void getStr(Cursor *c, char *out, size_t max)
+{
+    size_t len = getLE(c, 2);
+    size_t copy = (len >= max) ? max - 1 : len;
+
+    if (c->bad || c->pos + len > c->len)
+    {
+        c->bad = 1;
+        out[0] = '\0';
+        return;
+    }
+    memcpy(out, &c->data[c->pos], copy);
+    out[copy] = '\0';
+    c->pos += len;
+}
+
+/***
+ * Look for a repeating cycle of frames, the way the crash handler does
+ *
+ * @param pcs     Frame addresses
+ * @param start   First frame of the candidate cycle
+ * @param end     One past the last frame we may consume
+ * @param repeats Set to the number of times the cycle repeats
+ *
+ * @returns the cycle period in frames, or zero if there is no cycle
+ */
+static int findFrameCycle(const unsigned long long *pcs, int start, int end, int *repeats)
+{
+    int period;
+    int bestPeriod = 0;
+    int bestRepeats = 0;
+
+    for (period = 1 ; period <= ECRASH_DEFAULT_MAX_CYCLE_PERIOD ; period++)
+    {
+        int matched = 0;
+        int count;
+
+        if (start + period * ECRASH_MIN_CYCLE_REPEATS > end)
+        {
+            break;
+        }
+
+        while (start + period + matched < end && pcs[start + matched] == pcs[start + period + matched])
+        {
+            matched++;
+        }
+
+        count = 1 + matched / period;
+        if (count >= ECRASH_MIN_CYCLE_REPEATS && count * period > bestRepeats * bestPeriod)
+        {
+            bestPeriod = period;
+            bestRepeats = count;
+        }
+    }
+
+    *repeats = bestRepeats;
+    return bestPeriod;
+}
+
+/***
+ * Print a stack, collapsing cycles like the text output does
+ *
+ * @param pcs   Frame addresses
+ * @param count Number of frames
+ */
+static void printFrames(const unsigned long long *pcs, int count)
+{
+    int headEnd = ECRASH_DEFAULT_STACK_HEAD_FRAMES;
+    int tailStart = count - ECRASH_DEFAULT_STACK_TAIL_FRAMES;
+    int i;
+    int j;
+
+    if (tailStart < headEnd)
+    {
+        tailStart = headEnd;
+    }
+
+    for (i = 0 ; i < count ; )
+    {
+        int repeats = 0;
+        int period = 0;
+
+        if (!fullReport && i >= headEnd && i < tailStart)
+        {
+            period = findFrameCycle(pcs, i, tailStart, &repeats);
+        }
+
+        if (period == 0)
+        {
+            printf("*      Frame %02d: 0x%llx\n", i, pcs[i]);
+            i++;
+            continue;
+        }
+
+        printf("*      Frames %02d-%02d: cycle of %d frame%s (", i, i + period * repeats - 1, period,
+               period == 1 ? "" : "s");
+        for (j = 0 ; j < period ; j++)
+        {
+            printf("%s0x%llx", j ? ", " : "", pcs[i + j]);
+        }
+        printf(") x%d\n", repeats);
+
+        i += period * repeats;
+    }
+}
+
+/* What printFrame is in the middle of */
+typedef enum
+{
+    SECTION_NONE = 0,
+    SECTION_THREAD,
+    SECTION_THREAD_ANNOTATIONS,
+    SECTION_ANNOTATIONS,        /* Process wide */
+    SECTION_COUNTERS,
+    SECTION_HISTOGRAMS
+} Section;
+
+/***
+ * End (exclusive) of a histogram bucket, as eCrash.c
+ */
+static unsigned long long histogramBucketEnd(int b)
+{
+    return b >= 63 ? ~0ULL : 2ULL << b;
+}
+
+/***
+ * Find a percentile of a histogram, as eCrash.c
+ */
+static unsigned long long histogramPercentile(const unsigned long long *buckets, unsigned long long samples,
+                                              int percent)
+{
+    unsigned long long seen = 0;
+    int b;
+
+    for (b = 0 ; b < ECRASH_HISTOGRAM_BUCKETS - 1 ; b++)
+    {
+        seen += buckets[b];
+        if (seen * 100 >= samples * percent)
+        {
+            break;
+        }
+    }
+
+    return histogramBucketEnd(b);
+}
+
+/***
+ * Print one frame of a record
+ *
+ * @param type    Frame type
+ * @param c       Cursor over its payload
+ * @param section Open section, if any (updated)
+ *
+ * @returns zero, or -1 if the payload does not parse
+ */
+static int printFrame(int type, Cursor *c, Section *section)
+{
+    char name[256];
+    unsigned long long *pcs;
+    unsigned long long thread;
+    int signo;
+    int flags;
+    int count;
+    int i;
+
+    /* A thread's section runs until the next frame that isn't about the thread */
+    if ((*section == SECTION_THREAD || *section == SECTION_THREAD_ANNOTATIONS) && type != ECRASH_RECORD_FRAMES &&
+        type != ECRASH_RECORD_BREADCRUMBS && type != ECRASH_RECORD_ANNOTATION && type != ECRASH_RECORD_MEMORY &&
+        type != ECRASH_RECORD_SCHED)
+    {
+        printf("*\n");
+        *section = SECTION_NONE;
+    }
+    else if (*section == SECTION_ANNOTATIONS && type != ECRASH_RECORD_ANNOTATION)
+    {
+        printf("*\n");
+        *section = SECTION_NONE;
+    }
+    else if ((*section == SECTION_COUNTERS || *section == SECTION_HISTOGRAMS) && type != ECRASH_RECORD_COUNTER &&
+             type != ECRASH_RECORD_HISTOGRAM)
+    {
+        printf("*\n");
+        *section = SECTION_NONE;
+    }
+
+    switch (type)
+    {
+    case ECRASH_RECORD_START:
+        if (getLE(c, 4) != ECRASH_RECORD_MAGIC)
+        {
+            return -1;
+        }
+        if (getLE(c, 2) != ECRASH_RECORD_VERSION)
+        {
+            fprintf(stderr, "Unsupported record version\n");
+            return -1;
+        }
+        printf(BANNER "*\n");
+        break;
+    case ECRASH_RECORD_HEADER:
+        signo = getLE(c, 4);
+        if (signo)
+        {
+            printf("*  Got a crash! signo=%d\n", signo);
+        }
+        else
+        {
+            printf("*  Live dump: no crash, the process keeps running\n");
+        }
+        /* pid and time, then the fault address and signature (missing from older records) */
+        getLE(c, 4);
+        getLE(c, 8);
+        if (c->len - c->pos >= 8)
+        {
+            unsigned long long address = getLE(c, 8);
+
+            if (signo == SIGSEGV || signo == SIGBUS || signo == SIGILL || signo == SIGFPE)
+            {
+                printf("*  Fault address: 0x%llx\n", address);
+            }
+        }
+        if (c->len - c->pos >= 8)
+        {
+            unsigned long long signature = getLE(c, 8);
+
+            if (signature)
+            {
+                printf("*  Signature: 0x%016llx\n", signature);
+            }
+        }
+        printf("*\n");
+        break;
+    case ECRASH_RECORD_HANG:
+    {
+        unsigned int silentMs;
+        unsigned int deadlineMs;
+
+        thread = getLE(c, 8);
+        silentMs = getLE(c, 4);
+        deadlineMs = getLE(c, 4);
+        getStr(c, name, sizeof(name));
+        printf("*  Hang: \"%s\" (0x%llx) sent no heartbeat for %u ms (deadline %u ms)\n*\n", name, thread, silentMs,
+               deadlineMs);
+        break;
+    }
+    case ECRASH_RECORD_THREAD:
+        thread = getLE(c, 8);
+        flags = getLE(c, 1);
+        getStr(c, name, sizeof(name));
+        if (flags & ECRASH_THREAD_OFFENDING)
+        {
+            printf("*  Offending Thread's Backtrace:\n*\n");
+        }
+        else if (flags & ECRASH_THREAD_CAPTURED)
+        {
+            printf("*  Backtrace of \"%s\" (0x%llx)\n", name, thread);
+        }
+        else
+        {
+            printf("*  Error: unable to get backtrace of \"%s\" (0x%llx)\n", name, thread);
+        }
+        *section = SECTION_THREAD;
+        break;
+    case ECRASH_RECORD_FRAMES:
+        count = getLE(c, 4);
+        if (c->bad || c->len - c->pos < (size_t)count * 8)
+        {
+            return -1;
+        }
+        pcs = malloc(sizeof(*pcs) * (count + 1));
+        for (i = 0 ; i < count ; i++)
+        {
+            pcs[i] = getLE(c, 8);
+        }
+        printFrames(pcs, count);
+        free(pcs);
+        break;
+    case ECRASH_RECORD_BREADCRUMBS:
+        count = getLE(c, 4);
+        printf("*    Breadcrumbs (oldest first):\n");
+        for (i = 0 ; i < count && !c->bad ; i++)
+        {
+            long long age = (long long)getLE(c, 8);
+            unsigned int id = getLE(c, 4);
+            unsigned long long arg = getLE(c, 8);
+
+            printf("*      %lld.%03lld ms %s: id %u, arg 0x%llx\n", llabs(age) / 1000000, (llabs(age) / 1000) % 1000,
+                   age < 0 ? "after" : "before", id, arg);
+        }
+        break;
+    case ECRASH_RECORD_ANNOTATION:
+        if (*section == SECTION_THREAD)
+        {
+            printf("*    Annotations:\n");
+            *section = SECTION_THREAD_ANNOTATIONS;
+        }
+        else if (*section == SECTION_NONE)
+        {
+            printf("*  Annotations:\n");
+            *section = SECTION_ANNOTATIONS;
+        }
+        getStr(c, name, sizeof(name));
+        printf("%s%s: ", *section == SECTION_ANNOTATIONS ? "*    " : "*      ", name);
+        getStr(c, name, sizeof(name));
+        printf("%s\n", name);
+        break;
+    case ECRASH_RECORD_COUNTER:
+        if (*section != SECTION_COUNTERS)
+        {
+            printf("*  Counters:\n");
+            *section = SECTION_COUNTERS;
+        }
+        getStr(c, name, sizeof(name));
+        printf("*    %s: %llu\n", name, getLE(c, 8));
+        break;
+    case ECRASH_RECORD_SCHED:
+    {
+        int state = getLE(c, 1);
+        int spinning = getLE(c, 1);
+        int cpu = (int)getLE(c, 4);
+        unsigned long long userMs = getLE(c, 8);
+        unsigned long long systemMs = getLE(c, 8);
+        unsigned long long voluntary = getLE(c, 8);
+
+        printf("*    State %c%s, cpu %d, %llu.%03llu s user, %llu.%03llu s system, %llu voluntary / %llu involuntary "
+               "switches\n", state, spinning ? " (spinning)" : "", cpu, userMs / 1000, userMs % 1000,
+               systemMs / 1000, systemMs % 1000, voluntary, getLE(c, 8));
+        break;
+    }
+    case ECRASH_RECORD_MEMORY:
+    {
+        unsigned long long address;
+        unsigned int length;
+        unsigned int j;
+
+        getStr(c, name, sizeof(name));
+        address = getLE(c, 8);
+        length = getLE(c, 4);
+        if (c->bad || length > c->len - c->pos)
+        {
+            return -1;
+        }
+        if (length == 0)
+        {
+            printf("*    Memory (%s) at 0x%llx: unreadable\n", name, address);
+            break;
+        }
+
+        printf("*    Memory (%s) at 0x%llx: %u bytes\n", name, address, length);
+        for (i = 0 ; i < (int)length ; i += 16)
+        {
+            printf("*      %016llx:", address + i);
+            for (j = i ; j < (unsigned int)i + 16 ; j++)
+            {
+                if (j < length)
+                {
+                    printf(" %02x", c->data[c->pos + j]);
+                }
+                else
+                {
+                    printf("   ");
+                }
+            }
+            printf("  |");
+            for (j = i ; j < (unsigned int)i + 16 && j < length ; j++)
+            {
+                putchar(c->data[c->pos + j] >= 0x20 && c->data[c->pos + j] < 0x7f ? c->data[c->pos + j] : '.');
+            }
+            printf("|\n");
+        }
+        c->pos += length;
+        break;
+    }
+    case ECRASH_RECORD_REPEAT:
+    {
+        unsigned int occurrence = getLE(c, 4);
+
+        printf("*  Crash loop: occurrence %u in %u s, full report skipped\n", occurrence,
+               (unsigned int)getLE(c, 4));
+        break;
+    }
+    case ECRASH_RECORD_CORE:
+    {
+        unsigned int filter = getLE(c, 4);
+
+        if (filter)
+        {
+            printf("*  Core dump filter: 0x%x\n", filter);
+        }
+        count = getLE(c, 4);
+        if (count)
+        {
+            printf("*  Excluded from core dumps:\n");
+        }
+        for (i = 0 ; i < count && !c->bad ; i++)
+        {
+            unsigned long long start = getLE(c, 8);
+            unsigned long long length = getLE(c, 8);
+
+            getStr(c, name, sizeof(name));
+            printf("*    %s: 0x%llx-0x%llx (%llu KB)\n", name, start, start + length, length / 1024);
+        }
+        printf("*\n");
+        break;
+    }
+    case ECRASH_RECORD_RESOURCES:
+    {
+        unsigned long long rss = getLE(c, 8);
+        unsigned long long peak = getLE(c, 8);
+        unsigned long long virt = getLE(c, 8);
+        unsigned long long major = getLE(c, 8);
+        unsigned long long minor = getLE(c, 8);
+        unsigned int fds = getLE(c, 4);
+        unsigned long long fdLimit = getLE(c, 8);
+        unsigned int threads = getLE(c, 4);
+        unsigned int mappings = getLE(c, 4);
+        unsigned int anonMappings = getLE(c, 4);
+        unsigned long long anonKb = getLE(c, 8);
+        unsigned int omitted = getLE(c, 4);
+
+        printf("*  Resources:\n"
+               "*    RSS: %llu KB (peak %llu KB), %llu KB virtual\n"
+               "*    Page faults: %llu major, %llu minor\n", rss, peak, virt, major, minor);
+        if (fdLimit)
+        {
+            printf("*    File descriptors: %u of %llu\n", fds, fdLimit);
+        }
+        else
+        {
+            printf("*    File descriptors: %u (no limit)\n", fds);
+        }
+        printf("*    Threads: %u\n"
+               "*    Mappings: %u, %u anonymous (%llu KB)\n", threads, mappings, anonMappings, anonKb);
+        count = getLE(c, 4);
+        for (i = 0 ; i < count && !c->bad ; i++)
+        {
+            unsigned long long start = getLE(c, 8);
+            unsigned long long end = getLE(c, 8);
+
+            getStr(c, name, sizeof(name));
+            printf("*      0x%llx-0x%llx (%llu KB) %s\n", start, end, (end - start) / 1024, name);
+        }
+        if (omitted)
+        {
+            printf("*      ... and %u more files\n", omitted);
+        }
+        printf("*\n");
+        break;
+    }
+    case ECRASH_RECORD_HISTOGRAM:
+    {
+        unsigned long long buckets[ECRASH_HISTOGRAM_BUCKETS] = { 0 };
+        unsigned long long samples = 0;
+        int b;
+
+        if (*section != SECTION_HISTOGRAMS)
+        {
+            printf("*  Histograms:\n");
+            *section = SECTION_HISTOGRAMS;
+        }
+        getStr(c, name, sizeof(name));
+        count = getLE(c, 4);
+        for (i = 0 ; i < count && !c->bad ; i++)
+        {
+            b = getLE(c, 1) % ECRASH_HISTOGRAM_BUCKETS;
+            buckets[b] = getLE(c, 8);
+            samples += buckets[b];
+        }
+
+        if (samples == 0)
+        {
+            printf("*    %s: no samples\n", name);
+            break;
+        }
+        printf("*    %s: %llu samples, p50 < %llu, p90 < %llu, p99 < %llu, max < %llu\n", name, samples,
+               histogramPercentile(buckets, samples, 50), histogramPercentile(buckets, samples, 90),
+               histogramPercentile(buckets, samples, 99), histogramPercentile(buckets, samples, 100));
+        for (b = 0 ; fullReport && b < ECRASH_HISTOGRAM_BUCKETS ; b++)
+        {
+            if (buckets[b])
+            {
+                printf("*      [%llu, %llu): %llu\n", b ? 1ULL << b : 0ULL, histogramBucketEnd(b), buckets[b]);
+            }
+        }
+        break;
+    }
+    case ECRASH_RECORD_DROPPED:
+    {
+        int fd = getLE(c, 4);
+        int failures = getLE(c, 4);
+        int timedOut = getLE(c, 1);
+
+        getStr(c, name, sizeof(name));
+        printf("*  Note: output %s (fd %d) dropped: %s after %d failure(s)\n", name, fd,
+               timedOut ? "timed out" : "write error", failures);
+        break;
+    }
+    case ECRASH_RECORD_OUTPUTS:
+        count = getLE(c, 4);
+        printf("*  Outputs:\n");
+        for (i = 0 ; i < count && !c->bad ; i++)
+        {
+            int fd = getLE(c, 4);
+            int dropped = getLE(c, 1);
+            unsigned long long bytes = getLE(c, 8);
+            long long ns = getLE(c, 8);
+
+            getStr(c, name, sizeof(name));
+            printf("*    %-8s fd %d: %llu bytes in %lld.%03lld ms%s\n", name, fd, bytes, ns / 1000000,
+                   (ns / 1000) % 1000, dropped ? " (dropped)" : "");
+        }
+        /* Missing from older records */
+        if (!c->bad && c->len - c->pos >= 8 + 1)
+        {
+            long long ns = getLE(c, 8);
+
+            printf("*  Dumped in %lld.%03lld ms, then %s\n", ns / 1000000, (ns / 1000) % 1000,
+                   eCrash_DispositionName(getLE(c, 1)));
+        }
+        break;
+    case ECRASH_RECORD_END:
+        printf("*\n" BANNER);
+        break;
+    default:
+        /* Newer than us: skip it, the CRC says it is intact */
+        break;
+    }
+
+    return c->bad ? -1 : 0;
+}
+
+/***
+ * Decode a buffer holding one or more records
+ *
+ * @param name What to call it in messages
+ * @param data The bytes
+ * @param len  Number of bytes
+ *
+ * @returns zero if every record was complete, 2 if one was torn
+ */
+static int decode(const char *name, const unsigned char *data, size_t len)
+{
+    size_t pos = 0;
+    int inRecord = 0;
+    Section section = SECTION_NONE;
+    const char *why = NULL;
+
+    while (pos < len)
+    {
+        Cursor header = { data + pos, len - pos, 0, 0 };
+        int type = getLE(&header, 2);
+        size_t payloadLen = getLE(&header, 4);
+        size_t frameLen = ECRASH_RECORD_FRAME_HEADER_LEN + payloadLen + ECRASH_RECORD_FRAME_TRAILER_LEN;
+        Cursor payload;
+        Cursor trailer;
+        size_t i;
+
+        /* Zeros after a complete record are padding (as in a crash record file) */
+        if (!inRecord && type == 0)
+        {
+            for (i = pos ; i < len && data[i] == 0 ; i++)
+            {
+            }
+            if (i == len)
+            {
+                break;
+            }
+        }
+
+        if (header.bad || payloadLen > ECRASH_RECORD_MAX_PAYLOAD || frameLen > len - pos)
+        {
+            why = "incomplete frame";
+            break;
+        }
+
+        trailer = (Cursor){ data + pos + frameLen - ECRASH_RECORD_FRAME_TRAILER_LEN, 4, 0, 0 };
+        if (getLE(&trailer, 4) != eCrashRecord_Crc32(0, data + pos, frameLen - ECRASH_RECORD_FRAME_TRAILER_LEN))
+        {
+            why = "bad CRC";
+            break;
+        }
+
+        if (!inRecord && type != ECRASH_RECORD_START)
+        {
+            why = "not an eCrash record";
+            break;
+        }
+
+        payload = (Cursor){ data + pos + ECRASH_RECORD_FRAME_HEADER_LEN, payloadLen, 0, 0 };
+        if (printFrame(type, &payload, &section) != 0)
+        {
+            why = "malformed frame";
+            break;
+        }
+
+        inRecord = (type != ECRASH_RECORD_END);
+        pos += frameLen;
+    }
+
+    if (why == NULL && !inRecord)
+    {
+        return 0;
+    }
+
+    if (section != SECTION_NONE)
+    {
+        printf("*\n");
+    }
+    printf("*  Note: %s: record torn at byte %zu (%s)\n", name, pos, why ? why : "no end frame");
+    return 2;
+}
+
+/***
+ * A growing output buffer, for decompressed data
+ */
+typedef struct
+{
+    unsigned char *data;
+    size_t len;
+    size_t size;
+} Output;
+
+static void outputReserve(Output *out, size_t more)
+{
+    while (out->len + more > out->size)
+    {
+        out->size = out->size ? out->size * 2 : 65536;
+        out->data = realloc(out->data, out->size);
+        if (out->data == NULL)
+        {
+            perror("realloc");
+            exit(1);
+        }
+    }
+}
+
+/***
+ * Get an LZ length extension (see eCrashRecord.h)
+ */
+static size_t getLzLength(Cursor *c, size_t len)
+{
+    unsigned int extra;
+
+    do
+    {
+        extra = getLE(c, 1);
+        len += extra;
+    } while (extra == 255 && !c->bad);
+
+    return len;
+}
+
+/***
+ * Decompress one LZ block, appending to everything decompressed so far
+ *
+ * @param c   Cursor over the block payload
+ * @param out Decompressed data (matches may reach back into it)
+ *
+ * @returns zero, or -1 if the block does not decompress
+ */
+static int inflateBlock(Cursor *c, Output *out)
+{
+    size_t rawLen = getLE(c, 4);
+    size_t start = out->len;
+
+    outputReserve(out, rawLen);
+    while (!c->bad && c->pos < c->len)
+    {
+        int token = getLE(c, 1);
+        size_t litLen = token >> 4;
+        size_t offset;
+        size_t matchLen;
+
+        if (litLen == 15)
+        {
+            litLen = getLzLength(c, litLen);
+        }
+        if (c->bad || litLen > c->len - c->pos || out->len + litLen > start + rawLen)
+        {
+            return -1;
+        }
+        memcpy(out->data + out->len, c->data + c->pos, litLen);
+        out->len += litLen;
+        c->pos += litLen;
+
+        /* The last sequence has no match */
+        if (c->pos == c->len)
+        {
+            break;
+        }
+
+        offset = getLE(c, 2);
+        matchLen = token & 15;
+        if (matchLen == 15)
+        {
+            matchLen = getLzLength(c, matchLen);
+        }
+        matchLen += ECRASH_LZ_MIN_MATCH;
+        if (c->bad || offset == 0 || offset > out->len || out->len + matchLen > start + rawLen)
+        {
+            return -1;
+        }
+
+        /* Byte by byte: matches may overlap what they produce */
+        while (matchLen--)
+        {
+            out->data[out->len] = out->data[out->len - offset];
+            out->len++;
+        }
+    }
+
+    return (c->bad || out->len != start + rawLen) ? -1 : 0;
+}
+
+/***
+ * Decompress a compressed output
+ *
+ * @param data The compressed bytes
+ * @param len  Number of bytes
+ * @param out  Where to put the decompressed data
+ * @param pos  Set to how much of the input was good
+ *
+ * @returns NULL if it all decompressed, or why it stopped
+ */
+static const char *inflateStream(const unsigned char *data, size_t len, Output *out, size_t *pos)
+{
+    *pos = 0;
+    while (*pos < len)
+    {
+        Cursor header = { data + *pos, len - *pos, 0, 0 };
+        int type = getLE(&header, 2);
+        size_t payloadLen = getLE(&header, 4);
+        size_t frameLen = ECRASH_RECORD_FRAME_HEADER_LEN + payloadLen + ECRASH_RECORD_FRAME_TRAILER_LEN;
+        Cursor payload;
+        Cursor trailer;
+
+        if (header.bad || payloadLen > ECRASH_RECORD_MAX_PAYLOAD || frameLen > len - *pos)
+        {
+            return "incomplete block";
+        }
+
+        trailer = (Cursor){ data + *pos + frameLen - ECRASH_RECORD_FRAME_TRAILER_LEN, 4, 0, 0 };
+        if (getLE(&trailer, 4) != eCrashRecord_Crc32(0, data + *pos, frameLen - ECRASH_RECORD_FRAME_TRAILER_LEN))
+        {
+            return "bad CRC";
+        }
+
+        payload = (Cursor){ data + *pos + ECRASH_RECORD_FRAME_HEADER_LEN, payloadLen, 0, 0 };
+        if (type != ECRASH_RECORD_LZ_BLOCK || inflateBlock(&payload, out) != 0)
+        {
+            return "malformed block";
+        }
+
+        *pos += frameLen;
+    }
+
+    return NULL;
+}
+
+/***
+ * Decode whatever an output wrote: records, text or JSON, compressed
+ * or not (text and JSON are printed as they are)
+ *
+ * @param name What to call it in messages
+ * @param data The bytes
+ * @param len  Number of bytes
+ *
+ * @returns zero if it was complete, 2 if it was torn
+ */
+static int decodeOutput(const char *name, const unsigned char *data, size_t len)
+{
+    Output out = { NULL, 0, 0 };
+    const char *why;
+    size_t pos;
+    int rc = 0;
+
+    if (len >= 2 && data[0] == ECRASH_RECORD_START && data[1] == 0)
+    {
+        return decode(name, data, len);
+    }
+    if (len < 2 || data[0] != ECRASH_RECORD_LZ_BLOCK || data[1] != 0)
+    {
+        /* A text or JSON output */
+        fwrite(data, 1, len, stdout);
+        return 0;
+    }
+
+    why = inflateStream(data, len, &out, &pos);
+    if (out.len >= 2 && out.data[0] == ECRASH_RECORD_START && out.data[1] == 0)
+    {
+        rc = decode(name, out.data, out.len);
+    }
+    else
+    {
+        /* A compressed text or JSON output */
+        fwrite(out.data, 1, out.len, stdout);
+    }
+    free(out.data);
+
+    if (why)
+    {
+        printf("*  Note: %s: compressed stream torn at byte %zu (%s)\n", name, pos, why);
+        rc = 2;
+    }
+
+    return rc;
+}
+
+/***
+ * A slot log entry
+ */
+typedef struct
+{
+    int slot;
+    unsigned long long seq;
+    unsigned long long length;
+    unsigned int pid;
+    unsigned int state;
+} SlotEntry;
+
+static int slotCompare(const void *a, const void *b)
+{
+    const SlotEntry *x = a;
+    const SlotEntry *y = b;
+
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+/***
+ * Decode every report in a slot log, oldest first
+ *
+ * @param name What to call it in messages
+ * @param data The whole log
+ * @param len  Number of bytes
+ *
+ * @returns zero if every report was complete, 2 if one was torn
+ */
+static int decodeSlotLog(const char *name, const unsigned char *data, size_t len)
+{
+    static const char *states[] = { "empty", "torn", "complete", "truncated" };
+    SlotEntry entries[ECRASH_SLOTLOG_MAX_SLOTS];
+    Cursor header = { data, len, 0, 0 };
+    unsigned long long slotSize;
+    int slots;
+    int rc = 0;
+    int i;
+
+    getLE(&header, 4);
+    if (getLE(&header, 4) != ECRASH_SLOTLOG_VERSION)
+    {
+        fprintf(stderr, "%s: unsupported slot log version\n", name);
+        return 1;
+    }
+    slots = getLE(&header, 4);
+    getLE(&header, 4);
+    slotSize = getLE(&header, 8);
+    if (header.bad || slots > ECRASH_SLOTLOG_MAX_SLOTS || len < ECRASH_SLOTLOG_HEADER_SIZE)
+    {
+        fprintf(stderr, "%s: bad slot log header\n", name);
+        return 1;
+    }
+
+    for (i = 0 ; i < slots ; i++)
+    {
+        Cursor entry = { data + ECRASH_SLOTLOG_ENTRIES + i * ECRASH_SLOTLOG_ENTRY_SIZE, ECRASH_SLOTLOG_ENTRY_SIZE, 0, 0 };
+
+        entries[i].slot = i;
+        entries[i].seq = getLE(&entry, 8);
+        entries[i].length = getLE(&entry, 8);
+        entries[i].pid = getLE(&entry, 4);
+        entries[i].state = getLE(&entry, 4);
+    }
+    qsort(entries, slots, sizeof(SlotEntry), slotCompare);
+
+    for (i = 0 ; i < slots ; i++)
+    {
+        SlotEntry *e = &entries[i];
+        size_t offset = ECRASH_SLOTLOG_HEADER_SIZE + e->slot * slotSize;
+
+        if (e->state == ECRASH_SLOT_EMPTY)
+        {
+            continue;
+        }
+        if (e->state == ECRASH_SLOT_WRITING)
+        {
+            /* We never got the length: take the whole slot, decoding stops at the tear */
+            e->length = slotSize;
+        }
+        if (offset + e->length > len)
+        {
+            e->length = (offset < len) ? len - offset : 0;
+        }
+
+        printf("=== %s: slot %d, report %llu, pid %u, %llu bytes (%s)\n", name, e->slot, e->seq, e->pid, e->length,
+               states[e->state < 4 ? e->state : 0]);
+        if (decodeOutput(name, data + offset, e->length) != 0 || e->state != ECRASH_SLOT_COMPLETE)
+        {
+            rc = 2;
+        }
+    }
+
+    return rc;
+}
+
+#define USAGE "USAGE: %s [options] [record file ...]\n\
+   Decodes eCrash binary records and slot logs, and decompresses\n\
+   compressed outputs\n\
+   (standard input if no file is given).\n\
+   Where options are one or more of:\n\
+      -f,--full                        Print every frame (don't collapse cycles)\n\
+                                       and histogram bucket\n\
+      -h,-?,--help                     This message\n\n"
+
+int main(int argc, char *argv[])
+{
+    static struct option long_options[] = {
+        {"full", no_argument, &fullReport, 1},
+        {"help", no_argument, 0,           'h'},
+        {0,      0,           0,           0},
+    };
+    int rc = 0;
+    int c;
+    int i;
+
+    while ((c = getopt_long(argc, argv, "fh?", long_options, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 0:
+            break;
+        case 'f':
+            fullReport = 1;
+            break;
+        default:
+            printf(USAGE, argv[0]);
+            return 1;
+        }
+    }
+
+    for (i = optind ; i < argc || i == optind ; i++)
+    {
+        const char *name = (i < argc) ? argv[i] : "(stdin)";
+        FILE *f = (i < argc) ? fopen(argv[i], "rb") : stdin;
+        unsigned char *data = NULL;
+        size_t len = 0;
+        size_t size = 0;
+        size_t got;
+
+        if (f == NULL)
+        {
+            perror(name);
+            rc = 1;
+            continue;
+        }
+
+        do
+        {
+            if (len == size)
+            {
+                size = size ? size * 2 : 65536;
+                data = realloc(data, size);
+                if (data == NULL)
+                {
+                    perror("realloc");
+                    return 1;
+                }
+            }
+            got = fread(data + len, 1, size - len, f);
+            len += got;
+        } while (got > 0);
+
+        if (f != stdin)
+        {
+            fclose(f);
+        }
+
+        if (len >= 4 && getLE(&(Cursor){ data, len, 0, 0 }, 4) == ECRASH_SLOTLOG_MAGIC)
+        {
+            if (decodeSlotLog(name, data, len) != 0 && rc == 0)
+            {
+                rc = 2;
+            }
+        }
+        else if (decodeOutput(name, data, len) != 0 && rc == 0)
+        {
+            rc = 2;
+        }
+        free(data);
+    }
+
+    return rc;
+}
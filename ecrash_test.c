@@ -9,13 +9,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <getopt.h>
+#include <string.h>
 #include <strings.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <pthread.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include "eCrash.h"
 
 
@@ -29,12 +32,39 @@ static int secondsBeforeCrash = 3;
 static int threadToCrash = 0;
 static int unsafeBacktrace = 0;
 static int useSymbolTable = 0;
+static int recursionDepth = 0;
+static int stackDepth = 0;
+static int useMemfd = 0;
+static int structured = 0;
+static int compress = 0;
+static int slotLogSlots = 0;
+static char *blackBoxDir = NULL;
+static char *crashRecordFile = NULL;
+static int disposition = 0;
+static int minimalCore = 0;
+static char *crashLoopFile = NULL;
+static int spin = 0;
+static int resources = 0;
+static int liveDumps = 0;
+static int dumpSignal = 0;
+static char *dumpSocket = NULL;
+static int freezeNaps = 0;
+static int hangAbort = 0;
+static int profileHz = 0;
+static int wallSampleMs = 0;
+static int afterUninit = 0;
+static int stalledPipe = 0;
+
+/* Metric ids */
+static int napCounter = -1;
+static int napHistogram = -1;
 
 typedef struct
 {
     int threadNumber;
     int secondsBeforeCrash;
     int threadToCrash;
+    int recursionDepth;
     int signo;
 } eCrashTestParams;
 
@@ -47,9 +77,12 @@ void BuildSymbolTable(eCrashSymbolTable *table);
 void sleepFuncA(char *name);
 void sleepFuncB(char *name);
 void sleepFuncC(char *name);
+void spinFunc(char *name);
 void crashA(char *name);
 void crashB(char *name);
 void crashC(char *name);
+int parse_expr(char *name, int depth);
+int parse_term(char *name, int depth);
 
 eCrashSymbol symbols[] = {{"main",               (void *)main},
                           {"parseArguments",     (void *)parseArguments},
@@ -62,16 +95,152 @@ eCrashSymbol symbols[] = {{"main",               (void *)main},
                           {"crashA",             (void *)crashA},
                           {"crashB",             (void *)crashB},
                           {"crashC",             (void *)crashC},
+                          {"parse_expr",         (void *)parse_expr},
+                          {"parse_term",         (void *)parse_term},
 };
 
 /* some nested functions to make things prettier */
 void sleepFuncC(char *name)
 {
+    struct timespec start;
+    struct timespec end;
+    int naps = 0;
+
     printf("%s: Sleeping forever. . .\n", name);
     fflush(stdout);
     for (;;)
     {
+        /* Keep our black box stack fresh, and leave a trail */
+        eCrash_Snapshot();
+        eCrash_Breadcrumb(1, naps++);
+        if (freezeNaps == 0 || naps <= freezeNaps || strcmp(name, "Thread 1") != 0)
+        {
+            eCrash_Heartbeat();
+        }
+        clock_gettime(CLOCK_MONOTONIC, &start);
         sleep(1);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        eCrash_CounterAdd(napCounter, 1);
+        eCrash_HistogramRecord(napHistogram, (end.tv_sec - start.tv_sec) * 1000000 +
+                                             (end.tv_nsec - start.tv_nsec) / 1000);
+    }
+}
+
+/* For the after uninit check: registered, Uninit, then everything else */
+static pthread_barrier_t uninitBarrier;
+
+void *afterUninitThread(void *arg)
+{
+    int *failures = arg;
+
+    eCrash_RegisterThread("After uninit", 0);
+    eCrash_Breadcrumb(1, 1);
+    eCrash_Heartbeat();
+    eCrash_CounterAdd(napCounter, 1);
+    pthread_barrier_wait(&uninitBarrier);
+
+    /* eCrash_Uninit has run: these must all be no-ops, or fail cleanly */
+    pthread_barrier_wait(&uninitBarrier);
+    eCrash_Breadcrumb(1, 2);
+    eCrash_Heartbeat();
+    eCrash_CounterAdd(napCounter, 1);
+    eCrash_HistogramRecord(napHistogram, 100);
+    *failures += eCrash_SetThreadAnnotation("role", "zombie") != -1;
+    *failures += eCrash_SetHeartbeatDeadline(1000) != -1;
+    *failures += eCrash_Snapshot() != -1;
+    *failures += eCrash_UnregisterThread() != -1;
+
+    return NULL;
+}
+
+/***
+ * Check that a thread still registered when eCrash_Uninit runs can go
+ * on calling eCrash
+ *
+ * @returns zero if it could
+ */
+int afterUninitCheck(void)
+{
+    pthread_t thread;
+    int failures = 0;
+
+    pthread_barrier_init(&uninitBarrier, NULL, 2);
+    pthread_create(&thread, NULL, afterUninitThread, &failures);
+    pthread_barrier_wait(&uninitBarrier);
+    printf("eCrash_Uninit = %d\n", eCrash_Uninit());
+    pthread_barrier_wait(&uninitBarrier);
+    pthread_join(thread, NULL);
+
+    printf("After uninit: %s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
+
+/***
+ * Make a blocking pipe nobody reads, already full
+ *
+ * @returns its write end, or -1
+ */
+int fullPipe(void)
+{
+    char junk[4096];
+    int fds[2];
+    int flags;
+
+    if (pipe(fds) != 0)
+    {
+        return -1;
+    }
+    memset(junk, 'x', sizeof(junk));
+    flags = fcntl(fds[1], F_GETFL);
+    fcntl(fds[1], F_SETFL, flags | O_NONBLOCK);
+    while (write(fds[1], junk, sizeof(junk)) > 0)
+    {
+    }
+    fcntl(fds[1], F_SETFL, flags);
+
+    /* The read end stays open (and unread) for good */
+    return fds[1];
+}
+
+/***
+ * Check live dumps get past a stalled output, and keep doing so
+ *
+ * @returns zero if they did
+ */
+int stalledPipeCheck(void)
+{
+    struct timespec start;
+    struct timespec end;
+    int failures = 0;
+    long long ms;
+    int rc;
+    int i;
+
+    for (i = 0 ; i < 2 ; i++)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        rc = eCrash_DumpNow(ECRASH_DUMP_ALL_SINKS);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        ms = (end.tv_sec - start.tv_sec) * 1000LL + (end.tv_nsec - start.tv_nsec) / 1000000;
+        printf("Live dump %d returned %d after %lld ms\n", i + 1, rc, ms);
+        failures += (rc != 0 || ms > 1000);
+    }
+
+    printf("Stalled pipe: %s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
+
+/* A thread stuck in a busy loop, for the spinning flag */
+void spinFunc(char *name)
+{
+    volatile unsigned long spins = 0;
+
+    printf("%s: Spinning forever. . .\n", name);
+    fflush(stdout);
+    for (;;)
+    {
+        spins++;
     }
 }
 
@@ -89,6 +258,7 @@ void sleepFuncA(char *name)
 void crashC(char *name)
 {
     int *kaBoom = NULL;
+    eCrash_Breadcrumb(2, (unsigned long)kaBoom);
     printf("%s: kaBoom\n", name);
     fflush(stdout);
     *kaBoom = 7;
@@ -104,25 +274,57 @@ void crashA(char *name)
     crashB(name);
 }
 
+/* A pair of mutually recursive functions, to make a deep, repeating stack */
+int parse_term(char *name, int depth)
+{
+    if (depth <= 0)
+    {
+        crashA(name);
+        return 0;
+    }
+
+    return parse_expr(name, depth - 1) + 1;
+}
+
+int parse_expr(char *name, int depth)
+{
+    return parse_term(name, depth - 1) + 1;
+}
+
 void *ecrash_test_thread(void *vparams)
 {
     eCrashTestParams *params = (eCrashTestParams *)vparams;
     char threadName[256];
+    struct timespec until;
 
     /* Set up our name */
     sprintf(threadName, "Thread %d", params->threadNumber);
 
     /* Register for tracing */
     eCrash_RegisterThread(threadName, params->signo);
+    eCrash_SetThreadAnnotation("role", params->threadToCrash == params->threadNumber ? "crasher" : "sleeper");
 
     /* Sleep & crash, or just sleep */
     if (params->threadToCrash == params->threadNumber)
     {
         printf("%s: Sleeping %d seconds before crash\n", threadName, params->secondsBeforeCrash);
         fflush(stdout);
-        sleep(params->secondsBeforeCrash);
+        /* A live dump's (or wall clock sample's) backtrace signal cuts a sleep short: finish it */
+        clock_gettime(CLOCK_MONOTONIC, &until);
+        until.tv_sec += params->secondsBeforeCrash;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) != 0)
+        {
+        }
+        if (params->recursionDepth)
+        {
+            parse_expr(threadName, params->recursionDepth);
+        }
         crashA(threadName);
     }
+    else if (spin)
+    {
+        spinFunc(threadName);
+    }
     else
     {
         sleepFuncA(threadName);
@@ -141,6 +343,7 @@ int CreateAThread(int i)
     parms->threadNumber = i;
     parms->secondsBeforeCrash = secondsBeforeCrash;
     parms->threadToCrash = threadToCrash + 1;
+    parms->recursionDepth = recursionDepth;
     parms->signo = 0; /* will force default */
 
     return pthread_create(&thread, NULL, ecrash_test_thread, (void *)parms);
@@ -178,6 +381,36 @@ void BuildSymbolTable(eCrashSymbolTable *table)
       -n,--num_threads <num>           Number of threads to spawn (0 default)\n\
       -s,--seconds_before_crash <num>  Seconds to wait before crashing\n\
       -t,--thread_to_crash <num>       Thread to crash (default = last one)\n\
+      -r,--recursion_depth <num>       Recurse this deep before crashing\n\
+      -d,--stack_depth <num>           Maximum backtrace depth\n\
+      -m,--use_memfd                   Assemble the report in a memfd\n\
+      -j,--structured                  Also write JSON and binary reports\n\
+      -z,--compress                    Compress the JSON and binary reports\n\
+      -l,--slot_log <num>              Also keep reports in a log of <num> slots\n\
+      -b,--black_box <dir>             Keep a black box in <dir> (try kill -9)\n\
+      -p,--crash_record <file>         Write the phase one crash record to <file>\n\
+      -e,--disposition <num>           After the dump: 1 exit, 2 _exit, 3 re-raise,\n\
+                                       4 chain (default 1)\n\
+      -k,--minimal_core                Minimal core filter, less a 64MB cache\n\
+      -o,--crash_loop <file>           Detect crash loops, with state in <file>\n\
+      -w,--spin                        The other threads spin instead of sleeping\n\
+      -u,--resources                   Add the process resource section\n\
+      -i,--live_dumps <num>            Main thread takes <num> live dumps, one a\n\
+                                       second, while the others wait to crash\n\
+      -g,--dump_signal <signo>         Take a live dump on this signal\n\
+      -a,--dump_socket <name>          Take a live dump on a datagram to this\n\
+                                       abstract unix socket\n\
+      -f,--freeze <num>                Thread 1 stops its heartbeats after <num>\n\
+                                       naps: the watchdog dumps it 2 s later\n\
+      -y,--hang_abort                  And then aborts it\n\
+      -U,--after_uninit                Check a registered thread can still call\n\
+                                       eCrash once eCrash_Uninit has run, then exit\n\
+      -S,--stalled_pipe                Check live dumps give up on a full pipe\n\
+                                       (as the fd output) in time, then exit\n\
+      -P,--profile <hz>                Profile the CPU at <hz>, into\n\
+                                       eCrash.out.folded\n\
+      -W,--wall_sample <ms>            Sample every thread's stack and state\n\
+                                       every <ms>, into eCrash.out.wall.folded\n\
       -x,--use_unsafe_backtrace        Use unsafe backtrace_symbols\n\
       -c,--use_symbol_table            Use safe custom symbol table.\n\
       -h,-?,--help                     This message\n\n"
@@ -195,15 +428,37 @@ int parseArguments(int argc, char *argv[])
             {"quiet",                no_argument,       &verbose,         0},
             {"use_unsafe_backtrace", no_argument,       &unsafeBacktrace, 1},
             {"use_symbol_table",     no_argument,       &useSymbolTable,  1},
+            {"use_memfd",            no_argument,       &useMemfd,        1},
+            {"structured",           no_argument,       &structured,      1},
+            {"compress",             no_argument,       &compress,        1},
+            {"minimal_core",         no_argument,       &minimalCore,     1},
+            {"spin",                 no_argument,       &spin,            1},
+            {"resources",            no_argument,       &resources,       1},
+            {"hang_abort",           no_argument,       &hangAbort,       1},
+            {"after_uninit",         no_argument,       &afterUninit,     1},
+            {"stalled_pipe",         no_argument,       &stalledPipe,     1},
             /* These options set values, so they have flags */
             {"num_threads",          required_argument, 0,                'n'},
             {"seconds_before_crash", required_argument, 0,                's'},
             {"thread_to_crash",      required_argument, 0,                't'},
+            {"recursion_depth",      required_argument, 0,                'r'},
+            {"stack_depth",          required_argument, 0,                'd'},
+            {"slot_log",             required_argument, 0,                'l'},
+            {"black_box",            required_argument, 0,                'b'},
+            {"crash_record",         required_argument, 0,                'p'},
+            {"disposition",          required_argument, 0,                'e'},
+            {"crash_loop",           required_argument, 0,                'o'},
+            {"live_dumps",           required_argument, 0,                'i'},
+            {"dump_signal",          required_argument, 0,                'g'},
+            {"dump_socket",          required_argument, 0,                'a'},
+            {"freeze",               required_argument, 0,                'f'},
+            {"profile",              required_argument, 0,                'P'},
+            {"wall_sample",          required_argument, 0,                'W'},
             {"help",                 required_argument, 0,                'h'},
         };
         int option_index = 0;
 
-        c = getopt_long(argc, argv, "cvqxn:s:t:h?", long_options, &option_index);
+        c = getopt_long(argc, argv, "cvqxmjzkwuyUSn:s:t:r:d:l:b:p:e:o:i:g:a:f:P:W:h?", long_options, &option_index);
         if (c == -1)
         {
             break;
@@ -227,12 +482,78 @@ int parseArguments(int argc, char *argv[])
         case 't':
             threadToCrash = atol(optarg);
             break;
+        case 'r':
+            recursionDepth = atol(optarg);
+            break;
+        case 'd':
+            stackDepth = atol(optarg);
+            break;
+        case 'l':
+            slotLogSlots = atol(optarg);
+            break;
+        case 'b':
+            blackBoxDir = optarg;
+            break;
+        case 'p':
+            crashRecordFile = optarg;
+            break;
+        case 'e':
+            disposition = atol(optarg);
+            break;
+        case 'o':
+            crashLoopFile = optarg;
+            break;
+        case 'i':
+            liveDumps = atol(optarg);
+            break;
+        case 'g':
+            dumpSignal = atol(optarg);
+            break;
+        case 'a':
+            dumpSocket = optarg;
+            break;
+        case 'f':
+            freezeNaps = atol(optarg);
+            break;
+        case 'y':
+            hangAbort = 1;
+            break;
+        case 'U':
+            afterUninit = 1;
+            break;
+        case 'S':
+            stalledPipe = 1;
+            break;
+        case 'P':
+            profileHz = atol(optarg);
+            break;
+        case 'W':
+            wallSampleMs = atol(optarg);
+            break;
         case 'x':
             unsafeBacktrace = 1;
             break;
         case 'c':
             useSymbolTable = 1;
             break;
+        case 'm':
+            useMemfd = 1;
+            break;
+        case 'k':
+            minimalCore = 1;
+            break;
+        case 'w':
+            spin = 1;
+            break;
+        case 'u':
+            resources = 1;
+            break;
+        case 'j':
+            structured = 1;
+            break;
+        case 'z':
+            compress = 1;
+            break;
         case 'v':
             verbose = 1;
             break;
@@ -256,6 +577,8 @@ int parseArguments(int argc, char *argv[])
         printf("          numThreads: %d\n", numThreads);
         printf("  secondsBeforeCrash: %d\n", secondsBeforeCrash);
         printf("       threadToCrash: %d\n", threadToCrash);
+        printf("      recursionDepth: %d\n", recursionDepth);
+        printf("          stackDepth: %d\n", stackDepth);
     }
 
     return 0;
@@ -289,13 +612,87 @@ int main(int argc, char *argv[])
         /* Try again, with a append */
         params.fd = open("eCrash.out.fd", O_WRONLY | O_TRUNC);
     }
+    if (stalledPipe)
+    {
+        close(params.fd);
+        params.fd = fullPipe();
+        params.sinkTimeoutMs = 100;
+    }
+
+    if (structured || slotLogSlots)
+    {
+        eCrashSink *sink = params.sinks;
+
+        /* The same outputs... */
+        sink->type = ECRASH_SINK_FILENAME;
+        sink->filename = params.filename;
+        sink++;
+        sink->type = ECRASH_SINK_FILEP;
+        sink->filep = params.filep;
+        sink++;
+        sink->type = ECRASH_SINK_FD;
+        sink->fd = params.fd;
+        sink++;
+
+        /* ...plus a full JSON report and a binary one */
+        if (structured)
+        {
+            sink->type = ECRASH_SINK_FILENAME;
+            sink->filename = "eCrash.out.json";
+            sink->format = ECRASH_FORMAT_JSON;
+            sink->verbosity = ECRASH_VERBOSITY_FULL;
+            sink->compress = compress;
+            sink++;
+            sink->type = ECRASH_SINK_FILENAME;
+            sink->filename = "eCrash.out.bin";
+            sink->format = ECRASH_FORMAT_BINARY;
+            sink->compress = compress;
+            sink++;
+        }
+
+        /* ...plus a rotating log of binary records */
+        if (slotLogSlots)
+        {
+            sink->type = ECRASH_SINK_FILENAME;
+            sink->filename = "eCrash.out.slots";
+            sink->format = ECRASH_FORMAT_BINARY;
+            sink->compress = compress;
+            sink->slots = slotLogSlots;
+            sink->slotSize = 64 * 1024;
+        }
+    }
 
     if (verbose)
     {
         params.debugLevel = ECRASH_DEBUG_VERBOSE;
     }
     params.dumpAllThreads = true;
+    params.dumpResources = (resources != 0);
+    params.maxStackDepth = stackDepth;
     params.useBacktraceSymbols = unsafeBacktrace;
+    params.useMemfd = useMemfd;
+    params.blackBoxDir = blackBoxDir;
+    params.crashRecordFile = crashRecordFile;
+    params.disposition = disposition;
+    params.crashLoopFile = crashLoopFile;
+    params.dumpSignal = dumpSignal;
+    params.dumpSocket = dumpSocket;
+    params.profileHz = profileHz;
+    params.profileFile = "eCrash.out.folded";
+    params.profileFlushSeconds = 1;
+    params.wallSampleMs = wallSampleMs;
+    params.wallProfileFile = "eCrash.out.wall.folded";
+    if (freezeNaps)
+    {
+        params.hangAction = ECRASH_HANG_DUMP_THREAD;
+        params.heartbeatRoles[0].role = "Thread";
+        params.heartbeatRoles[0].deadlineMs = 2000;
+        params.hangAbort = (hangAbort != 0);
+    }
+    if (minimalCore)
+    {
+        params.coredumpFilter = ECRASH_COREDUMP_FILTER_MINIMAL;
+    }
     if (useSymbolTable)
     {
         params.symbolTable = &symbol_table;
@@ -311,6 +708,27 @@ int main(int argc, char *argv[])
         printf("eCrash_Init returned %d\n", rc);
         exit(rc);
     }
+    eCrash_SetAnnotation("build", __DATE__ " " __TIME__);
+    napCounter = eCrash_RegisterCounter("naps");
+    napHistogram = eCrash_RegisterHistogram("nap length (us)");
+
+    if (minimalCore)
+    {
+        /* A stand-in for a big cache nobody needs in a core */
+        size_t cacheSize = 64 * 1024 * 1024;
+        void *cache = mmap(NULL, cacheSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (cache != MAP_FAILED)
+        {
+            memset(cache, 0x5a, cacheSize);
+            eCrash_ExcludeFromCore(cache, cacheSize, "cache");
+        }
+    }
+
+    if (afterUninit)
+    {
+        return afterUninitCheck();
+    }
 
     if (numThreads)
     {
@@ -320,6 +738,12 @@ int main(int argc, char *argv[])
             CreateAThread(i + 1);
         }
     }
+
+    if (stalledPipe)
+    {
+        sleep(1);
+        return stalledPipeCheck();
+    }
     if (threadToCrash == 0)
     {
         int *badPtr = NULL;
@@ -331,6 +755,11 @@ int main(int argc, char *argv[])
         fflush(stdout);
         sleep(secondsBeforeCrash);
 
+        if (recursionDepth)
+        {
+            parse_expr("main", recursionDepth);
+        }
+
         printf("About to segv!\n");
         fflush(stdout);
         *badPtr = 7;
@@ -342,6 +771,12 @@ int main(int argc, char *argv[])
         for (;;)
         {
             sleep(1);
+            if (liveDumps > 0)
+            {
+                liveDumps--;
+                printf("Thread 0: live dump returned %d\n", eCrash_DumpNow(ECRASH_DUMP_ALL_SINKS));
+                fflush(stdout);
+            }
         }
     }
 